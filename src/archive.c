@@ -0,0 +1,315 @@
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "global.h"
+#include "archive.h"
+#include "inflate.h"
+
+#define GZIP_FLAG_HCRC    (1 << 1)
+#define GZIP_FLAG_EXTRA   (1 << 2)
+#define GZIP_FLAG_NAME    (1 << 3)
+#define GZIP_FLAG_COMMENT (1 << 4)
+
+#define ZIP_METHOD_STORED  0
+#define ZIP_METHOD_DEFLATE 8
+
+#define ZIP_END_RECORD_SIZE 22
+#define ZIP_MAX_COMMENT_SIZE 0xFFFF
+
+static FILE *archiveFile;  // NULL if no archive is open
+static bool isStored;      // The image is stored without compression
+static size_t imageSize;
+static uint32_t imageCrc;  // CRC-32 the image should have
+static uint32_t crc;       // CRC-32 of the image up to extractedSize
+static size_t extractedSize;
+static struct Inflater *inflater;
+
+static uint16_t get_le16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint32_t update_crc(uint32_t crc, const uint8_t *data, size_t size)
+{
+    static uint32_t table[256];
+    
+    if (table[1] == 0)
+    {
+        for (unsigned int i = 0; i < 256; i++)
+        {
+            uint32_t c = i;
+            
+            for (int bit = 0; bit < 8; bit++)
+                c = (c & 1) ? (c >> 1) ^ 0xEDB88320 : c >> 1;
+            table[i] = c;
+        }
+    }
+    crc = ~crc;
+    while (size-- != 0)
+        crc = table[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+//------------------------------------------------------------------------------
+// Containers
+//------------------------------------------------------------------------------
+
+static bool skip_string(FILE *file)
+{
+    int c;
+    
+    while ((c = fgetc(file)) != EOF)
+    {
+        if (c == '\0')
+            return true;
+    }
+    return false;
+}
+
+// Finds the deflate stream in a gzip file (RFC 1952). Only the first member
+// is read.
+static bool open_gzip(FILE *file, long fileSize, size_t *dataSize)
+{
+    uint8_t header[10];
+    uint8_t trailer[8];
+    uint8_t extraSize[2];
+    long dataStart;
+    
+    if (fseek(file, fileSize - sizeof(trailer), SEEK_SET) != 0
+     || fread(trailer, 1, sizeof(trailer), file) != sizeof(trailer))
+        return false;
+    imageCrc = get_le32(trailer);
+    imageSize = get_le32(trailer + 4);  // Modulo 4GByte, which is plenty
+    
+    if (fseek(file, 0, SEEK_SET) != 0 || fread(header, 1, sizeof(header), file) != sizeof(header)
+     || header[2] != 8)  // Deflate
+        return false;
+    if ((header[3] & GZIP_FLAG_EXTRA)
+     && (fread(extraSize, 1, 2, file) != 2 || fseek(file, get_le16(extraSize), SEEK_CUR) != 0))
+        return false;
+    if ((header[3] & GZIP_FLAG_NAME) && !skip_string(file))
+        return false;
+    if ((header[3] & GZIP_FLAG_COMMENT) && !skip_string(file))
+        return false;
+    if ((header[3] & GZIP_FLAG_HCRC) && fseek(file, 2, SEEK_CUR) != 0)
+        return false;
+    dataStart = ftell(file);
+    if (dataStart < 0 || dataStart + (long)sizeof(trailer) > fileSize)
+        return false;
+    *dataSize = fileSize - sizeof(trailer) - dataStart;
+    isStored = false;
+    return true;
+}
+
+static bool is_rom_name(const char *name, size_t length)
+{
+    static const char *const extensions[] = {".gb", ".gbc", ".sgb"};
+    
+    for (unsigned int i = 0; i < ARRAY_COUNT(extensions); i++)
+    {
+        size_t extLength = strlen(extensions[i]);
+        size_t j;
+        
+        if (length < extLength)
+            continue;
+        for (j = 0; j < extLength; j++)
+        {
+            if (tolower((unsigned char)name[length - extLength + j]) != extensions[i][j])
+                break;
+        }
+        if (j == extLength)
+            return true;
+    }
+    return false;
+}
+
+// Finds the first ROM image in a zip file, or the first file if none of them
+// has a ROM extension. Zip64 isn't supported, as no ROM needs it.
+static bool open_zip(FILE *file, long fileSize, size_t *dataSize)
+{
+    size_t searchSize = MIN((size_t)fileSize, ZIP_END_RECORD_SIZE + ZIP_MAX_COMMENT_SIZE);
+    uint8_t *buffer = malloc(searchSize);
+    uint8_t *end = NULL;
+    uint8_t *dir = NULL;
+    uint8_t *entry = NULL;
+    uint32_t dirSize, dirOffset;
+    unsigned int entryCount;
+    uint8_t local[30];
+    bool ok = false;
+    
+    if (buffer == NULL)
+        return false;
+    if (searchSize < ZIP_END_RECORD_SIZE)
+        goto done;
+    if (fseek(file, fileSize - searchSize, SEEK_SET) != 0 || fread(buffer, 1, searchSize, file) != searchSize)
+        goto done;
+    
+    // The end of central directory record is at the end, before the comment
+    for (size_t i = searchSize - ZIP_END_RECORD_SIZE + 1; i-- > 0; )
+    {
+        if (get_le32(buffer + i) == 0x06054B50)
+        {
+            end = buffer + i;
+            break;
+        }
+    }
+    if (end == NULL)
+        goto done;
+    entryCount = get_le16(end + 10);
+    dirSize = get_le32(end + 12);
+    dirOffset = get_le32(end + 16);
+    if ((long)dirOffset + (long)dirSize > fileSize || (dir = malloc(dirSize)) == NULL)
+        goto done;
+    if (fseek(file, dirOffset, SEEK_SET) != 0 || fread(dir, 1, dirSize, file) != dirSize)
+        goto done;
+    
+    for (uint8_t *p = dir; entryCount-- > 0 && p + 46 <= dir + dirSize; )
+    {
+        size_t nameLength = get_le16(p + 28);
+        
+        if (get_le32(p) != 0x02014B50 || p + 46 + nameLength > dir + dirSize)
+            break;
+        if (entry == NULL || is_rom_name((char *)p + 46, nameLength))
+        {
+            entry = p;
+            if (is_rom_name((char *)p + 46, nameLength))
+                break;
+        }
+        p += 46 + nameLength + get_le16(p + 30) + get_le16(p + 32);
+    }
+    if (entry == NULL || (get_le16(entry + 8) & 1))  // Encrypted
+        goto done;
+    if (get_le16(entry + 10) == ZIP_METHOD_STORED)
+        isStored = true;
+    else if (get_le16(entry + 10) == ZIP_METHOD_DEFLATE)
+        isStored = false;
+    else
+        goto done;
+    imageCrc = get_le32(entry + 16);
+    *dataSize = get_le32(entry + 20);
+    imageSize = get_le32(entry + 24);
+    
+    // The data follows the local header, whose extra field can differ
+    if (fseek(file, get_le32(entry + 42), SEEK_SET) != 0 || fread(local, 1, sizeof(local), file) != sizeof(local)
+     || get_le32(local) != 0x04034B50
+     || fseek(file, get_le16(local + 26) + get_le16(local + 28), SEEK_CUR) != 0)
+        goto done;
+    ok = true;
+  
+  done:
+    free(buffer);
+    free(dir);
+    return ok;
+}
+
+//------------------------------------------------------------------------------
+// Public functions
+//------------------------------------------------------------------------------
+
+// Returns whether file is a gzip or zip file
+bool archive_probe(FILE *file)
+{
+    uint8_t magic[4];
+    bool isArchive;
+    
+    isArchive = fread(magic, 1, sizeof(magic), file) == sizeof(magic)
+      && ((magic[0] == 0x1F && magic[1] == 0x8B) || get_le32(magic) == 0x04034B50);
+    rewind(file);
+    return isArchive;
+}
+
+// Opens the ROM image in an archive and returns its decompressed size. The
+// archive takes ownership of file, even if it fails to open.
+bool archive_open(FILE *file, size_t *size)
+{
+    uint8_t magic[2];
+    long fileSize;
+    size_t dataSize;
+    bool ok;
+    
+    archive_close();
+    if (fread(magic, 1, sizeof(magic), file) != sizeof(magic)
+     || fseek(file, 0, SEEK_END) != 0 || (fileSize = ftell(file)) <= 0)
+        ok = false;
+    else if (magic[0] == 0x1F && magic[1] == 0x8B)
+        ok = open_gzip(file, fileSize, &dataSize);
+    else
+        ok = open_zip(file, fileSize, &dataSize);
+    if (ok && !isStored)
+    {
+        ok = (inflater = malloc(sizeof(*inflater))) != NULL;
+        if (ok)
+            inflate_init(inflater, file, dataSize, NULL, 0);
+    }
+    if (!ok || imageSize == 0)
+    {
+        fclose(file);
+        free(inflater);
+        inflater = NULL;
+        return false;
+    }
+    dbg_printf("archive: %s image of %lu bytes\n", isStored ? "stored" : "compressed", (unsigned long)imageSize);
+    archiveFile = file;
+    crc = 0;
+    extractedSize = 0;
+    *size = imageSize;
+    return true;
+}
+
+// Extracts the image up to at least end bytes into dest, which must be the
+// same buffer of at least the image size every time. Once the whole image is
+// out, its checksum is verified.
+bool archive_extract(uint8_t *dest, size_t end)
+{
+    size_t start = extractedSize;
+    
+    if (archiveFile == NULL)
+        return false;
+    end = MIN(end, imageSize);
+    if (end <= extractedSize)
+        return true;
+    if (isStored)
+    {
+        if (fread(dest + extractedSize, 1, end - extractedSize, archiveFile) != end - extractedSize)
+            return false;
+        extractedSize = end;
+    }
+    else
+    {
+        inflater->out = dest;
+        inflater->outSize = imageSize;
+        if (inflate_run(inflater, end) == INFLATE_ERROR)
+            return false;
+        extractedSize = inflater->outPos;
+        if (extractedSize < end)
+            return false;  // The stream ended early
+        if (extractedSize == imageSize && inflate_run(inflater, SIZE_MAX) != INFLATE_DONE)
+            return false;
+    }
+    crc = update_crc(crc, dest + start, extractedSize - start);
+    if (extractedSize == imageSize && crc != imageCrc)
+    {
+        dbg_puts("archive: CRC mismatch");
+        return false;
+    }
+    return true;
+}
+
+void archive_close(void)
+{
+    if (archiveFile == NULL)
+        return;
+    fclose(archiveFile);
+    free(inflater);
+    archiveFile = NULL;
+    inflater = NULL;
+}
@@ -0,0 +1,11 @@
+#ifndef GUARD_ARCHIVE_H
+#define GUARD_ARCHIVE_H
+
+// ROM images inside gzip and zip files. The image is decompressed as it's
+// needed, straight into the caller's buffer, so no temporary file is made.
+bool archive_probe(FILE *file);
+bool archive_open(FILE *file, size_t *size);
+bool archive_extract(uint8_t *dest, size_t end);
+void archive_close(void);
+
+#endif  // GUARD_ARCHIVE_H
@@ -0,0 +1,714 @@
+#include <assert.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "global.h"
+#include "audio.h"
+#include "gameboy.h"
+#include "memory.h"
+#include "platform/platform.h"
+
+// The APU is not stepped along with the CPU. It remembers the CPU clock it was
+// last brought up to date at, and only catches up over the elapsed interval
+// when a sound register is accessed or when a frame ends. While catching up,
+// each channel jumps straight from one waveform step to the next, and only the
+// points where its output level changes are turned into band-limited steps in
+// a delta buffer. At the end of the frame, the delta buffer is integrated into
+// a block of 16-bit stereo samples which the frontend can fetch.
+
+#define FRAME_SEQ_PERIOD 8192  // The frame sequencer runs at 512 Hz
+
+#define BLIP_PHASE_BITS 5
+#define BLIP_PHASES (1 << BLIP_PHASE_BITS)
+#define BLIP_WIDTH 16
+#define BLIP_DELTA_BITS 15
+#define BLIP_BASS_SHIFT 9  // Strength of the high-pass filter that removes DC
+#define BLIP_CUTOFF 0.9    // Fraction of the Nyquist frequency to pass
+
+#define AMP_SCALE 48  // 4 channels * 15 * 8 (master volume) * 48 fits in 16 bits
+
+struct Channel
+{
+    bool enabled;
+    uint8_t output;         // Current output level (0-15)
+    uint8_t volume;         // Envelope volume
+    uint8_t envelopeTimer;
+    uint16_t length;        // Length counter
+    uint8_t pos;            // Position in the duty pattern or wave RAM
+    uint32_t period;        // Clocks per waveform step
+    uint32_t timer;         // Clocks until the next waveform step
+};
+
+// Offset of each channel's first register. Each channel has five registers,
+// even though channels 2 and 4 don't use the first one.
+static const uint8_t channelRegs[4] = {0x10, 0x15, 0x1A, 0x1F};
+
+static const uint8_t dutyPatterns[4] = {0x01, 0x81, 0x87, 0x7E};
+
+// Machine state
+static struct Channel channels[4];
+static uint16_t noiseLfsr;
+static bool sweepEnabled;
+static uint16_t sweepShadow;
+static uint8_t sweepTimer;
+static uint32_t apuClock;  // CPU clock that the APU has been emulated up to
+static uint32_t frameSeqTimer;
+static uint8_t frameSeqStep;
+
+// Sample output. This is not part of the machine state.
+static unsigned int sampleRate;
+static double sampleRateAdjust = 1.0;
+static bool audioMuted;
+static int16_t blipKernel[BLIP_PHASES][BLIP_WIDTH];
+static uint32_t blipClock;   // CPU clock at the start of the current sample block
+static uint64_t blipFactor;  // Samples per CPU clock, 32.32 fixed point
+static uint64_t blipOffset;  // Fractional sample position of blipClock
+static unsigned int blipSize;
+static int32_t *blipDeltas[2];
+static int32_t blipIntegrators[2];
+static int channelAmps[4][2];
+static int16_t *sampleBlock;
+static unsigned int sampleBlockCount;
+
+//------------------------------------------------------------------------------
+// Band-limited synthesis
+//------------------------------------------------------------------------------
+
+// Builds a table of windowed sinc impulses, one for each fractional sample
+// position. Each one sums to exactly 1 << BLIP_DELTA_BITS, so integrating the
+// delta buffer gives back the original step heights without any drift.
+static void blip_init_kernel(void)
+{
+    const double pi = 3.14159265358979323846;
+    
+    for (unsigned int phase = 0; phase < BLIP_PHASES; phase++)
+    {
+        double taps[BLIP_WIDTH];
+        double sum = 0.0;
+        int total = 0;
+        
+        for (unsigned int i = 0; i < BLIP_WIDTH; i++)
+        {
+            double x = (double)i - (BLIP_WIDTH / 2 - 1) - (double)phase / BLIP_PHASES;
+            double window = 0.5 + 0.5 * cos(pi * x / (BLIP_WIDTH / 2));
+            double sinc = (x == 0.0) ? 1.0 : sin(pi * x * BLIP_CUTOFF) / (pi * x * BLIP_CUTOFF);
+            
+            taps[i] = sinc * window;
+            sum += taps[i];
+        }
+        for (unsigned int i = 0; i < BLIP_WIDTH; i++)
+        {
+            blipKernel[phase][i] = lround(taps[i] / sum * (1 << BLIP_DELTA_BITS));
+            total += blipKernel[phase][i];
+        }
+        blipKernel[phase][BLIP_WIDTH / 2 - 1] += (1 << BLIP_DELTA_BITS) - total;
+    }
+}
+
+static bool output_active(void)
+{
+    return sampleRate != 0 && !audioMuted;
+}
+
+// Adds a step of the given height to each side, at the given number of CPU
+// clocks after the start of the sample block.
+static void blip_add_delta(uint32_t time, int deltaLeft, int deltaRight)
+{
+    uint64_t pos = blipOffset + time * blipFactor;
+    unsigned int index = pos >> 32;
+    const int16_t *kernel = blipKernel[(pos >> (32 - BLIP_PHASE_BITS)) & (BLIP_PHASES - 1)];
+    int32_t *left = blipDeltas[0] + index;
+    int32_t *right = blipDeltas[1] + index;
+    
+    assert(index + BLIP_WIDTH <= blipSize);
+    for (unsigned int i = 0; i < BLIP_WIDTH; i++)
+    {
+        left[i] += kernel[i] * deltaLeft;
+        right[i] += kernel[i] * deltaRight;
+    }
+}
+
+static void blip_clear(void)
+{
+    blipClock = apuClock;
+    blipOffset = 0;
+    blipIntegrators[0] = blipIntegrators[1] = 0;
+    memset(channelAmps, 0, sizeof(channelAmps));
+    sampleBlockCount = 0;
+    if (sampleRate != 0)
+    {
+        memset(blipDeltas[0], 0, blipSize * sizeof(*blipDeltas[0]));
+        memset(blipDeltas[1], 0, blipSize * sizeof(*blipDeltas[1]));
+    }
+}
+
+// Turns everything up to the given time into samples in the sample block
+static void blip_end_block(uint32_t time)
+{
+    uint64_t pos = blipOffset + time * blipFactor;
+    unsigned int count = pos >> 32;
+    
+    assert(count + BLIP_WIDTH <= blipSize);
+    for (unsigned int side = 0; side < 2; side++)
+    {
+        int32_t *deltas = blipDeltas[side];
+        int32_t sum = blipIntegrators[side];
+        
+        for (unsigned int i = 0; i < count; i++)
+        {
+            int32_t s = sum >> BLIP_DELTA_BITS;
+            
+            sum += deltas[i];
+            if (s > INT16_MAX)
+                s = INT16_MAX;
+            else if (s < INT16_MIN)
+                s = INT16_MIN;
+            sampleBlock[i * 2 + side] = s;
+            sum -= s * (1 << (BLIP_DELTA_BITS - BLIP_BASS_SHIFT));
+        }
+        blipIntegrators[side] = sum;
+        
+        // Move the tails of the last few impulses to the start of the buffer
+        memmove(deltas, deltas + count, BLIP_WIDTH * sizeof(*deltas));
+        memset(deltas + BLIP_WIDTH, 0, count * sizeof(*deltas));
+    }
+    sampleBlockCount = count;
+    blipOffset = pos & 0xFFFFFFFF;
+}
+
+//------------------------------------------------------------------------------
+// Channels
+//------------------------------------------------------------------------------
+
+// Sends a channel's output level through the panning and master volume, and
+// adds a step to the output wherever its contribution changes.
+static void update_channel_amp(unsigned int ch, uint32_t time)
+{
+    unsigned int level = channels[ch].output;
+    int left = 0;
+    int right = 0;
+    
+    if (!output_active())
+        return;
+    if (REG_NR51 & (0x10 << ch))
+        left = level * (((REG_NR50 >> 4) & 7) + 1) * AMP_SCALE;
+    if (REG_NR51 & (0x01 << ch))
+        right = level * ((REG_NR50 & 7) + 1) * AMP_SCALE;
+    if (left != channelAmps[ch][0] || right != channelAmps[ch][1])
+    {
+        blip_add_delta(time, left - channelAmps[ch][0], right - channelAmps[ch][1]);
+        channelAmps[ch][0] = left;
+        channelAmps[ch][1] = right;
+    }
+}
+
+static void set_output(unsigned int ch, uint32_t time, unsigned int level)
+{
+    channels[ch].output = level;
+    update_channel_amp(ch, time);
+}
+
+static unsigned int wave_level(unsigned int pos)
+{
+    static const uint8_t volumeShifts[4] = {4, 0, 1, 2};
+    uint8_t sample = io[REG_OFFSET_WAVE + pos / 2];
+    
+    if (pos & 1)
+        sample &= 0xF;
+    else
+        sample >>= 4;
+    return sample >> volumeShifts[(REG_NR32 >> 5) & 3];
+}
+
+// Returns the level a channel should currently be outputting
+static unsigned int channel_level(unsigned int ch)
+{
+    const struct Channel *c = &channels[ch];
+    
+    if (!c->enabled)
+        return 0;
+    switch (ch)
+    {
+      case 0:
+      case 1:
+        return ((dutyPatterns[io[channelRegs[ch] + 1] >> 6] >> c->pos) & 1) ? c->volume : 0;
+      case 2:
+        return wave_level(c->pos);
+      default:
+        return (noiseLfsr & 1) ? 0 : c->volume;
+    }
+}
+
+static bool dac_enabled(unsigned int ch)
+{
+    if (ch == 2)
+        return REG_NR30 & 0x80;
+    else
+        return io[channelRegs[ch] + 2] & 0xF8;
+}
+
+static void update_period(unsigned int ch)
+{
+    static const uint8_t noiseDivisors[8] = {8, 16, 32, 48, 64, 80, 96, 112};
+    unsigned int freq = io[channelRegs[ch] + 3] | ((io[channelRegs[ch] + 4] & 7) << 8);
+    
+    switch (ch)
+    {
+      case 0:
+      case 1:
+        channels[ch].period = (2048 - freq) * 4;
+        break;
+      case 2:
+        channels[ch].period = (2048 - freq) * 2;
+        break;
+      case 3:
+        channels[ch].period = noiseDivisors[REG_NR43 & 7] << (REG_NR43 >> 4);
+        break;
+    }
+}
+
+// The following functions run a channel's waveform over [start, end), with
+// times given in clocks from the start of the sample block.
+
+static void run_square(unsigned int ch, uint32_t start, uint32_t end)
+{
+    struct Channel *c = &channels[ch];
+    uint8_t duty = dutyPatterns[io[channelRegs[ch] + 1] >> 6];
+    uint32_t time;
+    
+    if (!c->enabled)
+        return;
+    for (time = start + c->timer; time < end; time += c->period)
+    {
+        unsigned int level;
+        
+        c->pos = (c->pos + 1) & 7;
+        level = ((duty >> c->pos) & 1) ? c->volume : 0;
+        if (level != c->output)
+            set_output(ch, time, level);
+    }
+    c->timer = time - end;
+}
+
+static void run_wave(uint32_t start, uint32_t end)
+{
+    struct Channel *c = &channels[2];
+    uint32_t time;
+    
+    if (!c->enabled)
+        return;
+    for (time = start + c->timer; time < end; time += c->period)
+    {
+        unsigned int level;
+        
+        c->pos = (c->pos + 1) & 31;
+        level = wave_level(c->pos);
+        if (level != c->output)
+            set_output(2, time, level);
+    }
+    c->timer = time - end;
+}
+
+static void run_noise(uint32_t start, uint32_t end)
+{
+    struct Channel *c = &channels[3];
+    bool shortMode = REG_NR43 & 8;
+    uint32_t time;
+    
+    // Clock shifts of 14 and 15 stop the LFSR
+    if (!c->enabled || (REG_NR43 >> 4) >= 14)
+        return;
+    for (time = start + c->timer; time < end; time += c->period)
+    {
+        unsigned int bit = (noiseLfsr ^ (noiseLfsr >> 1)) & 1;
+        unsigned int level;
+        
+        noiseLfsr = (noiseLfsr >> 1) | (bit << 14);
+        if (shortMode)
+            noiseLfsr = (noiseLfsr & ~0x40) | (bit << 6);
+        level = (noiseLfsr & 1) ? 0 : c->volume;
+        if (level != c->output)
+            set_output(3, time, level);
+    }
+    c->timer = time - end;
+}
+
+// Calculates the next sweep frequency, disabling channel 1 if it overflows
+static unsigned int sweep_calculate(void)
+{
+    unsigned int delta = sweepShadow >> (REG_NR10 & 7);
+    unsigned int freq = (REG_NR10 & 8) ? sweepShadow - delta : sweepShadow + delta;
+    
+    if (freq > 2047)
+        channels[0].enabled = false;
+    return freq;
+}
+
+static void trigger_channel(unsigned int ch)
+{
+    struct Channel *c = &channels[ch];
+    uint8_t envelope = io[channelRegs[ch] + 2];
+    
+    c->enabled = dac_enabled(ch);
+    if (c->length == 0)
+        c->length = (ch == 2) ? 256 : 64;
+    c->timer = c->period;
+    c->volume = envelope >> 4;
+    c->envelopeTimer = envelope & 7;
+    if (ch == 2)
+        c->pos = 0;
+    else if (ch == 3)
+        noiseLfsr = 0x7FFF;
+    else if (ch == 0)
+    {
+        unsigned int sweepPeriod = (REG_NR10 >> 4) & 7;
+        
+        sweepShadow = REG_NR13 | ((REG_NR14 & 7) << 8);
+        sweepTimer = sweepPeriod ? sweepPeriod : 8;
+        sweepEnabled = sweepPeriod != 0 || (REG_NR10 & 7) != 0;
+        if (REG_NR10 & 7)
+            sweep_calculate();
+    }
+}
+
+//------------------------------------------------------------------------------
+// Frame sequencer
+//------------------------------------------------------------------------------
+
+static void clock_lengths(void)
+{
+    for (unsigned int ch = 0; ch < 4; ch++)
+    {
+        struct Channel *c = &channels[ch];
+        
+        if ((io[channelRegs[ch] + 4] & 0x40) && c->length > 0)
+        {
+            if (--c->length == 0)
+                c->enabled = false;
+        }
+    }
+}
+
+static void clock_sweep(void)
+{
+    unsigned int sweepPeriod = (REG_NR10 >> 4) & 7;
+    
+    if (sweepTimer > 0 && --sweepTimer == 0)
+    {
+        sweepTimer = sweepPeriod ? sweepPeriod : 8;
+        if (sweepEnabled && sweepPeriod != 0)
+        {
+            unsigned int freq = sweep_calculate();
+            
+            if (freq <= 2047 && (REG_NR10 & 7) != 0)
+            {
+                sweepShadow = freq;
+                REG_NR13 = freq & 0xFF;
+                REG_NR14 = (REG_NR14 & ~7) | (freq >> 8);
+                update_period(0);
+                sweep_calculate();
+            }
+        }
+    }
+}
+
+static void clock_envelopes(void)
+{
+    for (unsigned int ch = 0; ch < 4; ch++)
+    {
+        struct Channel *c = &channels[ch];
+        uint8_t envelope = io[channelRegs[ch] + 2];
+        
+        if (ch == 2 || (envelope & 7) == 0)
+            continue;
+        if (c->envelopeTimer > 0)
+            c->envelopeTimer--;
+        if (c->envelopeTimer == 0)
+        {
+            c->envelopeTimer = envelope & 7;
+            if ((envelope & 8) && c->volume < 15)
+                c->volume++;
+            else if (!(envelope & 8) && c->volume > 0)
+                c->volume--;
+        }
+    }
+}
+
+static void frame_seq_step(uint32_t time)
+{
+    if ((frameSeqStep & 1) == 0)
+        clock_lengths();
+    if (frameSeqStep == 2 || frameSeqStep == 6)
+        clock_sweep();
+    if (frameSeqStep == 7)
+        clock_envelopes();
+    frameSeqStep = (frameSeqStep + 1) & 7;
+    for (unsigned int ch = 0; ch < 4; ch++)
+        set_output(ch, time, channel_level(ch));
+}
+
+//------------------------------------------------------------------------------
+// Catch-up
+//------------------------------------------------------------------------------
+
+// Emulates the APU from where it was left off up to the current CPU clock
+static void audio_sync(void)
+{
+    uint32_t time = apuClock - blipClock;
+    uint32_t end = cpuClock - blipClock;
+    
+    while (time < end)
+    {
+        uint32_t segmentEnd = time + MIN(end - time, frameSeqTimer);
+        
+        run_square(0, time, segmentEnd);
+        run_square(1, time, segmentEnd);
+        run_wave(time, segmentEnd);
+        run_noise(time, segmentEnd);
+        frameSeqTimer -= segmentEnd - time;
+        time = segmentEnd;
+        if (frameSeqTimer == 0)
+        {
+            frame_seq_step(time);
+            frameSeqTimer = FRAME_SEQ_PERIOD;
+        }
+    }
+    apuClock = cpuClock;
+}
+
+//------------------------------------------------------------------------------
+// Interface
+//------------------------------------------------------------------------------
+
+// Resets the APU to the state the boot ROM leaves it in
+void audio_init(void)
+{
+    static const uint8_t initialRegs[0x17] =
+    {
+        0x80, 0xBF, 0xF3, 0x00, 0xBF,  // NR10-NR14
+        0x00, 0x3F, 0x00, 0x00, 0xBF,  // NR21-NR24
+        0x7F, 0xFF, 0x9F, 0x00, 0xBF,  // NR30-NR34
+        0x00, 0xFF, 0x00, 0x00, 0xBF,  // NR41-NR44
+        0x77, 0xF3, 0x80,              // NR50-NR52
+    };
+    
+    memcpy(io + REG_OFFSET_NR10, initialRegs, sizeof(initialRegs));
+    memset(channels, 0, sizeof(channels));
+    for (unsigned int ch = 0; ch < 4; ch++)
+        update_period(ch);
+    noiseLfsr = 0x7FFF;
+    sweepEnabled = false;
+    sweepShadow = 0;
+    sweepTimer = 8;
+    apuClock = cpuClock;
+    frameSeqTimer = FRAME_SEQ_PERIOD;
+    frameSeqStep = 0;
+    blip_clear();
+}
+
+// Sets the output sample rate. A rate of 0 turns off sample generation, but
+// the APU is still emulated.
+void audio_set_sample_rate(unsigned int rate)
+{
+    static bool kernelReady = false;
+    
+    if (!kernelReady)
+    {
+        blip_init_kernel();
+        kernelReady = true;
+    }
+    free(blipDeltas[0]);
+    free(blipDeltas[1]);
+    free(sampleBlock);
+    blipDeltas[0] = blipDeltas[1] = NULL;
+    sampleBlock = NULL;
+    sampleRate = rate;
+    if (rate != 0)
+    {
+        // Leave room for blocks of up to 1/8 of a second, which is plenty for
+        // a frame.
+        blipSize = rate / 8 + BLIP_WIDTH;
+        blipDeltas[0] = malloc(blipSize * sizeof(*blipDeltas[0]));
+        blipDeltas[1] = malloc(blipSize * sizeof(*blipDeltas[1]));
+        sampleBlock = malloc(blipSize * 2 * sizeof(*sampleBlock));
+        if (blipDeltas[0] == NULL || blipDeltas[1] == NULL || sampleBlock == NULL)
+            platform_fatal_error("Failed to allocate audio buffers");
+    }
+    audio_adjust_sample_rate(sampleRateAdjust);
+    blip_clear();
+    for (unsigned int ch = 0; ch < 4; ch++)
+        update_channel_amp(ch, 0);
+}
+
+// Scales the output sample rate by a factor close to 1, which takes effect from
+// the next frame. Since the samples are synthesized directly at the output
+// rate, this resamples for free. Frontends use it to keep their buffers from
+// slowly draining or filling up when the sound card's clock doesn't exactly
+// match the rate frames are presented at.
+void audio_adjust_sample_rate(double adjust)
+{
+    assert(adjust > 0.5 && adjust < 2.0);
+    sampleRateAdjust = adjust;
+    blipFactor = (uint64_t)((double)((uint64_t)sampleRate << 32) * adjust / CPU_CLOCK_RATE);
+}
+
+// While muted, the APU is still emulated but nothing is added to the output.
+// The run-ahead frames are run muted so that they don't get heard twice.
+void audio_set_muted(bool muted)
+{
+    audioMuted = muted;
+}
+
+uint8_t audio_read_reg(uint16_t addr)
+{
+    // Bits that always read back as 1, for 0xFF10-0xFF2F
+    static const uint8_t readMasks[0x20] =
+    {
+        0x80, 0x3F, 0x00, 0xFF, 0xBF,  // NR10-NR14
+        0xFF, 0x3F, 0x00, 0xFF, 0xBF,  // NR21-NR24
+        0x7F, 0xFF, 0x9F, 0xFF, 0xBF,  // NR30-NR34
+        0xFF, 0xFF, 0x00, 0x00, 0xBF,  // NR41-NR44
+        0x00, 0x00, 0x70,              // NR50-NR52
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    };
+    unsigned int offset = addr - IO_BASE;
+    
+    if (offset >= REG_OFFSET_WAVE)
+        return io[offset];
+    if (offset == REG_OFFSET_NR52)
+    {
+        uint8_t val = REG_NR52 | readMasks[offset - REG_OFFSET_NR10];
+        
+        // The channel status bits depend on the length counters
+        audio_sync();
+        for (unsigned int ch = 0; ch < 4; ch++)
+        {
+            if (channels[ch].enabled)
+                val |= 1 << ch;
+        }
+        return val;
+    }
+    return io[offset] | readMasks[offset - REG_OFFSET_NR10];
+}
+
+void audio_write_reg(uint16_t addr, uint8_t val)
+{
+    unsigned int offset = addr - IO_BASE;
+    uint32_t time;
+    
+    audio_sync();
+    time = apuClock - blipClock;
+    if (offset == REG_OFFSET_NR52)
+    {
+        if (!(val & 0x80))
+        {
+            // Powering off clears all of the sound registers
+            memset(io + REG_OFFSET_NR10, 0, REG_OFFSET_NR52 - REG_OFFSET_NR10);
+            for (unsigned int ch = 0; ch < 4; ch++)
+                channels[ch].enabled = false;
+        }
+        else if (!(REG_NR52 & 0x80))
+            frameSeqStep = 0;
+        REG_NR52 = val & 0x80;
+    }
+    else if (offset >= REG_OFFSET_WAVE)
+        io[offset] = val;
+    else if (REG_NR52 & 0x80)  // The other registers can't be written while the APU is off
+    {
+        io[offset] = val;
+        if (offset < REG_OFFSET_NR50)
+        {
+            unsigned int ch = (offset - REG_OFFSET_NR10) / 5;
+            
+            switch ((offset - REG_OFFSET_NR10) % 5)
+            {
+              case 0:
+                if (ch == 2 && !(val & 0x80))
+                    channels[2].enabled = false;
+                break;
+              case 1:
+                if (ch == 2)
+                    channels[2].length = 256 - val;
+                else
+                    channels[ch].length = 64 - (val & 0x3F);
+                break;
+              case 2:
+                if (ch != 2 && !dac_enabled(ch))
+                    channels[ch].enabled = false;
+                break;
+              case 3:
+                update_period(ch);
+                break;
+              case 4:
+                update_period(ch);
+                if (val & 0x80)
+                    trigger_channel(ch);
+                break;
+            }
+        }
+    }
+    
+    // Any of these writes could change the channels' levels, volume, or panning
+    for (unsigned int ch = 0; ch < 4; ch++)
+        set_output(ch, time, channel_level(ch));
+}
+
+// Catches up to the end of the frame and turns it into a block of samples,
+// which stays available from audio_get_samples until the next frame ends.
+void audio_end_frame(void)
+{
+    audio_sync();
+    if (output_active())
+        blip_end_block(apuClock - blipClock);
+    blipClock = apuClock;
+}
+
+// Returns the samples from the last frame as interleaved 16-bit stereo pairs
+const int16_t *audio_get_samples(unsigned int *count)
+{
+    *count = sampleBlockCount;
+    return sampleBlock;
+}
+
+size_t audio_state_size(void)
+{
+    return sizeof(channels) + sizeof(noiseLfsr) + sizeof(sweepEnabled) + sizeof(sweepShadow)
+      + sizeof(sweepTimer) + sizeof(apuClock) + sizeof(frameSeqTimer) + sizeof(frameSeqStep);
+}
+
+uint8_t *audio_save_state(uint8_t *p)
+{
+    STATE_SAVE(p, channels);
+    STATE_SAVE(p, noiseLfsr);
+    STATE_SAVE(p, sweepEnabled);
+    STATE_SAVE(p, sweepShadow);
+    STATE_SAVE(p, sweepTimer);
+    STATE_SAVE(p, apuClock);
+    STATE_SAVE(p, frameSeqTimer);
+    STATE_SAVE(p, frameSeqStep);
+    return p;
+}
+
+// Must be called after the IO registers have been loaded
+const uint8_t *audio_load_state(const uint8_t *p)
+{
+    STATE_LOAD(p, channels);
+    STATE_LOAD(p, noiseLfsr);
+    STATE_LOAD(p, sweepEnabled);
+    STATE_LOAD(p, sweepShadow);
+    STATE_LOAD(p, sweepTimer);
+    STATE_LOAD(p, apuClock);
+    STATE_LOAD(p, frameSeqTimer);
+    STATE_LOAD(p, frameSeqStep);
+    
+    // Start a new sample block from here, stepping from whatever the output
+    // was at to the loaded levels.
+    blipClock = apuClock;
+    for (unsigned int ch = 0; ch < 4; ch++)
+        update_channel_amp(ch, 0);
+    return p;
+}
@@ -0,0 +1,16 @@
+#ifndef GUARD_AUDIO_H
+#define GUARD_AUDIO_H
+
+void audio_init(void);
+void audio_set_sample_rate(unsigned int rate);
+void audio_adjust_sample_rate(double adjust);
+void audio_set_muted(bool muted);
+uint8_t audio_read_reg(uint16_t addr);
+void audio_write_reg(uint16_t addr, uint8_t val);
+void audio_end_frame(void);
+const int16_t *audio_get_samples(unsigned int *count);
+size_t audio_state_size(void);
+uint8_t *audio_save_state(uint8_t *p);
+const uint8_t *audio_load_state(const uint8_t *p);
+
+#endif  // GUARD_AUDIO_H
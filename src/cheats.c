@@ -0,0 +1,253 @@
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "global.h"
+#include "cheats.h"
+#include "gameboy.h"
+#include "memory.h"
+#include "platform/platform.h"
+
+#define MAX_CHEATS 64
+
+struct GameGenieCode
+{
+    uint16_t addr;
+    uint8_t value;
+    int16_t compare;  // -1 to patch whatever byte is there
+};
+
+struct GameSharkCode
+{
+    uint16_t addr;
+    uint8_t value;
+};
+
+// Patched copies of the ROM pages of one bank that some Game Genie code
+// applies to. They are made the first time the bank is mapped, since codes
+// with a compare value only apply to the banks that have that value there.
+struct PatchedPage
+{
+    uint8_t page;  // Page in the address space, 0x00-0x7F
+    uint8_t data[0x100];
+};
+
+struct PatchedBank
+{
+    bool built;
+    unsigned int count;
+    struct PatchedPage *pages;
+};
+
+static struct GameGenieCode gameGenieCodes[MAX_CHEATS];
+static unsigned int gameGenieCount;
+static struct GameSharkCode gameSharkCodes[MAX_CHEATS];
+static unsigned int gameSharkCount;
+
+static struct PatchedBank rom0Patches;    // Bank 0 at 0x0000-0x3FFF
+static struct PatchedBank *rom1Patches;   // Every bank at 0x4000-0x7FFF
+
+static void free_patched_bank(struct PatchedBank *pb)
+{
+    free(pb->pages);
+    pb->pages = NULL;
+    pb->count = 0;
+    pb->built = false;
+}
+
+static void free_patches(void)
+{
+    free_patched_bank(&rom0Patches);
+    if (rom1Patches != NULL)
+    {
+        for (unsigned int i = 0; i < gRomInfo.romBankCount; i++)
+            free_patched_bank(&rom1Patches[i]);
+        free(rom1Patches);
+        rom1Patches = NULL;
+    }
+}
+
+static uint8_t *get_patched_page(struct PatchedBank *pb, unsigned int page, const uint8_t *original)
+{
+    for (unsigned int i = 0; i < pb->count; i++)
+    {
+        if (pb->pages[i].page == page)
+            return pb->pages[i].data;
+    }
+    pb->pages = realloc(pb->pages, (pb->count + 1) * sizeof(*pb->pages));
+    if (pb->pages == NULL)
+        platform_fatal_error("Failed to allocate memory for cheats");
+    pb->pages[pb->count].page = page;
+    memcpy(pb->pages[pb->count].data, original, 0x100);
+    return pb->pages[pb->count++].data;
+}
+
+// Applies the codes in the 16KByte region at firstPage to the bank mapped there
+static void build_patched_bank(struct PatchedBank *pb, unsigned int bank, unsigned int firstPage)
+{
+    const uint8_t *rom = gamePAK + 0x4000 * bank;
+    
+    for (unsigned int i = 0; i < gameGenieCount; i++)
+    {
+        const struct GameGenieCode *gg = &gameGenieCodes[i];
+        unsigned int offset = gg->addr - firstPage * 0x100;
+        unsigned int page = gg->addr >> 8;
+        
+        if (page < firstPage || page >= firstPage + 0x40)
+            continue;
+        if (gg->compare >= 0 && rom[offset] != gg->compare)
+            continue;
+        get_patched_page(pb, page, rom + (offset & ~0xFF))[gg->addr & 0xFF] = gg->value;
+    }
+    pb->built = true;
+}
+
+// Maps the current ROM pages again, so that changed codes take effect
+static void remap_rom(void)
+{
+    free_patches();
+    if (gameGenieCount != 0)
+    {
+        rom1Patches = calloc(gRomInfo.romBankCount, sizeof(*rom1Patches));
+        if (rom1Patches == NULL)
+            platform_fatal_error("Failed to allocate memory for cheats");
+    }
+    memory_update_rom_pages();
+}
+
+//------------------------------------------------------------------------------
+// Code parsing
+//------------------------------------------------------------------------------
+
+static bool parse_hex(const char *str, unsigned int count, unsigned int *digits)
+{
+    for (unsigned int i = 0; i < count; i++)
+    {
+        if (!isxdigit((unsigned char)str[i]))
+            return false;
+        digits[i] = isdigit((unsigned char)str[i]) ? str[i] - '0' : toupper((unsigned char)str[i]) - 'A' + 10;
+    }
+    return true;
+}
+
+// ABC-DEF or ABC-DEF-GHI: AB is the new value and FCDE, with F inverted, the
+// address. GI, rotated right by two and XORed with 0xBA, is the value the
+// original byte must have. H is a checksum, which isn't verified.
+static bool parse_game_genie(const char *code, struct GameGenieCode *gg)
+{
+    char str[9];
+    unsigned int d[9];
+    size_t len = 0;
+    
+    for (const char *p = code; *p != '\0'; p++)
+    {
+        if (*p == '-')
+            continue;
+        if (len == sizeof(str))
+            return false;
+        str[len++] = *p;
+    }
+    if ((len != 6 && len != 9) || !parse_hex(str, len, d))
+        return false;
+    gg->value = (d[0] << 4) | d[1];
+    gg->addr = ((d[5] ^ 0xF) << 12) | (d[2] << 8) | (d[3] << 4) | d[4];
+    gg->compare = -1;
+    if (len == 9)
+    {
+        unsigned int val = (d[6] << 4) | d[8];
+        
+        gg->compare = (((val >> 2) | (val << 6)) & 0xFF) ^ 0xBA;
+    }
+    return gg->addr < 0x8000;
+}
+
+// TTVVLLHH: VV is written to HHLL. TT selects a RAM bank on cartridges that
+// the GameShark supports banking for, and is ignored here.
+static bool parse_game_shark(const char *code, struct GameSharkCode *gs)
+{
+    unsigned int d[8];
+    
+    if (strlen(code) != 8 || !parse_hex(code, 8, d))
+        return false;
+    gs->value = (d[2] << 4) | d[3];
+    gs->addr = (d[6] << 12) | (d[7] << 8) | (d[4] << 4) | d[5];
+    return (gs->addr >= 0xA000 && gs->addr < 0xE000) || (gs->addr >= HRAM_BASE && gs->addr < IE_ADDR);
+}
+
+//------------------------------------------------------------------------------
+// Public functions
+//------------------------------------------------------------------------------
+
+// Adds a Game Genie or GameShark code. Returns false if it isn't valid.
+bool cheats_add(const char *code)
+{
+    struct GameGenieCode gg;
+    struct GameSharkCode gs;
+    
+    if (parse_game_shark(code, &gs))
+    {
+        if (gameSharkCount == MAX_CHEATS)
+            return false;
+        gameSharkCodes[gameSharkCount++] = gs;
+        dbg_printf("cheats: GameShark 0x%04X = 0x%02X\n", gs.addr, gs.value);
+        return true;
+    }
+    if (parse_game_genie(code, &gg))
+    {
+        if (gameGenieCount == MAX_CHEATS)
+            return false;
+        gameGenieCodes[gameGenieCount++] = gg;
+        dbg_printf("cheats: Game Genie 0x%04X = 0x%02X (compare %d)\n", gg.addr, gg.value, gg.compare);
+        remap_rom();
+        return true;
+    }
+    return false;
+}
+
+void cheats_clear(void)
+{
+    bool hadGameGenie = (gameGenieCount != 0);
+    
+    gameGenieCount = 0;
+    gameSharkCount = 0;
+    if (hadGameGenie)
+        remap_rom();
+}
+
+// Called after bank is mapped at the 16KByte region starting at firstPage,
+// to map patched copies over the pages that have codes
+void cheats_patch_rom_pages(unsigned int bank, unsigned int firstPage)
+{
+    struct PatchedBank *pb;
+    
+    if (gameGenieCount == 0)
+        return;
+    pb = (firstPage == 0) ? &rom0Patches : &rom1Patches[bank];
+    if (!pb->built)
+        build_patched_bank(pb, bank, firstPage);
+    for (unsigned int i = 0; i < pb->count; i++)
+        memReadPages[pb->pages[i].page] = pb->pages[i].data;
+}
+
+void cheats_vblank(void)
+{
+    for (unsigned int i = 0; i < gameSharkCount; i++)
+    {
+        uint16_t addr = gameSharkCodes[i].addr;
+        
+        // A write to cartridge RAM that isn't mapped would go to the mapper,
+        // which may treat it as an error. Skip it until the game enables RAM.
+        if (addr >= 0xA000 && addr < 0xC000)
+        {
+            uint8_t *page = memWritePages[addr >> 8];
+            
+            if (page != NULL)
+                page[addr & 0xFF] = gameSharkCodes[i].value;
+        }
+        else
+            memory_write_byte(addr, gameSharkCodes[i].value);
+    }
+}
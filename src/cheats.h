@@ -0,0 +1,12 @@
+#ifndef GUARD_CHEATS_H
+#define GUARD_CHEATS_H
+
+// Game Genie codes patch the ROM by mapping patched copies of the affected
+// ROM pages into the page tables, so reads cost the same with or without
+// cheats. GameShark codes write to RAM once per frame, at vblank.
+bool cheats_add(const char *code);
+void cheats_clear(void);
+void cheats_patch_rom_pages(unsigned int bank, unsigned int firstPage);
+void cheats_vblank(void);
+
+#endif  // GUARD_CHEATS_H
@@ -9,6 +9,7 @@
 
 #include "global.h"
 #include "config.h"
+#include "gameboy.h"
 #include "platform/platform.h"
 
 enum
@@ -41,6 +42,12 @@ struct Config gConfig =
     .snapWindowSize = true,
     .colorPalette = 0,
 #endif
+    .runAheadFrames = 0,
+    .saveFlushInterval = 5,
+    .rtcDeterministic = false,
+    .lazyRomLoading = false,
+    .renderMode = RENDER_MODE_INLINE,
+    .renderer = RENDERER_SCANLINE,
     .keys =
     {
         .a = 46,
@@ -64,6 +71,12 @@ static const struct ConfigOption options[] = {
     {.name = "snap_window_size",    .type = CONFIG_TYPE_BOOL, .boolValue = &gConfig.snapWindowSize},
     {.name = "color_palette",       .type = CONFIG_TYPE_UINT, .uintValue = &gConfig.colorPalette},
 #endif
+    {.name = "run_ahead_frames",    .type = CONFIG_TYPE_UINT, .uintValue = &gConfig.runAheadFrames},
+    {.name = "save_flush_interval", .type = CONFIG_TYPE_UINT, .uintValue = &gConfig.saveFlushInterval},
+    {.name = "rtc_deterministic",   .type = CONFIG_TYPE_BOOL, .boolValue = &gConfig.rtcDeterministic},
+    {.name = "lazy_rom_loading",    .type = CONFIG_TYPE_BOOL, .boolValue = &gConfig.lazyRomLoading},
+    {.name = "render_mode",         .type = CONFIG_TYPE_UINT, .uintValue = &gConfig.renderMode},
+    {.name = "renderer",            .type = CONFIG_TYPE_UINT, .uintValue = &gConfig.renderer},
     {.name = "key_a",               .type = CONFIG_TYPE_UINT, .uintValue = &gConfig.keys.a},
     {.name = "key_b",               .type = CONFIG_TYPE_UINT, .uintValue = &gConfig.keys.b},
     {.name = "key_start",           .type = CONFIG_TYPE_UINT, .uintValue = &gConfig.keys.start},
@@ -231,7 +244,9 @@ void config_save(const char *filename)
         return;
     }
     
+#ifdef FRONTEND_WINDOWS
     dbg_printf("gConfig.colorPalette = %u\n", gConfig.colorPalette);
+#endif
     for (unsigned int i = 0; i < ARRAY_COUNT(options); i++)
     {
         const struct ConfigOption *option = &options[i];
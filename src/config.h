@@ -26,6 +26,12 @@ struct Config
 	bool snapWindowSize;
     unsigned int colorPalette;
 #endif
+    unsigned int runAheadFrames;
+    unsigned int saveFlushInterval;
+    bool rtcDeterministic;
+    bool lazyRomLoading;
+    unsigned int renderMode;
+    unsigned int renderer;
 	struct ConfigKeys keys;
 };
 
@@ -1,14 +1,26 @@
+#ifndef _WIN32
+#define _DEFAULT_SOURCE  // For mmap() and MAP_ANONYMOUS under -std=c11
+#define USE_MMAP
+#endif
+
 #include <assert.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef USE_MMAP
+#include <sys/mman.h>
+#endif
 
 #include "global.h"
+#include "archive.h"
+#include "audio.h"
+#include "cheats.h"
 #include "gameboy.h"
 #include "gpu.h"
 #include "memory.h"
+#include "saveram.h"
 #include "platform/platform.h"
 
 struct Registers regs;
@@ -39,11 +51,226 @@ static bool needUpdateTiles;
 #define INTR_FLAG_JOYPAD (1 << 4)
 
 uint8_t joypadState;
+static unsigned int (*joypadCallback)(void);
+static bool joypadLatched;
 uint32_t cpuClock;
-uint32_t gpuClock;
 uint32_t timerClock;
 uint32_t timerClock2;
 
+static unsigned int runAheadFrames;
+static uint8_t *runAheadState;
+static unsigned int renderer = RENDERER_SCANLINE;
+
+static size_t romMapSize;  // size of the gamePAK mapping, or 0 if it was malloc'ed
+static bool lazyRomLoading;
+static size_t archiveImageSize;  // Unpadded size of a ROM loaded from an archive
+
+//------------------------------------------------------------------------------
+// ROM Loading
+//------------------------------------------------------------------------------
+
+#ifdef USE_MMAP
+// Maps the ROM file read-only, so the image is paged in on demand and shared
+// through the page cache with anything else that has the same file open.
+// The file is mapped over an anonymous reservation of the padded size so that
+// the padding past the end of the file reads as zeroes instead of faulting.
+static bool map_rom_file(FILE *file, size_t fileSize, size_t paddedSize)
+{
+    uint8_t *base = mmap(NULL, paddedSize, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    
+    if (base == MAP_FAILED)
+        return false;
+    if (mmap(base, fileSize, PROT_READ, MAP_SHARED | MAP_FIXED, fileno(file), 0) == MAP_FAILED)
+    {
+        munmap(base, paddedSize);
+        return false;
+    }
+    gamePAK = base;
+    romMapSize = paddedSize;
+    return true;
+}
+#endif
+
+// Returns the size of a ROM image padded to a power of two number of banks,
+// at least two
+static size_t set_rom_size(size_t size)
+{
+    gRomInfo.romBankCount = 2;
+    while ((size_t)gRomInfo.romBankCount * 0x4000 < size)
+        gRomInfo.romBankCount *= 2;
+    gRomInfo.romBanksLoaded = gRomInfo.romBankCount;
+    return (size_t)gRomInfo.romBankCount * 0x4000;
+}
+
+static void unload_rom_file(void)
+{
+    archive_close();
+#ifdef USE_MMAP
+    if (romMapSize != 0)
+        munmap((void *)gamePAK, romMapSize);
+    else
+#endif
+        free((void *)gamePAK);
+    gamePAK = NULL;
+}
+
+// Makes sure the first count banks of a lazily loaded ROM are extracted.
+// Deflate streams can only be decompressed in order, so this also extracts
+// every bank before them.
+void gameboy_load_rom_banks(unsigned int count)
+{
+    size_t end = MIN((size_t)count * 0x4000, archiveImageSize);
+    
+    if (count <= gRomInfo.romBanksLoaded)
+        return;
+    dbg_printf("extracting ROM banks up to 0x%X\n", count - 1);
+    if (!archive_extract((uint8_t *)gamePAK, end))
+        platform_fatal_error("Failed to extract ROM '%s'", gRomInfo.romFileName);
+    gRomInfo.romBanksLoaded = count;
+    if (end == archiveImageSize)
+    {
+        // The rest is padding
+        archive_close();
+        gRomInfo.romBanksLoaded = gRomInfo.romBankCount;
+    }
+}
+
+// Loads the ROM image from a gzip or zip file. Either the whole image is
+// decompressed up front, or with lazy loading only the first two banks are,
+// and the rest follow as the game selects them.
+static bool load_rom_archive(FILE *file)
+{
+    size_t imageSize;
+    size_t paddedSize;
+    uint8_t *buffer;
+    
+    if (!archive_open(file, &imageSize))
+        return false;
+    paddedSize = set_rom_size(imageSize);
+#ifdef USE_MMAP
+    // Pages of banks that are never extracted are never touched, so they
+    // don't take up any memory
+    buffer = mmap(NULL, paddedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffer == MAP_FAILED)
+        buffer = NULL;
+    romMapSize = paddedSize;
+#else
+    buffer = calloc(paddedSize, 1);
+    romMapSize = 0;
+#endif
+    if (buffer == NULL)
+    {
+        archive_close();
+        return false;
+    }
+    gamePAK = buffer;
+    archiveImageSize = imageSize;
+    if (!archive_extract(buffer, lazyRomLoading ? 0x8000 : imageSize))
+    {
+        unload_rom_file();
+        return false;
+    }
+    if (lazyRomLoading && imageSize > 0x8000)
+        gRomInfo.romBanksLoaded = 2;
+    else
+        archive_close();
+    return true;
+}
+
+// Loads the ROM image into gamePAK, padded with zeroes to a power of two
+// number of banks (at least two). The MBCs mask bank numbers with
+// romBankCount - 1, so no bank select can reach past the end of the image.
+static bool load_rom_file(const char *filename)
+{
+    FILE *file = fopen(filename, "rb");
+    long fileSize;
+    size_t paddedSize;
+    uint8_t *buffer;
+    
+    if (file == NULL)
+        return false;
+    if (archive_probe(file))
+        return load_rom_archive(file);
+    if (fseek(file, 0, SEEK_END) != 0 || (fileSize = ftell(file)) <= 0
+     || fseek(file, 0, SEEK_SET) != 0)
+    {
+        fclose(file);
+        return false;
+    }
+    paddedSize = set_rom_size(fileSize);
+    
+#ifdef USE_MMAP
+    if (map_rom_file(file, fileSize, paddedSize))
+    {
+        fclose(file);
+        return true;
+    }
+#endif
+    // Fall back to reading the whole file into memory
+    buffer = calloc(paddedSize, 1);
+    if (buffer == NULL || fread(buffer, 1, fileSize, file) != (size_t)fileSize)
+    {
+        free(buffer);
+        fclose(file);
+        return false;
+    }
+    fclose(file);
+    gamePAK = buffer;
+    romMapSize = 0;
+    return true;
+}
+
+// Extracts the banks of ROMs loaded from archives only when the game first
+// selects them, so large ROMs start faster. Takes effect on the next ROM.
+void gameboy_set_lazy_rom_loading(bool lazy)
+{
+    lazyRomLoading = lazy;
+}
+
+// Games that only show right with the slower pixel FIFO renderer. Quirks are
+// looked up once when the ROM is loaded. An entry matches titles that start
+// with its title, and a headerChecksum of -1 matches any revision.
+static const struct
+{
+    const char *title;
+    int headerChecksum;
+    uint8_t quirks;
+} quirkTable[] =
+{
+    {"PREHISTORIK", -1, QUIRK_PIXEL_FIFO},  // Changes BGP mid-line to shade its text
+};
+
+static uint8_t lookup_quirks(void)
+{
+    for (unsigned int i = 0; i < ARRAY_COUNT(quirkTable); i++)
+    {
+        if (strncmp(gRomInfo.gameTitle, quirkTable[i].title, strlen(quirkTable[i].title)) == 0
+         && (quirkTable[i].headerChecksum < 0 || quirkTable[i].headerChecksum == gRomInfo.headerChecksum))
+            return quirkTable[i].quirks;
+    }
+    return 0;
+}
+
+static void update_renderer(void)
+{
+    gpu_set_pixel_fifo(renderer == RENDERER_PIXEL_FIFO || (gRomInfo.quirks & QUIRK_PIXEL_FIFO));
+}
+
+// Returns the '.' that starts the extension of the file name at the end of
+// path, or NULL if it has none
+static char *find_extension(char *path)
+{
+    char *ext = strrchr(path, '.');
+    
+    if (ext == NULL || strchr(ext, '/') != NULL)
+        return NULL;
+#ifdef _WIN32
+    if (strchr(ext, '\\') != NULL)
+        return NULL;
+#endif
+    return ext;
+}
+
 static void initialize_cart_info(const char *filename)
 {
     static const char *const mapperNames[] =
@@ -69,6 +296,7 @@ static void initialize_cart_info(const char *filename)
         [0x0B] = {MAPPER_MMM01, 0},
         [0x0C] = {MAPPER_MMM01, CART_FLAG_SRAM},
         [0x0D] = {MAPPER_MMM01, CART_FLAG_SRAM | CART_FLAG_BATTERY},
+        [0x0F] = {MAPPER_MBC3,  CART_FLAG_TIMER | CART_FLAG_BATTERY},
         [0x10] = {MAPPER_MBC3,  CART_FLAG_TIMER | CART_FLAG_RAM | CART_FLAG_BATTERY},
         [0x12] = {MAPPER_MBC3,  CART_FLAG_RAM},
         [0x13] = {MAPPER_MBC3,  CART_FLAG_RAM | CART_FLAG_BATTERY},
@@ -99,6 +327,8 @@ static void initialize_cart_info(const char *filename)
         gRomInfo.ramSizeKbyte = ramSizes[gamePAK[0x149]];
     else
         gRomInfo.ramSizeKbyte = 0;
+    gRomInfo.headerChecksum = gamePAK[0x14D];
+    gRomInfo.quirks = lookup_quirks();
     
     dbg_puts("ROM INFO:");
     dbg_printf("File Name: '%s'\n", gRomInfo.romFileName);
@@ -124,54 +354,55 @@ static void initialize_cart_info(const char *filename)
             dbg_fputs("+SRAM", stdout);
         if (flags & CART_FLAG_RUMBLE)
             dbg_fputs("+RUMBLE", stdout);
+        if (flags & CART_FLAG_TIMER)
+            dbg_fputs("+TIMER", stdout);
         dbg_puts(")");
     }
     dbg_printf("Game Boy Color: %s\n", gRomInfo.isGameBoyColor ? "yes" : "no");
     dbg_printf("Nintendo Logo: %s\n", gRomInfo.logoCheck ? "OK" : "FAILED");
     dbg_printf("RAM size: %uKByte (%u)\n", gRomInfo.ramSizeKbyte, gamePAK[0x149]);
+    dbg_printf("Quirks: 0x%02X\n", gRomInfo.quirks);
     
     if (gRomInfo.mapper == MAPPER_UNKNOWN)
         platform_fatal_error("Unknown cartridge type: 0x%02X", gRomInfo.cartridgeType);
     else if (gRomInfo.mapper == MAPPER_MBC2 || gRomInfo.mapper == MAPPER_MMM01)
         platform_fatal_error("Mapper %s is not supported", mapperNames[gRomInfo.mapper]);
-    memory_initialize_mapper();
     if (gRomInfo.cartridgeFlags & CART_FLAG_BATTERY)
     {
         char *ext;
         
         strcpy(gRomInfo.saveFileName, gRomInfo.romFileName);
-        ext = strrchr(gRomInfo.saveFileName, '.');
+        ext = find_extension(gRomInfo.saveFileName);
+        // Share the save file with an uncompressed copy of the ROM
+        if (ext != NULL && (strcmp(ext, ".gz") == 0 || strcmp(ext, ".zip") == 0))
+        {
+            *ext = '\0';
+            if (find_extension(gRomInfo.saveFileName) != NULL)
+                ext = find_extension(gRomInfo.saveFileName);
+        }
         if (ext == NULL)
             ext = gRomInfo.saveFileName + strlen(gRomInfo.saveFileName) - 1;
         if (ext + 5 < gRomInfo.saveFileName + sizeof(gRomInfo.saveFileName))
             strcpy(ext, ".sav");
         else
             platform_fatal_error("Cannot save. File name is too long.");
-        memory_load_save_file(gRomInfo.saveFileName);
     }
+    memory_initialize_mapper();
 }
 
 bool gameboy_load_rom(const char *filename)
 {
-    FILE *file;
-    size_t fileSize;
-
-    file = fopen(filename, "rb");
-    if (file == NULL)
+    if (!load_rom_file(filename))
         return false;
-    fseek(file, 0, SEEK_END);
-    fileSize = ftell(file);
-    gamePAK = malloc(fileSize);
-    fseek(file, 0, SEEK_SET);
-    fread(gamePAK, 1, fileSize, file);
-    fclose(file);
     initialize_cart_info(filename);
+    update_renderer();
     
     memset(vram, 0, sizeof(vram));
-    memset(eram, 0, sizeof(eram));
+    gpu_invalidate_tiles();
     memset(iwram, 0, sizeof(iwram));
     memset(io, 0, sizeof(io));
     memset(oam, 0, sizeof(oam));
+    gpu_invalidate_sprites();
     memset(hram, 0, sizeof(hram));
     
     REG_TAC = 0xF8;
@@ -182,8 +413,10 @@ bool gameboy_load_rom(const char *filename)
     cpuClock = 0;
     gpuClock = 0;
     timerClock = 0;
+    audio_init();
     rom0 = gamePAK;
     rom1 = gamePAK + 0x4000;
+    memory_init_page_tables();
     regs.af = 0x01B0;
     regs.bc = 0x0013;
     regs.de = 0x00D8;
@@ -199,9 +432,65 @@ bool gameboy_load_rom(const char *filename)
 
 void gameboy_close_rom(void)
 {
-    if (gRomInfo.cartridgeFlags & CART_FLAG_BATTERY)
-        memory_save_save_file(gRomInfo.saveFileName);
-    free(gamePAK);
+    cheats_clear();
+    memory_clear_watches();
+    memory_close_mapper();
+    unload_rom_file();
+    free(runAheadState);
+    runAheadState = NULL;
+}
+
+//------------------------------------------------------------------------------
+// Save States
+//------------------------------------------------------------------------------
+
+// Returns the size of a save state. The state only holds what can't be derived
+// from the rest of it, since its size bounds how fast run-ahead and snapshots
+// can copy a machine. It is VRAM (8KByte), WRAM (8KByte), cartridge RAM
+// (0-128KByte, as the header says), OAM, I/O and HRAM (under 0.5KByte), and
+// the CPU, MBC, APU and PPU registers (about 200 bytes), so about 25KByte for
+// a cartridge with 8KByte of RAM. The decoded tile cache in gpu.c is rebuilt
+// from VRAM on load instead of being stored.
+size_t gameboy_state_size(void)
+{
+    return sizeof(regs) + sizeof(interruptsEnabled) + sizeof(cpuHalted)
+      + sizeof(cpuClock) + sizeof(timerClock) + sizeof(timerClock2)
+      + memory_state_size() + audio_state_size() + gpu_state_size();
+}
+
+// Captures the whole machine state into buffer, which must be at least
+// gameboy_state_size() bytes. The state is only meant to be loaded back into
+// the same process with the same ROM loaded.
+void gameboy_save_state(void *buffer)
+{
+    uint8_t *p = buffer;
+    
+    STATE_SAVE(p, regs);
+    STATE_SAVE(p, interruptsEnabled);
+    STATE_SAVE(p, cpuHalted);
+    STATE_SAVE(p, cpuClock);
+    STATE_SAVE(p, timerClock);
+    STATE_SAVE(p, timerClock2);
+    p = memory_save_state(p);
+    p = audio_save_state(p);
+    p = gpu_save_state(p);
+    assert(p == (uint8_t *)buffer + gameboy_state_size());
+}
+
+void gameboy_load_state(const void *buffer)
+{
+    const uint8_t *p = buffer;
+    
+    STATE_LOAD(p, regs);
+    STATE_LOAD(p, interruptsEnabled);
+    STATE_LOAD(p, cpuHalted);
+    STATE_LOAD(p, cpuClock);
+    STATE_LOAD(p, timerClock);
+    STATE_LOAD(p, timerClock2);
+    p = memory_load_state(p);
+    p = audio_load_state(p);
+    p = gpu_load_state(p);
+    assert(p == (const uint8_t *)buffer + gameboy_state_size());
 }
 
 void dump_regs(void)
@@ -248,6 +537,23 @@ void gameboy_joypad_release(unsigned int keys)
     joypadState &= ~keys;
 }
 
+void gameboy_set_joypad_callback(unsigned int (*callback)(void))
+{
+    joypadCallback = callback;
+}
+
+// Called when the game reads the JOYP register. If the frontend supplied a
+// callback, it is asked for the current button state, but only on the first
+// read of each frame so that polling loops don't hammer the frontend.
+void gameboy_joypad_latch(void)
+{
+    if (joypadCallback != NULL && !joypadLatched)
+    {
+        joypadState = joypadCallback();
+        joypadLatched = true;
+    }
+}
+
 static void update_clocks(unsigned int val)
 {
     cpuClock += val;
@@ -1756,10 +2062,9 @@ static void cpu_step(void)
         break;
       case 2:
         {
-            uint16_t operand;
+            uint16_t operand = memory_read_word(regs.pc);
             
-            operand = memory_read_byte(regs.pc++);
-            operand |= memory_read_byte(regs.pc++) << 8;
+            regs.pc += 2;
             instr->func2op(operand);
         }
         break;
@@ -1816,15 +2121,6 @@ static void dispatch_interrupts(void)
     }
 }
 
-//------------------------------------------------------------------------------
-// Audio
-//------------------------------------------------------------------------------
-
-static void audio_step(void)
-{
-    // TODO: implement audio
-}
-
 //------------------------------------------------------------------------------
 // Timer
 //------------------------------------------------------------------------------
@@ -1884,25 +2180,153 @@ static void timer_step(void)
     }
 }
 
-void gameboy_run_frame(void)
+static void run_frame(uint8_t *frameBuffer, size_t pitch)
 {
-    gpu_frame_init();
+    gpu_frame_init(frameBuffer, pitch);
     while (!gpuFrameDone)
     {
         cpu_step();
         gpu_step();
-        audio_step();
         timer_step();
         dispatch_interrupts();
     }
-    platform_draw_done();
+    audio_end_frame();
+    memory_end_frame();
+}
+
+// Sets how many frames to run ahead of the real emulation. Each frame, the
+// emulator runs the real frame without showing it, then runs this many more
+// frames with the same input and shows the last one before rewinding to the
+// real frame. This hides that many frames of the game's own input lag, at the
+// cost of emulating (frames + 1) frames per frame.
+void gameboy_set_run_ahead(unsigned int frames)
+{
+    runAheadFrames = frames;
+}
+
+// Makes frames come out in format, with the shades from white to black shown
+// as the RGB colors in palette. The palette is ignored for
+// PIXEL_FORMAT_INDEXED8, the default.
+void gameboy_set_screen_format(unsigned int format, const uint8_t palette[4][3])
+{
+    gpu_set_screen_format(format, palette);
+}
+
+// Sets when frames are drawn, as one of the RENDER_MODE constants. Frames are
+// the same in every mode; they differ in how the work is scheduled. Returns
+// false if the mode isn't available in this build.
+bool gameboy_set_render_mode(unsigned int mode)
+{
+    return gpu_set_render_mode(mode);
+}
+
+// Sets how lines are drawn, as one of the RENDERER constants. Games with
+// QUIRK_PIXEL_FIFO use the pixel FIFO whichever is set.
+void gameboy_set_renderer(unsigned int which)
+{
+    renderer = which;
+    if (gamePAK != NULL)
+        update_renderer();
+}
+
+// Sets how often battery-backed RAM is written to the save file while the
+// game runs. 0 only writes it when the game disables cartridge RAM after
+// saving, and when the ROM is closed.
+void gameboy_set_save_flush_interval(unsigned int seconds)
+{
+    saveram_set_flush_interval(seconds * 60);
+}
+
+// Makes the cartridge clock count emulated time instead of host time, so that
+// runs with the same input are reproducible. Should be set before loading a
+// ROM, as the time that passed since the game was saved is only added when
+// the clock follows the host.
+void gameboy_set_deterministic_rtc(bool deterministic)
+{
+    memory_set_deterministic_rtc(deterministic);
+}
+
+// Adds a Game Genie (ABC-DEF or ABC-DEF-GHI) or GameShark (01VVLLHH) code to
+// the loaded ROM. Cheats stay active until cleared or the ROM is closed.
+bool gameboy_add_cheat(const char *code)
+{
+    if (gamePAK == NULL)
+        return false;
+    return cheats_add(code);
+}
+
+void gameboy_clear_cheats(void)
+{
+    cheats_clear();
+}
+
+// Calls callback once per frame with the writes made to start-end (inclusive)
+// during it. Returns an id for gameboy_remove_watch(), or -1 on failure.
+int gameboy_add_watch(uint16_t start, uint16_t end,
+  void (*callback)(const struct MemoryWatchEvent *events, unsigned int count, void *userData), void *userData)
+{
+    return memory_add_watch(start, end, callback, userData);
+}
+
+void gameboy_remove_watch(int id)
+{
+    memory_remove_watch(id);
+}
+
+void gameboy_run_frame(void)
+{
+    uint8_t *frameBuffer;
+    size_t pitch;
+    
+    joypadLatched = false;
+    if (runAheadFrames == 0)
+    {
+        frameBuffer = platform_get_framebuffer(&pitch);
+        run_frame(frameBuffer, pitch);
+        memory_deliver_watch_events();
+        platform_draw_done(gpu_get_frame_changes());
+        saveram_end_frame();
+        return;
+    }
+    
+    if (runAheadState == NULL)
+    {
+        runAheadState = malloc(gameboy_state_size());
+        if (runAheadState == NULL)
+            platform_fatal_error("Failed to allocate memory for run-ahead");
+    }
+    run_frame(NULL, 0);  // Frames that aren't shown aren't drawn
+    memory_deliver_watch_events();
+    gameboy_save_state(runAheadState);
+    audio_set_muted(true);
+    memory_set_watches_muted(true);
+    for (unsigned int i = 1; i < runAheadFrames; i++)
+        run_frame(NULL, 0);
+    frameBuffer = platform_get_framebuffer(&pitch);
+    run_frame(frameBuffer, pitch);
+    audio_set_muted(false);
+    memory_set_watches_muted(false);
+    platform_draw_done(gpu_get_frame_changes());
+    gameboy_load_state(runAheadState);
+    saveram_end_frame();
+}
+
+// Runs a frame like gameboy_run_frame(), but without drawing it or presenting
+// it to the frontend, for frames that wouldn't be seen anyway, like most of
+// them while fast-forwarding. Everything but making the pixels is emulated as
+// usual. With run-ahead, only the real frame is run.
+void gameboy_skip_frame(void)
+{
+    joypadLatched = false;
+    run_frame(NULL, 0);
+    memory_deliver_watch_events();
+    saveram_end_frame();
 }
 
 void gameboy_step(void)
 {
     cpu_step();
     gpu_step();
-    audio_step();
     timer_step();
     dispatch_interrupts();
 }
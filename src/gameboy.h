@@ -4,6 +4,30 @@
 #define GB_DISPLAY_WIDTH 160
 #define GB_DISPLAY_HEIGHT 144
 
+// Formats the PPU can write frame buffers in
+enum
+{
+    PIXEL_FORMAT_INDEXED8,  // Shades 0 (white) to 3 (black), one byte each
+    PIXEL_FORMAT_RGB565,    // Native-endian 16-bit words
+    PIXEL_FORMAT_XRGB8888,  // Native-endian 32-bit words, 0x00RRGGBB
+    PIXEL_FORMAT_RGB24,     // Red, green and blue bytes
+};
+
+// When the PPU draws lines
+enum
+{
+    RENDER_MODE_INLINE,    // As each line is scanned out
+    RENDER_MODE_DEFERRED,  // All of them when vblank starts
+    RENDER_MODE_THREAD,    // On a thread of their own, overlapped with emulation
+};
+
+// How the PPU draws lines
+enum
+{
+    RENDERER_SCANLINE,    // A line at a time, with fixed mode lengths
+    RENDERER_PIXEL_FIFO,  // A dot at a time, for games that change registers mid-line
+};
+
 struct Registers
 {
     union
@@ -59,14 +83,23 @@ struct RomInfo
     uint16_t ramSizeKbyte;
     uint8_t mapper;
     uint8_t cartridgeFlags;
+    uint8_t headerChecksum;
+    uint8_t quirks;
+    unsigned int romBankCount;  // power of two, after padding the image
+    unsigned int romBanksLoaded;  // Less than romBankCount while an archive is being extracted
 };
 
+#define CPU_CLOCK_RATE 4194304
+
 #define CART_FLAG_RAM     (1 << 0)
 #define CART_FLAG_SRAM    (1 << 1)
 #define CART_FLAG_BATTERY (1 << 2)
 #define CART_FLAG_RUMBLE  (1 << 3)
 #define CART_FLAG_TIMER   (1 << 4)
 
+// Game-specific behavior, see the quirk table in gameboy.c
+#define QUIRK_PIXEL_FIFO (1 << 0)  // Needs the pixel FIFO renderer
+
 extern struct RomInfo gRomInfo;
 
 #define KEY_A_BUTTON      (1 << 0)
@@ -78,13 +111,51 @@ extern struct RomInfo gRomInfo;
 #define KEY_DPAD_UP       (1 << 6)
 #define KEY_DPAD_DOWN     (1 << 7)
 
+// A write to a watched address. cycle is the value of cpuClock at the time.
+struct MemoryWatchEvent
+{
+    uint16_t addr;
+    uint8_t oldVal;
+    uint8_t newVal;
+    uint32_t cycle;
+};
+
+// The rows of a frame that differ from what was in the frame buffer before it
+// was drawn, so that frontends can present just those, or nothing at all
+struct FrameChanges
+{
+    unsigned int firstRow;  // Every changed row is in firstRow to endRow - 1,
+    unsigned int endRow;    // which is empty if none changed
+    bool rows[GB_DISPLAY_HEIGHT];
+};
+
 extern uint8_t joypadState;
+extern uint32_t cpuClock;
 
 bool gameboy_load_rom(const char *filename);
 void gameboy_close_rom(void);
 void dump_regs(void);
 void gameboy_run_frame(void);
+void gameboy_skip_frame(void);
+void gameboy_set_run_ahead(unsigned int frames);
+void gameboy_set_screen_format(unsigned int format, const uint8_t palette[4][3]);
+void gameboy_set_save_flush_interval(unsigned int seconds);
+void gameboy_set_deterministic_rtc(bool deterministic);
+void gameboy_set_lazy_rom_loading(bool lazy);
+bool gameboy_set_render_mode(unsigned int mode);
+void gameboy_set_renderer(unsigned int which);
+void gameboy_load_rom_banks(unsigned int count);
+bool gameboy_add_cheat(const char *code);
+void gameboy_clear_cheats(void);
+int gameboy_add_watch(uint16_t start, uint16_t end,
+  void (*callback)(const struct MemoryWatchEvent *events, unsigned int count, void *userData), void *userData);
+void gameboy_remove_watch(int id);
+size_t gameboy_state_size(void);
+void gameboy_save_state(void *buffer);
+void gameboy_load_state(const void *buffer);
 void gameboy_joypad_press(unsigned int keys);
 void gameboy_joypad_release(unsigned int keys);
+void gameboy_set_joypad_callback(unsigned int (*callback)(void));
+void gameboy_joypad_latch(void);
 
 #endif  // GUARD_GAMEBOY_H
@@ -14,6 +14,12 @@
 #define UNUSED(a) (void)(a)
 #undef MAX
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
+#undef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+// Copy a variable into or out of a save state buffer, advancing the pointer
+#define STATE_SAVE(p, var) (memcpy((p), &(var), sizeof(var)), (p) += sizeof(var))
+#define STATE_LOAD(p, var) (memcpy(&(var), (p), sizeof(var)), (p) += sizeof(var))
 
 #define APPNAME "Game Boy Emulator"
 
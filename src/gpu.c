@@ -2,479 +2,1173 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "global.h"
+#include "cheats.h"
 #include "gameboy.h"
 #include "gpu.h"
 #include "memory.h"
 #include "platform/platform.h"
+#include "ringbuf.h"
 
 #define LCDC_DISP_ENABLE (1 << 7)
 #define LCDC_BG_TILE_DATA (1 << 4)
 #define LCDC_BG_TILE_MAP (1 << 3)
 
+// The compositor's SIMD paths are built with per-function target attributes
+// and chosen at run time, so the rest of the program needs no -m flags
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define GPU_X86_SIMD
+#define ATTRIBUTE_TARGET(t) __attribute__((target(t)))
+#include <immintrin.h>
+#endif
+
+#if !defined(__STDC_NO_THREADS__) && defined(__has_include)
+#if __has_include(<threads.h>)
+#define GPU_RENDER_THREAD
+#include <threads.h>
+#endif
+#endif
+
 uint32_t gpuClock;
 bool gpuFrameDone;
 static uint8_t *frameBuffer;
-static const void *screenPalette;
-static unsigned int screenBytesPerPixel;
-static uint8_t screenTileData[384][8][8];
+static size_t frameBufferPitch;
+static unsigned int screenFormat = PIXEL_FORMAT_INDEXED8;
+static uint8_t screenLine[GB_DISPLAY_WIDTH] ATTRIBUTE_ALIGNED(32);  // Shades, before they're written out
+static struct FrameChanges frameChanges;
+static uint16_t screenColors16[4];
+static uint32_t screenColors32[4];
+static uint8_t screenColors24[4][3];
+static uint8_t screenTileData[384][8][8];  // VRAM tiles decoded to one byte per pixel
+static uint8_t dirtyTileRows[384];         // Bit n set if row n must be decoded again
+static unsigned long tileRowsDecoded;      // For benchmarking the caches
+static unsigned long layerRowsDrawn;
+static unsigned int renderMode = RENDER_MODE_INLINE;
+static const uint8_t *drawVram = vram;  // What lines are drawn from: VRAM and OAM, or
+static const uint8_t *drawOam = oam;    // copies of them
+static bool oamChanged;                 // OAM changed since the last line was logged or sent
 static void (*gpuFunc)(void);
+static unsigned int hblankLength = 204;  // Dots in mode 0, which get fewer as mode 3 gets longer
+
+// The registers a line is drawn with, as they were when it was drawn
+struct LineState
+{
+    uint8_t *dest;
+    uint8_t scanline;
+    uint8_t lcdc;
+    uint8_t scx;
+    uint8_t scy;
+    uint8_t wx;
+    uint8_t wy;
+    uint8_t bgp;
+    uint8_t obp0;
+    uint8_t obp1;
+};
 
 static void gpu_state_oam_search(void);
 static void gpu_state_data_transfer(void);
+static void gpu_state_fifo_transfer(void);
 static void gpu_state_hblank(void);
 static void gpu_state_vblank(void);
 
-// TODO: Optimize this
-
-static void render_scanline(unsigned int scanline)
+// Tiles are decoded a row at a time, and only when a scanline uses a row that
+// was written to since it was last decoded. Loading a tile thus costs one
+// decode per row rather than one per byte written, and tiles that are loaded
+// but not shown this frame cost nothing.
+static void decode_tile_row(unsigned int tileNum, unsigned int y)
 {
-    const uint8_t bgPalette[] =
-    {
-        REG_BGP & 3,
-        (REG_BGP >> 2) & 3,
-        (REG_BGP >> 4) & 3,
-        (REG_BGP >> 6) & 3,
-    };
-    const uint8_t objPalette0[] =
+    uint8_t tileData1 = drawVram[tileNum * 16 + y * 2 + 0];
+    uint8_t tileData2 = drawVram[tileNum * 16 + y * 2 + 1];
+    
+    for (unsigned int x = 0; x < 8; x++)
     {
-        0,
-        (REG_OBP0 >> 2) & 3,
-        (REG_OBP0 >> 4) & 3,
-        (REG_OBP0 >> 6) & 3,
-    };
-    const uint8_t objPalette1[] =
+        unsigned int bit = 7 - x;
+        
+        screenTileData[tileNum][y][x] = ((tileData1 >> bit) & 1) | (((tileData2 >> bit) & 1) << 1);
+    }
+    dirtyTileRows[tileNum] &= ~(1 << y);
+    tileRowsDecoded++;
+}
+
+static inline const uint8_t *get_tile_row(unsigned int tileNum, unsigned int y)
+{
+    if (dirtyTileRows[tileNum] & (1 << y))
+        decode_tile_row(tileNum, y);
+    return screenTileData[tileNum][y];
+}
+
+//------------------------------------------------------------------------------
+// Line compositing
+//------------------------------------------------------------------------------
+
+// The background and window are drawn from layers: each of the two tile maps
+// rendered to a 256x256 image of color numbers, once for each way LCDC bit 4
+// can address tile data. A line is then a wrapped copy of one layer row,
+// mapped through the palette 16 or 32 pixels at a time. Layer rows are filled
+// in 8 pixels at a time, from decoded tile rows, as lines use them.
+//
+// Each map entry has a mask of the pixel rows that are up to date in each
+// layer. A map entry is known to have changed when it no longer has the tile
+// number the layer was drawn with, which leaves tile map writes as plain
+// memory writes. Tile data writes are collected in changedTileRows, and taken
+// out of the masks of every entry using those tiles before the next line.
+
+struct TileLayer
+{
+    uint8_t pixels[256][256];
+    uint8_t rowsValid[32][32];  // Bit n set if pixel row n of the entry is drawn
+};
+
+static struct TileLayer tileLayers[2][2];  // Indexed by tile map, then tile data addressing
+static uint8_t layerTileNums[2][32][32];   // Map entries the layers were drawn with
+static uint8_t changedTileRows[384];       // Tile rows written since the last sync
+static bool tilesChanged;
+static unsigned int compositor = COMPOSITOR_COUNT;  // Not chosen yet
+static void (*map_palette)(uint8_t *dest, const uint8_t *src, unsigned int count, const uint8_t *palette);
+
+// Tile numbers 0-127 refer to tiles 256-383 when LCDC bit 4 is clear
+static unsigned int get_map_tile(unsigned int tileNum, unsigned int addressing)
+{
+    return (addressing == 0) ? tileNum : (unsigned int)(256 + (int8_t)tileNum);
+}
+
+static void sync_layers(void)
+{
+    for (unsigned int map = 0; map < 2; map++)
     {
-        0,
-        (REG_OBP1 >> 2) & 3,
-        (REG_OBP1 >> 4) & 3,
-        (REG_OBP1 >> 6) & 3,
-    };
-    uint8_t *const linePtr = frameBuffer + scanline * GB_DISPLAY_WIDTH;
-    const uint8_t *bgTileMap = vram + ((REG_LCDC & (1 << 3)) ? 0x1C00 : 0x1800);
-    const uint8_t *winTileMap = vram + ((REG_LCDC & (1 << 6)) ? 0x1C00 : 0x1800);
-    unsigned int bgScrollX = REG_SCX;
-    unsigned int bgScrollY = REG_SCY;
-    unsigned int winPosX = REG_WX - 7;
-    unsigned int winPosY = REG_WY;
+        for (unsigned int entry = 0; entry < 32 * 32; entry++)
+        {
+            unsigned int tileNum = layerTileNums[map][entry / 32][entry % 32];
+            
+            for (unsigned int addressing = 0; addressing < 2; addressing++)
+                tileLayers[map][addressing].rowsValid[entry / 32][entry % 32] &= ~changedTileRows[get_map_tile(tileNum, addressing)];
+        }
+    }
+    memset(changedTileRows, 0, sizeof(changedTileRows));
+    tilesChanged = false;
+}
+
+// Returns row y of the layer for map and addressing, with at least count
+// entries starting at column firstCol (wrapping around) up to date
+static const uint8_t *get_layer_row(unsigned int map, unsigned int addressing, unsigned int y, unsigned int firstCol, unsigned int count)
+{
+    struct TileLayer *layer = &tileLayers[map][addressing];
+    const uint8_t *tileNums = drawVram + 0x1800 + map * 0x400 + (y / 8) * 32;
+    uint8_t *drawnTileNums = layerTileNums[map][y / 8];
+    uint8_t *rowsValid = layer->rowsValid[y / 8];
+    unsigned int rowBit = 1 << (y % 8);
     
-    // Render Background
-    if (REG_LCDC & (1 << 4))
+    if (tilesChanged)
+        sync_layers();
+    for (unsigned int i = 0; i < count; i++)
     {
-        unsigned int tileRow = ((scanline + bgScrollY) / 8) % 32;
-        unsigned int tilePixelRow = (scanline + bgScrollY) % 8;
-        const uint8_t *tileNums = bgTileMap + tileRow * 32;
+        unsigned int col = (firstCol + i) % 32;
         
-        for (unsigned int screenX = 0, bgX = bgScrollX; screenX < GB_DISPLAY_WIDTH; screenX++, bgX++)
+        if (tileNums[col] != drawnTileNums[col])
         {
-            unsigned int tileCol = (bgX / 8) % 32;
-            unsigned int tilePixelCol = bgX % 8;
-            unsigned int tileNum = tileNums[tileCol];
-            
-            linePtr[screenX] = bgPalette[screenTileData[tileNum][tilePixelRow][tilePixelCol]];
+            drawnTileNums[col] = tileNums[col];
+            tileLayers[map][0].rowsValid[y / 8][col] = 0;
+            tileLayers[map][1].rowsValid[y / 8][col] = 0;
+        }
+        if (!(rowsValid[col] & rowBit))
+        {
+            memcpy(&layer->pixels[y][col * 8], get_tile_row(get_map_tile(tileNums[col], addressing), y % 8), 8);
+            rowsValid[col] |= rowBit;
+            layerRowsDrawn++;
         }
     }
-    else
+    return layer->pixels[y];
+}
+
+static void map_palette_scalar(uint8_t *dest, const uint8_t *src, unsigned int count, const uint8_t *palette)
+{
+    for (unsigned int i = 0; i < count; i++)
+        dest[i] = palette[src[i]];
+}
+
+#ifdef GPU_X86_SIMD
+
+// SSE2 has no byte shuffle, so each color number is compared against all four
+// and the matching palette entry is selected
+ATTRIBUTE_TARGET("sse2")
+static void map_palette_sse2(uint8_t *dest, const uint8_t *src, unsigned int count, const uint8_t *palette)
+{
+    __m128i colors[4];
+    __m128i shades[4];
+    unsigned int i;
+    
+    for (unsigned int c = 0; c < 4; c++)
+    {
+        colors[c] = _mm_set1_epi8(c);
+        shades[c] = _mm_set1_epi8(palette[c]);
+    }
+    for (i = 0; i + 16 <= count; i += 16)
+    {
+        __m128i pixels = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i out = _mm_setzero_si128();
+        
+        for (unsigned int c = 0; c < 4; c++)
+            out = _mm_or_si128(out, _mm_and_si128(_mm_cmpeq_epi8(pixels, colors[c]), shades[c]));
+        _mm_storeu_si128((__m128i *)(dest + i), out);
+    }
+    map_palette_scalar(dest + i, src + i, count - i, palette);
+}
+
+// The palette is a 4-entry byte shuffle table
+ATTRIBUTE_TARGET("ssse3")
+static void map_palette_ssse3(uint8_t *dest, const uint8_t *src, unsigned int count, const uint8_t *palette)
+{
+    __m128i lut = _mm_setr_epi8(palette[0], palette[1], palette[2], palette[3], 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    unsigned int i;
+    
+    for (i = 0; i + 16 <= count; i += 16)
+    {
+        __m128i pixels = _mm_loadu_si128((const __m128i *)(src + i));
+        
+        _mm_storeu_si128((__m128i *)(dest + i), _mm_shuffle_epi8(lut, pixels));
+    }
+    map_palette_scalar(dest + i, src + i, count - i, palette);
+}
+
+ATTRIBUTE_TARGET("avx2")
+static void map_palette_avx2(uint8_t *dest, const uint8_t *src, unsigned int count, const uint8_t *palette)
+{
+    __m256i lut = _mm256_setr_epi8(
+      palette[0], palette[1], palette[2], palette[3], 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      palette[0], palette[1], palette[2], palette[3], 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    unsigned int i;
+    
+    for (i = 0; i + 32 <= count; i += 32)
+    {
+        __m256i pixels = _mm256_loadu_si256((const __m256i *)(src + i));
+        
+        _mm256_storeu_si256((__m256i *)(dest + i), _mm256_shuffle_epi8(lut, pixels));
+    }
+    map_palette_ssse3(dest + i, src + i, count - i, palette);
+}
+
+#endif  // GPU_X86_SIMD
+
+static const struct
+{
+    const char *name;
+    void (*map_palette)(uint8_t *dest, const uint8_t *src, unsigned int count, const uint8_t *palette);
+} compositors[COMPOSITOR_COUNT] =
+{
+    [COMPOSITOR_SCALAR] = {"scalar", map_palette_scalar},
+#ifdef GPU_X86_SIMD
+    [COMPOSITOR_SSE2]   = {"sse2",   map_palette_sse2},
+    [COMPOSITOR_SSSE3]  = {"ssse3",  map_palette_ssse3},
+    [COMPOSITOR_AVX2]   = {"avx2",   map_palette_avx2},
+#endif
+};
+
+static bool compositor_supported(unsigned int which)
+{
+    if (which >= COMPOSITOR_COUNT || compositors[which].map_palette == NULL)
+        return false;
+#ifdef GPU_X86_SIMD
+    __builtin_cpu_init();
+    if (which == COMPOSITOR_SSE2)
+        return __builtin_cpu_supports("sse2");
+    if (which == COMPOSITOR_SSSE3)
+        return __builtin_cpu_supports("ssse3");
+    if (which == COMPOSITOR_AVX2)
+        return __builtin_cpu_supports("avx2");
+#endif
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// Sprites
+//------------------------------------------------------------------------------
+
+// The sprites on each line are worked out once after OAM changes rather than
+// on every line. Like the PPU, each line takes the first 10 sprites in OAM
+// that overlap it vertically. They are kept in drawing priority order: lower
+// X first, and lower OAM index first among equal X. The OAM fields are copied
+// out into separate arrays for compositing.
+
+#define MAX_LINE_SPRITES 10
+
+static uint8_t spriteYs[40];
+static uint8_t spriteXs[40];
+static uint8_t spriteTileNums[40];
+static uint8_t spriteFlags[40];
+static uint8_t spriteLines[GB_DISPLAY_HEIGHT][MAX_LINE_SPRITES];  // OAM indexes, highest priority first
+static uint8_t spriteLineCounts[GB_DISPLAY_HEIGHT];
+static unsigned int spriteLinesHeight;  // Sprite height the lines are for, or 0 if OAM changed
+
+static void build_sprite_lines(unsigned int height)
+{
+    const struct OamEntry *sprites = (const struct OamEntry *)drawOam;
+    
+    memset(spriteLineCounts, 0, sizeof(spriteLineCounts));
+    for (unsigned int i = 0; i < 40; i++)
     {
-        unsigned int tileRow = ((scanline + bgScrollY) / 8) % 32;
-        unsigned int tilePixelRow = (scanline + bgScrollY) % 8;
-        const int8_t *tileNums = (int8_t *)bgTileMap + tileRow * 32;
+        int top = sprites[i].y - 16;
         
-        for (unsigned int screenX = 0, bgX = bgScrollX; screenX < GB_DISPLAY_WIDTH; screenX++, bgX++)
+        spriteYs[i] = sprites[i].y;
+        spriteXs[i] = sprites[i].x;
+        spriteTileNums[i] = sprites[i].tileNum;
+        spriteFlags[i] = sprites[i].flags;
+        for (int line = MAX(top, 0); line < MIN(top + (int)height, GB_DISPLAY_HEIGHT); line++)
         {
-            unsigned int tileCol = (bgX / 8) % 32;
-            unsigned int tilePixelCol = bgX % 8;
-            unsigned int tileNum = 256 + tileNums[tileCol];
+            uint8_t *list = spriteLines[line];
+            unsigned int n = spriteLineCounts[line];
             
-            linePtr[screenX] = bgPalette[screenTileData[tileNum][tilePixelRow][tilePixelCol]];
+            if (n == MAX_LINE_SPRITES)
+                continue;
+            // Sprites come in OAM order, so they only go before those with
+            // a greater X
+            for (; n > 0 && spriteXs[list[n - 1]] > sprites[i].x; n--)
+                list[n] = list[n - 1];
+            list[n] = i;
+            spriteLineCounts[line]++;
         }
     }
-    
-    // Render Window
-    if ((REG_LCDC & (1 << 5)) && scanline >= winPosY)
-    {   
-        if (REG_LCDC & (1 << 4))
+    spriteLinesHeight = height;
+}
+
+//------------------------------------------------------------------------------
+// Output formats
+//------------------------------------------------------------------------------
+
+// Lines are put together as shades 0-3 and written to the frontend's buffer,
+// through a table of the four colors in its format unless it takes shades.
+// The frontend then has the finished image with no conversion pass of its
+// own. Each line is compared with what it replaces as it's written, so the
+// frontend also learns which rows it doesn't need to present again.
+
+// Returns whether the line written to dest differs from what was there
+static bool write_screen_line(uint8_t *dest, const uint8_t *shades)
+{
+    switch (screenFormat)
+    {
+      case PIXEL_FORMAT_INDEXED8:
+        if (memcmp(dest, shades, GB_DISPLAY_WIDTH) == 0)
+            return false;
+        memcpy(dest, shades, GB_DISPLAY_WIDTH);
+        return true;
+      case PIXEL_FORMAT_RGB565:
         {
-            unsigned int tileRow = (scanline - winPosY) / 8;
-            unsigned int tilePixelRow = (scanline - winPosY) % 8;
-            const uint8_t *tileNums = winTileMap + tileRow * 32;
+            uint16_t *pixels = (uint16_t *)dest;
+            uint16_t diff = 0;
             
-            for (unsigned int screenX = winPosX, winX = 0; screenX < GB_DISPLAY_WIDTH; screenX++, winX++)
+            for (unsigned int x = 0; x < GB_DISPLAY_WIDTH; x++)
             {
-                unsigned int tileCol = winX / 8;
-                unsigned int tilePixelCol = winX % 8;
-                unsigned int tileNum = tileNums[tileCol];
+                uint16_t color = screenColors16[shades[x]];
                 
-                assert(tileCol < 32);
-                linePtr[screenX] = screenTileData[tileNum][tilePixelRow][tilePixelCol];
+                diff |= pixels[x] ^ color;
+                pixels[x] = color;
             }
+            return diff != 0;
         }
-        else
+      case PIXEL_FORMAT_XRGB8888:
         {
-            unsigned int tileRow = (scanline - winPosY) / 8;
-            unsigned int tilePixelRow = (scanline - winPosY) % 8;
-            const int8_t *tileNums = winTileMap + tileRow * 32;
+            uint32_t *pixels = (uint32_t *)dest;
+            uint32_t diff = 0;
             
-            for (unsigned int screenX = winPosX, winX = 0; screenX < GB_DISPLAY_WIDTH; screenX++, winX++)
+            for (unsigned int x = 0; x < GB_DISPLAY_WIDTH; x++)
             {
-                unsigned int tileCol = winX / 8;
-                unsigned int tilePixelCol = winX % 8;
-                unsigned int tileNum = 256 + tileNums[tileCol];
+                uint32_t color = screenColors32[shades[x]];
                 
-                assert(tileCol < 32);
-                linePtr[screenX] = screenTileData[tileNum][tilePixelRow][tilePixelCol];
+                diff |= pixels[x] ^ color;
+                pixels[x] = color;
             }
+            return diff != 0;
         }
-    }
-    
-    // Render Sprites
-    if (REG_LCDC & (1 << 1))
-    {
-        struct OamEntry *sprite;
-        unsigned int x = 0;
-        unsigned int xMax = 8;
-        
-        for (int i = 39; i >= 0; i--)
+      case PIXEL_FORMAT_RGB24:
         {
-            int spriteX, spriteY;
+            uint8_t diff = 0;
             
-            sprite = &((struct OamEntry *)oam)[i];
-            spriteX = sprite->x - 8;
-            spriteY = sprite->y - 16;
-            if (REG_LCDC & (1 << 2))
+            for (unsigned int x = 0; x < GB_DISPLAY_WIDTH; x++)
             {
-                // 8x16 sprites
-                if ((int)scanline >= spriteY && (int)scanline < spriteY + 16
-                  && spriteX + 8 > 0 && spriteX < GB_DISPLAY_WIDTH)
-                {
-                    unsigned int tilePixelRow = scanline - spriteY;
-                    unsigned int tilePixelCol = 0;
-                    unsigned int tileWidth = 8;
-                    const uint8_t *palette = (sprite->flags & OBJ_FLAG_PAL) ? objPalette1 : objPalette0;
-                    uint8_t tileNum;
-                    uint8_t pixel;
-                    
-                    if (sprite->flags & (1 << 6))
-                        tilePixelRow = 15 - tilePixelRow;
-                    if (tilePixelRow < 8)
-                        tileNum = sprite->tileNum & ~1;
-                    else
-                        tileNum = sprite->tileNum | 1;
-                    tilePixelRow %= 8;
-                    if (spriteX < 0)
-                        tilePixelCol = 0 - spriteX;
-                    else if (spriteX + 8 > GB_DISPLAY_WIDTH)
-                    {
-                        tileWidth = GB_DISPLAY_WIDTH - spriteX;
-                        assert(spriteX + tileWidth == GB_DISPLAY_WIDTH);
-                        if (tileWidth >= 8)
-                        {
-                            printf("spriteX = %i\n", spriteX);
-                            printf("GB_DISPLAY_WIDTH = %i\n", GB_DISPLAY_WIDTH);
-                            printf("tileWidth = %u\n", tileWidth);
-                        }
-                        assert(tileWidth < 8);
-                    }
-                    
-                    if (sprite->flags & OBJ_FLAG_XFLIP)
-                    {
-                        for (; tilePixelCol < tileWidth; tilePixelCol++)
-                        {
-                            assert(spriteX + tilePixelCol < GB_DISPLAY_WIDTH);
-                            pixel = screenTileData[tileNum][tilePixelRow][7 - tilePixelCol];
-                            if (pixel != 0)
-                                linePtr[spriteX + tilePixelCol] = palette[pixel];
-                        }
-                    }
-                    else
-                    {
-                        for (; tilePixelCol < tileWidth; tilePixelCol++)
-                        {
-                            assert(spriteX + tilePixelCol < GB_DISPLAY_WIDTH);
-                            pixel = screenTileData[tileNum][tilePixelRow][tilePixelCol];
-                            if (pixel != 0)
-                                linePtr[spriteX + tilePixelCol] = palette[pixel];
-                        }
-                    }
-                }
-            }
-            else
-            {
-                // 8x8 sprites
-                if ((int)scanline >= spriteY && (int)scanline < spriteY + 8
-                 && spriteX + 8 > 0 && spriteX < GB_DISPLAY_WIDTH)
-                {
-                    unsigned int tilePixelRow = scanline - spriteY;
-                    unsigned int tilePixelCol = 0;
-                    unsigned int tileWidth = 8;
-                    const uint8_t *palette = (sprite->flags & OBJ_FLAG_PAL) ? objPalette1 : objPalette0;
-                    uint8_t pixel;
-                    
-                    assert(tilePixelRow < 8);
-                    if (spriteX < 0)
-                        tilePixelCol = 0 - spriteX;
-                    else if (spriteX + 8 > GB_DISPLAY_WIDTH)
-                    {
-                        tileWidth = GB_DISPLAY_WIDTH - spriteX;
-                        assert(tileWidth < 8);
-                        assert(spriteX + tileWidth == GB_DISPLAY_WIDTH);
-                    }
-                    
-                    if (sprite->flags & OBJ_FLAG_XFLIP)
-                    {
-                        for (; tilePixelCol < tileWidth; tilePixelCol++)
-                        {
-                            assert(spriteX + tilePixelCol < GB_DISPLAY_WIDTH);
-                            pixel = screenTileData[sprite->tileNum][tilePixelRow][7 - tilePixelCol];
-                            if (pixel != 0)
-                                linePtr[spriteX + tilePixelCol] = palette[pixel];
-                        }
-                    }
-                    else
-                    {
-                        for (; tilePixelCol < tileWidth; tilePixelCol++)
-                        {
-                            assert(spriteX + tilePixelCol < GB_DISPLAY_WIDTH);
-                            pixel = screenTileData[sprite->tileNum][tilePixelRow][tilePixelCol];
-                            if (pixel != 0)
-                                linePtr[spriteX + tilePixelCol] = palette[pixel];
-                        }
-                    }
-                }
+                const uint8_t *color = screenColors24[shades[x]];
+                
+                diff |= (dest[x * 3 + 0] ^ color[0]) | (dest[x * 3 + 1] ^ color[1]) | (dest[x * 3 + 2] ^ color[2]);
+                memcpy(dest + x * 3, color, 3);
             }
+            return diff != 0;
         }
     }
+    return true;
 }
 
-/*
-static void render_scanline(unsigned int scanline)
+// Draws a line as the registers in line had it, from the tile map layers and
+// the sprite lines
+static void render_scanline(const struct LineState *line)
 {
     const uint8_t bgPalette[] =
     {
-        REG_BGP & 3,
-        (REG_BGP >> 2) & 3,
-        (REG_BGP >> 4) & 3,
-        (REG_BGP >> 6) & 3,
+        line->bgp & 3,
+        (line->bgp >> 2) & 3,
+        (line->bgp >> 4) & 3,
+        (line->bgp >> 6) & 3,
     };
     const uint8_t objPalette0[] =
     {
         0,
-        (REG_OBP0 >> 2) & 3,
-        (REG_OBP0 >> 4) & 3,
-        (REG_OBP0 >> 6) & 3,
+        (line->obp0 >> 2) & 3,
+        (line->obp0 >> 4) & 3,
+        (line->obp0 >> 6) & 3,
     };
     const uint8_t objPalette1[] =
     {
         0,
-        (REG_OBP1 >> 2) & 3,
-        (REG_OBP1 >> 4) & 3,
-        (REG_OBP1 >> 6) & 3,
+        (line->obp1 >> 2) & 3,
+        (line->obp1 >> 4) & 3,
+        (line->obp1 >> 6) & 3,
     };
-    uint8_t *const linePtr = frameBuffer + scanline * GB_DISPLAY_WIDTH;
-    const uint8_t *tileMap = vram + ((REG_LCDC & (1 << 3)) ? 0x1C00 : 0x1800);
-    const uint8_t *winTileMap = vram + ((REG_LCDC & (1 << 6)) ? 0x1C00 : 0x1800);
-    uint8_t *pix;
-    unsigned int col;
+    uint8_t *const linePtr = screenLine;
+    unsigned int scanline = line->scanline;
+    unsigned int addressing = (line->lcdc & LCDC_BG_TILE_DATA) ? 0 : 1;
+    unsigned int bgTileMap = (line->lcdc & (1 << 3)) ? 1 : 0;
+    unsigned int winTileMap = (line->lcdc & (1 << 6)) ? 1 : 0;
+    unsigned int bgScrollX = line->scx;
+    unsigned int bgScrollY = line->scy;
+    unsigned int winPosX = (line->wx < 7) ? 0 : line->wx - 7;
+    unsigned int winPosY = line->wy;
     
-    // Render background
-    pix = linePtr;
-    if (REG_LCDC & (1 << 4))
-    {
-        unsigned int tileRow = ((scanline + REG_SCY) / 8) % 32;
-        const uint8_t *tileNums = tileMap + tileRow * 32;
-        unsigned int tilePixelRow = (scanline + REG_SCY) % 8;
-        const uint8_t *tilePatternTable = vram;
-        int bit;
-        uint8_t tileData1, tileData2;
+    // Render Background
+    {
+        const uint8_t *layerRow = get_layer_row(bgTileMap, addressing, (scanline + bgScrollY) % 256, bgScrollX / 8, GB_DISPLAY_WIDTH / 8 + 1);
+        unsigned int width = MIN(GB_DISPLAY_WIDTH, 256 - bgScrollX);
         
-        col = REG_SCX / 8;
-        bit = 7 - (REG_SCX % 8);
+        map_palette(linePtr, layerRow + bgScrollX, width, bgPalette);
+        if (width < GB_DISPLAY_WIDTH)
+            map_palette(linePtr + width, layerRow, GB_DISPLAY_WIDTH - width, bgPalette);
+    }
+    
+    // Render Window
+    if ((line->lcdc & (1 << 5)) && scanline >= winPosY && winPosX < GB_DISPLAY_WIDTH)
+    {
+        // With WX below 7, the start of the window is off the left edge
+        unsigned int skip = (line->wx < 7) ? 7 - line->wx : 0;
+        unsigned int width = GB_DISPLAY_WIDTH - winPosX;
+        const uint8_t *layerRow = get_layer_row(winTileMap, addressing, scanline - winPosY, 0, (skip + width + 7) / 8);
+        
+        map_palette(linePtr + winPosX, layerRow + skip, width, bgPalette);
+    }
+    
+    // Render Sprites
+    if (line->lcdc & (1 << 1))
+    {
+        unsigned int height = (line->lcdc & (1 << 2)) ? 16 : 8;
         
-        tileData1 = tilePatternTable[tileNums[col] * 16 + tilePixelRow * 2 + 0];
-        tileData2 = tilePatternTable[tileNums[col] * 16 + tilePixelRow * 2 + 1];
+        if (spriteLinesHeight != height)
+            build_sprite_lines(height);
         
-        while (pix < linePtr + GB_DISPLAY_WIDTH)
+        // Lowest priority first, so that higher priority sprites end up on top
+        for (unsigned int n = spriteLineCounts[scanline]; n-- > 0; )
         {
-            *(pix++) = bgPalette[((tileData1 >> bit) & 1) | (((tileData2 >> bit) & 1) << 1)];
-            bit--;
-            if (bit < 0)
+            unsigned int i = spriteLines[scanline][n];
+            int spriteX = spriteXs[i] - 8;
+            unsigned int tilePixelRow = scanline - (spriteYs[i] - 16);
+            unsigned int tilePixelCol = 0;
+            unsigned int tileWidth = 8;
+            unsigned int tileNum = spriteTileNums[i];
+            const uint8_t *palette = (spriteFlags[i] & OBJ_FLAG_PAL) ? objPalette1 : objPalette0;
+            const uint8_t *tilePixels;
+            uint8_t pixel;
+            
+            // Sprites off the sides still take up one of the 10 places
+            if (spriteX + 8 <= 0 || spriteX >= GB_DISPLAY_WIDTH)
+                continue;
+            if (spriteFlags[i] & OBJ_FLAG_YFLIP)
+                tilePixelRow = height - 1 - tilePixelRow;
+            if (height == 16)
+                tileNum = (tilePixelRow < 8) ? (tileNum & ~1) : (tileNum | 1);
+            tilePixels = get_tile_row(tileNum, tilePixelRow % 8);
+            if (spriteX < 0)
+                tilePixelCol = 0 - spriteX;
+            else if (spriteX + 8 > GB_DISPLAY_WIDTH)
+                tileWidth = GB_DISPLAY_WIDTH - spriteX;
+            
+            if (spriteFlags[i] & OBJ_FLAG_XFLIP)
+            {
+                for (; tilePixelCol < tileWidth; tilePixelCol++)
+                {
+                    pixel = tilePixels[7 - tilePixelCol];
+                    if (pixel != 0)
+                        linePtr[spriteX + tilePixelCol] = palette[pixel];
+                }
+            }
+            else
             {
-                bit = 7;
-                col = (col + 1) % 32;
-                tileData1 = tilePatternTable[tileNums[col] * 16 + tilePixelRow * 2 + 0];
-                tileData2 = tilePatternTable[tileNums[col] * 16 + tilePixelRow * 2 + 1];
+                for (; tilePixelCol < tileWidth; tilePixelCol++)
+                {
+                    pixel = tilePixels[tilePixelCol];
+                    if (pixel != 0)
+                        linePtr[spriteX + tilePixelCol] = palette[pixel];
+                }
             }
         }
     }
+    
+    frameChanges.rows[scanline] = write_screen_line(line->dest, linePtr);
+}
+
+// Called when the tile data byte at offset into VRAM changed
+static void invalidate_tile_row(unsigned int offset)
+{
+    unsigned int tileNum = offset / 16;
+    unsigned int rowBit = 1 << ((offset >> 1) & 7);
+    
+    dirtyTileRows[tileNum] |= rowBit;
+    changedTileRows[tileNum] |= rowBit;
+    tilesChanged = true;
+}
+
+//------------------------------------------------------------------------------
+// Deferred rendering
+//------------------------------------------------------------------------------
+
+// In deferred mode, lines aren't drawn during mode 3. Their registers are
+// logged instead, and the whole frame is drawn in one pass when vblank starts,
+// which keeps the renderer's code and data in the caches rather than taking
+// turns with CPU emulation 144 times a frame.
+//
+// Usually VRAM and OAM don't change once the first line is logged, and every
+// line is drawn from them as they are at vblank. Otherwise VRAM writes made
+// after the first line are logged along with the values they replaced, and
+// OAM is copied for each line it changed before. VRAM is then taken back to
+// how it was at the first line, and the writes are made again in between
+// drawing the lines.
+
+#define MAX_DEFERRED_WRITES 4096
+
+struct DeferredWrite
+{
+    uint16_t offset;  // Into VRAM
+    uint8_t oldVal;
+    uint8_t newVal;
+};
+
+static struct LineState deferredLines[GB_DISPLAY_HEIGHT];
+static uint16_t deferredLineWrites[GB_DISPLAY_HEIGHT];  // Writes logged before each line
+static uint8_t deferredLineOams[GB_DISPLAY_HEIGHT];     // OAM copy each line is drawn with
+static unsigned int deferredLineCount;
+static struct DeferredWrite deferredWrites[MAX_DEFERRED_WRITES];
+static unsigned int deferredWriteCount;
+static uint8_t deferredOams[GB_DISPLAY_HEIGHT][OAM_SIZE];
+static unsigned int deferredOamCount;
+
+static void set_vram_byte(unsigned int offset, uint8_t val)
+{
+    vram[offset] = val;
+    if (offset < 0x1800)
+        invalidate_tile_row(offset);
+}
+
+static void draw_deferred_lines(void)
+{
+    unsigned int write = 0;
+    
+    if (deferredWriteCount == 0 && deferredOamCount == 1 && !oamChanged)
+    {
+        for (unsigned int i = 0; i < deferredLineCount; i++)
+            render_scanline(&deferredLines[i]);
+    }
     else
     {
-        unsigned int tileRow = ((scanline + REG_SCY) / 8) % 32;
-        const int8_t *tileNums = (int8_t *)tileMap + tileRow * 32;
-        unsigned int tilePixelRow = (scanline + REG_SCY) % 8;
-        const uint8_t *tilePatternTable = vram + 0x800;
-        int bit;
-        uint8_t tileData1, tileData2;
-        
-        col = REG_SCX / 8;
-        bit = 7 - (REG_SCX % 8);
-        
-        tileData1 = tilePatternTable[(128 + tileNums[col]) * 16 + tilePixelRow * 2 + 0];
-        tileData2 = tilePatternTable[(128 + tileNums[col]) * 16 + tilePixelRow * 2 + 1];
-        
-        while (pix < linePtr + GB_DISPLAY_WIDTH)
+        for (unsigned int i = deferredWriteCount; i-- > 0; )
+            set_vram_byte(deferredWrites[i].offset, deferredWrites[i].oldVal);
+        for (unsigned int i = 0; i < deferredLineCount; i++)
         {
-            *(pix++) = bgPalette[((tileData1 >> bit) & 1) | (((tileData2 >> bit) & 1) << 1)];
-            bit--;
-            if (bit < 0)
+            for (; write < deferredLineWrites[i]; write++)
+                set_vram_byte(deferredWrites[write].offset, deferredWrites[write].newVal);
+            if (drawOam != deferredOams[deferredLineOams[i]])
             {
-                bit = 7;
-                col = (col + 1) % 32;
-                tileData1 = tilePatternTable[(128 + tileNums[col]) * 16 + tilePixelRow * 2 + 0];
-                tileData2 = tilePatternTable[(128 + tileNums[col]) * 16 + tilePixelRow * 2 + 1];
+                drawOam = deferredOams[deferredLineOams[i]];
+                spriteLinesHeight = 0;
             }
+            render_scanline(&deferredLines[i]);
         }
+        for (; write < deferredWriteCount; write++)
+            set_vram_byte(deferredWrites[write].offset, deferredWrites[write].newVal);
+        drawOam = oam;
+        spriteLinesHeight = 0;
     }
+    deferredLineCount = 0;
+    deferredWriteCount = 0;
+    deferredOamCount = 0;
+}
+
+static void defer_line(const struct LineState *line)
+{
+    if (deferredLineCount == GB_DISPLAY_HEIGHT)
+        draw_deferred_lines();
+    if (deferredLineCount == 0 || oamChanged)
+    {
+        memcpy(deferredOams[deferredOamCount++], oam, OAM_SIZE);
+        oamChanged = false;
+    }
+    deferredLines[deferredLineCount] = *line;
+    deferredLineWrites[deferredLineCount] = deferredWriteCount;
+    deferredLineOams[deferredLineCount] = deferredOamCount - 1;
+    deferredLineCount++;
+}
+
+// Called before val is written to offset in VRAM, after the first line
+static void defer_write(unsigned int offset, uint8_t val)
+{
+    // If the log is full, the lines so far are drawn now, which needs no log
+    if (deferredWriteCount == MAX_DEFERRED_WRITES)
+        draw_deferred_lines();
+    else
+        deferredWrites[deferredWriteCount++] = (struct DeferredWrite){offset, vram[offset], val};
+}
+
+//------------------------------------------------------------------------------
+// Render thread
+//------------------------------------------------------------------------------
+
+// With the render thread on, the emulation thread doesn't draw lines itself.
+// Where it would draw one, it sends the registers the line is drawn with to
+// the render thread through a ring buffer, preceded by every change to VRAM
+// and OAM since the last line. The render thread applies the changes to its
+// own copies of VRAM and OAM before drawing each line, so lines come out the
+// same as when drawn in place, while emulation carries on with the next ones.
+// The tile, layer and sprite caches belong to the render thread while it's
+// on. The emulation thread waits for it to finish at the end of the frame.
+//
+// Changes made during frames that aren't drawn aren't sent one at a time.
+// The next drawn frame sends all of VRAM and OAM instead, and the render
+// thread compares them with its copies to find what changed. OAM is always
+// sent whole, as one DMA changes most of it.
+
+#ifdef GPU_RENDER_THREAD
+
+#define RENDER_QUEUE_SIZE 0x10000
+
+enum
+{
+    RENDER_CMD_VRAM_WRITE,
+    RENDER_CMD_VRAM,  // Followed by all of VRAM
+    RENDER_CMD_OAM,   // Followed by all of OAM
+    RENDER_CMD_LINE,  // Followed by a struct LineState
+};
+
+struct RenderCommand
+{
+    uint8_t type;
+    uint8_t val;      // For RENDER_CMD_VRAM_WRITE
+    uint16_t offset;  // For RENDER_CMD_VRAM_WRITE, into VRAM
+};
+
+static thrd_t renderThread;
+static mtx_t renderMutex;
+static cnd_t renderWorkCond;   // Signaled when there are commands
+static cnd_t renderIdleCond;   // Signaled when the render thread runs out of them
+static bool renderThreadIdle;  // Guarded by renderMutex
+static bool renderThreadQuit;  // Guarded by renderMutex
+static struct RingBuffer renderQueue;
+
+// Only used by the emulation thread
+static bool renderCopiesStale;  // VRAM or OAM changed without being sent
+static uint8_t renderCommandBuffer[sizeof(struct RenderCommand) + VRAM_SIZE];
+
+// Only used by the render thread
+static uint8_t renderVram[VRAM_SIZE];
+static uint8_t renderOam[OAM_SIZE];
+
+// Replaces the render thread's copy of VRAM with the one that follows a
+// RENDER_CMD_VRAM, and invalidates the tile rows that differ
+static void receive_vram(void)
+{
+    static uint8_t newVram[VRAM_SIZE];
     
-    // Render window
-    pix = linePtr;
-    if ((REG_LCDC & (1 << 5)) && scanline >= REG_WY)
+    ringbuf_read(&renderQueue, newVram, sizeof(newVram));
+    for (unsigned int offset = 0; offset < 0x1800; offset++)
     {
-        //printf("x = %u, y = %u\n", REG_WX, REG_WY);
-        if (REG_LCDC & (1 << 4))
+        if (newVram[offset] != renderVram[offset])
+            invalidate_tile_row(offset);
+    }
+    memcpy(renderVram, newVram, sizeof(renderVram));
+}
+
+static void receive_oam(void)
+{
+    uint8_t newOam[OAM_SIZE];
+    
+    ringbuf_read(&renderQueue, newOam, sizeof(newOam));
+    if (memcmp(renderOam, newOam, sizeof(renderOam)) != 0)
+    {
+        memcpy(renderOam, newOam, sizeof(renderOam));
+        spriteLinesHeight = 0;
+    }
+}
+
+static void run_render_commands(void)
+{
+    struct RenderCommand cmd;
+    struct LineState line;
+    
+    // Commands are sent in one write each, so the data after one is all there
+    while (ringbuf_read(&renderQueue, &cmd, sizeof(cmd)) == sizeof(cmd))
+    {
+        switch (cmd.type)
         {
-            const uint8_t *pTileNum = winTileMap + ((scanline - REG_WY) / 8) * 32;
-            unsigned int tilePixelRow = (scanline - REG_WY) % 8;
-            const uint8_t *tilePatternTable = vram;
-            
-            for (col = 0; col < 20; col++)
-            {
-                uint8_t tileData1 = tilePatternTable[*pTileNum * 16 + tilePixelRow * 2 + 0];
-                uint8_t tileData2 = tilePatternTable[*pTileNum * 16 + tilePixelRow * 2 + 1];
-                
-                for (int i = 7; i >= 0; i--)
-                {
-                    *(pix++) = bgPalette[((tileData1 >> i) & 1) | (((tileData2 >> i) & 1) << 1)];
-                }
-                pTileNum++;
-            }
+          case RENDER_CMD_VRAM_WRITE:
+            renderVram[cmd.offset] = cmd.val;
+            if (cmd.offset < 0x1800)
+                invalidate_tile_row(cmd.offset);
+            break;
+          case RENDER_CMD_VRAM:
+            receive_vram();
+            break;
+          case RENDER_CMD_OAM:
+            receive_oam();
+            break;
+          case RENDER_CMD_LINE:
+            ringbuf_read(&renderQueue, &line, sizeof(line));
+            render_scanline(&line);
+            break;
         }
-        else
+    }
+}
+
+static int render_thread_main(void *arg)
+{
+    (void)arg;
+    mtx_lock(&renderMutex);
+    while (!renderThreadQuit)
+    {
+        if (ringbuf_used(&renderQueue) == 0)
         {
-            const int8_t *pTileNum = (int8_t *)winTileMap + ((scanline - REG_WY) / 8) * 32;
-            unsigned int tilePixelRow = (scanline - REG_WY) % 8;
-            const uint8_t *tilePatternTable = vram + 0x800;
-            
-            for (col = 0; col < 20; col++)
-            {
-                uint8_t tileData1 = tilePatternTable[(128 + *pTileNum) * 16 + tilePixelRow * 2 + 0];
-                uint8_t tileData2 = tilePatternTable[(128 + *pTileNum) * 16 + tilePixelRow * 2 + 1];
-                
-                for (int i = 7; i >= 0; i--)
-                {
-                    *(pix++) = bgPalette[((tileData1 >> i) & 1) | (((tileData2 >> i) & 1) << 1)];
-                }
-                pTileNum++;
-            }
+            renderThreadIdle = true;
+            cnd_broadcast(&renderIdleCond);
+            cnd_wait(&renderWorkCond, &renderMutex);
+            renderThreadIdle = false;
+            continue;
         }
+        mtx_unlock(&renderMutex);
+        run_render_commands();
+        mtx_lock(&renderMutex);
     }
+    mtx_unlock(&renderMutex);
+    return 0;
+}
+
+// Waits until the render thread has carried out every command sent to it
+static void wait_for_render_thread(void)
+{
+    if (renderMode != RENDER_MODE_THREAD)
+        return;
+    mtx_lock(&renderMutex);
+    cnd_signal(&renderWorkCond);
+    while (!renderThreadIdle || ringbuf_used(&renderQueue) != 0)
+        cnd_wait(&renderIdleCond, &renderMutex);
+    mtx_unlock(&renderMutex);
+}
+
+// Sends a command along with size bytes of data. If the queue is full, the
+// render thread gets to empty it first.
+static void send_render_command(unsigned int type, const void *data, size_t size)
+{
+    struct RenderCommand cmd = {.type = type};
     
-    // Render sprites
-    for (unsigned int i = 0; i < 40; i++)
+    memcpy(renderCommandBuffer, &cmd, sizeof(cmd));
+    memcpy(renderCommandBuffer + sizeof(cmd), data, size);
+    size += sizeof(cmd);
+    if (RENDER_QUEUE_SIZE - ringbuf_used(&renderQueue) < size)
+        wait_for_render_thread();
+    ringbuf_write(&renderQueue, renderCommandBuffer, size);
+}
+
+static void send_vram_write(uint16_t offset, uint8_t val)
+{
+    struct RenderCommand cmd = {RENDER_CMD_VRAM_WRITE, val, offset};
+    
+    if (RENDER_QUEUE_SIZE - ringbuf_used(&renderQueue) < sizeof(cmd))
+        wait_for_render_thread();
+    ringbuf_write(&renderQueue, &cmd, sizeof(cmd));
+}
+
+static void send_line(const struct LineState *line)
+{
+    if (renderCopiesStale)
+    {
+        send_render_command(RENDER_CMD_VRAM, vram, VRAM_SIZE);
+        send_render_command(RENDER_CMD_OAM, oam, OAM_SIZE);
+        renderCopiesStale = false;
+        oamChanged = false;
+    }
+    else if (oamChanged)
+    {
+        send_render_command(RENDER_CMD_OAM, oam, OAM_SIZE);
+        oamChanged = false;
+    }
+    send_render_command(RENDER_CMD_LINE, line, sizeof(*line));
+    
+    mtx_lock(&renderMutex);
+    cnd_signal(&renderWorkCond);
+    mtx_unlock(&renderMutex);
+}
+
+static void start_render_thread(void)
+{
+    if (!ringbuf_init(&renderQueue, RENDER_QUEUE_SIZE)
+     || mtx_init(&renderMutex, mtx_plain) != thrd_success
+     || cnd_init(&renderWorkCond) != thrd_success
+     || cnd_init(&renderIdleCond) != thrd_success)
+        platform_fatal_error("Failed to start the render thread");
+    
+    // The caches are up to date with VRAM and OAM, so they are with copies
+    memcpy(renderVram, vram, sizeof(renderVram));
+    memcpy(renderOam, oam, sizeof(renderOam));
+    renderCopiesStale = false;
+    oamChanged = false;
+    renderThreadIdle = false;
+    renderThreadQuit = false;
+    drawVram = renderVram;
+    drawOam = renderOam;
+    if (thrd_create(&renderThread, render_thread_main, NULL) != thrd_success)
+        platform_fatal_error("Failed to start the render thread");
+}
+
+static void stop_render_thread(void)
+{
+    wait_for_render_thread();
+    mtx_lock(&renderMutex);
+    renderThreadQuit = true;
+    cnd_signal(&renderWorkCond);
+    mtx_unlock(&renderMutex);
+    thrd_join(renderThread, NULL);
+    cnd_destroy(&renderIdleCond);
+    cnd_destroy(&renderWorkCond);
+    mtx_destroy(&renderMutex);
+    ringbuf_destroy(&renderQueue);
+    
+    // The caches were kept for the copies, which can be behind
+    drawVram = vram;
+    drawOam = oam;
+    gpu_invalidate_tiles();
+    gpu_invalidate_sprites();
+}
+
+#else
+
+static void wait_for_render_thread(void)
+{
+}
+
+#endif  // GPU_RENDER_THREAD
+
+static void draw_line(uint8_t *dest, unsigned int scanline)
+{
+    struct LineState line =
+    {
+        .dest = dest,
+        .scanline = scanline,
+        .lcdc = REG_LCDC,
+        .scx = REG_SCX,
+        .scy = REG_SCY,
+        .wx = REG_WX,
+        .wy = REG_WY,
+        .bgp = REG_BGP,
+        .obp0 = REG_OBP0,
+        .obp1 = REG_OBP1,
+    };
+    
+    switch (renderMode)
+    {
+      case RENDER_MODE_INLINE:
+        render_scanline(&line);
+        break;
+      case RENDER_MODE_DEFERRED:
+        defer_line(&line);
+        break;
+#ifdef GPU_RENDER_THREAD
+      case RENDER_MODE_THREAD:
+        send_line(&line);
+        break;
+#endif
+    }
+}
+
+// Draws the lines that were put off, and waits for the ones sent to the
+// render thread
+static void finish_lines(void)
+{
+    if (renderMode == RENDER_MODE_DEFERRED)
+        draw_deferred_lines();
+    wait_for_render_thread();
+}
+
+//------------------------------------------------------------------------------
+// Pixel FIFO
+//------------------------------------------------------------------------------
+
+// The pixel FIFO renderer draws lines a dot at a time like the PPU does, for
+// games that change registers in the middle of a line. Mode 3 lasts until 160
+// pixels have been pushed out, so its length varies the way it does on the
+// hardware: the first tile is fetched twice, SCX % 8 pixels are fetched and
+// thrown away, the window restarts the background fetcher, and each sprite
+// holds up the pixels while its tile is fetched, for longer if the fetcher is
+// in the middle of a tile. Registers are read at the dot the PPU reads them,
+// and the palettes as each pixel goes out. Writes to them and to VRAM first
+// run the PPU up to the cycle the writing instruction started at.
+//
+// It costs several times what the scanline renderer does, so it's only used
+// for games with QUIRK_PIXEL_FIFO or when asked for. Lines are always drawn
+// as they're scanned out, whatever the render mode.
+
+#define FIFO_START_DOTS  6  // The first fetch of a line, which is thrown away
+#define FIFO_FETCH_DOTS  6  // Tile number, then the low and high bytes of its row
+#define FIFO_SPRITE_DOTS 6
+
+struct FifoSprite
+{
+    uint8_t startX;    // Pixel it's fetched at
+    uint8_t firstCol;  // Columns before this are off the left of the screen
+    uint8_t oamIndex;
+};
+
+struct PixelFifo
+{
+    uint16_t dots;         // Dots into mode 3
+    uint8_t lcdX;          // Pixels pushed out so far
+    uint8_t discard;       // Pixels to throw away before pushing any out
+    uint8_t stall;         // Dots until the fetcher starts, or the sprite is fetched
+    bool fetchingSprite;
+    uint8_t fetchStep;     // Dots into the background fetch, FIFO_FETCH_DOTS once it's done
+    uint8_t fetchX;        // Tiles fetched from the background or window so far
+    uint8_t tileNum;
+    uint8_t tileLow;
+    uint8_t tileHigh;
+    uint8_t bgColors[8];
+    uint8_t bgCount;       // Pixels left, taken from the end of bgColors
+    uint8_t objColors[8];  // Ring buffer, starting at objHead
+    uint8_t objFlags[8];
+    uint8_t objHead;
+    bool inWindow;
+    bool windowYReached;   // LY has matched WY this frame
+    bool windowDrawn;      // Window was drawn on this line
+    uint8_t windowLine;    // Window row the next line with the window shows
+    struct FifoSprite sprites[MAX_LINE_SPRITES];  // In the order they're fetched
+    uint8_t spriteCount;
+    uint8_t nextSprite;
+};
+
+static struct PixelFifo fifo;
+static bool pixelFifo;  // Lines are drawn by the pixel FIFO
+
+// OAM search: picks the first 10 sprites on the line, in the order their
+// pixels take priority, which is lower X first
+static void fifo_start_line(void)
+{
+    const struct OamEntry *sprites = (const struct OamEntry *)oam;
+    int height = (REG_LCDC & (1 << 2)) ? 16 : 8;
+    unsigned int found = 0;
+    
+    memory_sync_dma();
+    if (REG_LY == 0)
     {
-        struct OamEntry *sprite = (struct OamEntry *)oam + i;
+        fifo.windowYReached = false;
+        fifo.windowLine = 0;
+    }
+    if (REG_LY == REG_WY)
+        fifo.windowYReached = true;
+    fifo.dots = 0;
+    fifo.lcdX = 0;
+    fifo.discard = REG_SCX % 8;
+    fifo.stall = FIFO_START_DOTS;
+    fifo.fetchingSprite = false;
+    fifo.fetchStep = 0;
+    fifo.fetchX = 0;
+    fifo.bgCount = 0;
+    memset(fifo.objColors, 0, sizeof(fifo.objColors));
+    fifo.objHead = 0;
+    fifo.inWindow = false;
+    fifo.windowDrawn = false;
+    fifo.spriteCount = 0;
+    fifo.nextSprite = 0;
+    for (unsigned int i = 0; i < 40 && found < MAX_LINE_SPRITES; i++)
+    {
+        int top = sprites[i].y - 16;
+        unsigned int x = sprites[i].x;
+        unsigned int n;
         
-        if (sprite->x != 0 && sprite->y != 0)
+        if (REG_LY < top || REG_LY >= top + height)
+            continue;
+        // Sprites off the sides take up one of the 10 places without being
+        // fetched
+        found++;
+        if (x == 0 || x >= GB_DISPLAY_WIDTH + 8)
+            continue;
+        for (n = fifo.spriteCount; n > 0 && sprites[fifo.sprites[n - 1].oamIndex].x > x; n--)
+            fifo.sprites[n] = fifo.sprites[n - 1];
+        fifo.sprites[n] = (struct FifoSprite){MAX(x, 8) - 8, (x < 8) ? 8 - x : 0, i};
+        fifo.spriteCount++;
+    }
+}
+
+// Row of the tile the background fetcher is on
+static unsigned int fifo_tile_row(void)
+{
+    return (fifo.inWindow ? fifo.windowLine : REG_LY + REG_SCY) % 8;
+}
+
+static unsigned int fifo_tile_data_addr(void)
+{
+    unsigned int addressing = (REG_LCDC & LCDC_BG_TILE_DATA) ? 0 : 1;
+    
+    return get_map_tile(fifo.tileNum, addressing) * 16 + fifo_tile_row() * 2;
+}
+
+// Runs the background fetcher for a dot. Once it has a tile, it waits for the
+// FIFO to run out of pixels to push the tile's 8 pixels in.
+static void fifo_fetch(void)
+{
+    if (fifo.fetchStep < FIFO_FETCH_DOTS)
+    {
+        switch (++fifo.fetchStep)
         {
-            if (REG_LCDC & 4)  // 8x16 sprites
+          case 2:
+            if (fifo.inWindow)
             {
-                if ((int)scanline >= sprite->y - 16 && (int)scanline < sprite->y - 16 + 16)
-                {
-                    unsigned int tilePixelRow = scanline - (sprite->y - 16);
-                    unsigned int tileNum;
-                    const uint8_t *palette;
-                    
-                    if (sprite->flags & (1 << 4))
-                        palette = objPalette1;
-                    else
-                        palette = objPalette0;
-                    if (sprite->flags & (1 << 6))
-                        tilePixelRow = 15 - tilePixelRow;
-                    if (tilePixelRow < 8)
-                        tileNum = sprite->tileNum & ~1;
-                    else
-                        tileNum = (sprite->tileNum & ~1) + 1;
-                    tilePixelRow %= 8;
-                    uint8_t tileData1 = vram[tileNum * 16 + tilePixelRow * 2 + 0];
-                    uint8_t tileData2 = vram[tileNum * 16 + tilePixelRow * 2 + 1];
-                    uint8_t pixel;
-                    
-                    pix = linePtr + sprite->x - 8;
-                    if (sprite->flags & (1 << 5))
-                    {
-                        for (int i = 0; i < 8 && pix < linePtr + GB_DISPLAY_WIDTH; i++)
-                        {
-                            pixel = ((tileData1 >> i) & 1) | (((tileData2 >> i) & 1) << 1);
-                            if (pixel != 0)
-                                *pix = palette[pixel];
-                            pix++;                
-                        }
-                    }
-                    else
-                    {
-                        for (int i = 7; i >= 0 && pix < linePtr + GB_DISPLAY_WIDTH; i--)
-                        {
-                            pixel = ((tileData1 >> i) & 1) | (((tileData2 >> i) & 1) << 1);
-                            if (pixel != 0)
-                                *pix = palette[pixel];
-                            pix++;                
-                        }
-                    }
-                }
+                unsigned int map = (REG_LCDC & (1 << 6)) ? 1 : 0;
+                
+                fifo.tileNum = vram[0x1800 + map * 0x400 + (fifo.windowLine / 8) * 32 + fifo.fetchX % 32];
             }
             else
             {
-                if ((int)scanline >= sprite->y - 16 && (int)scanline < sprite->y - 16 + 8)
-                {
-                    unsigned int tilePixelRow = scanline - (sprite->y - 16);
-                    if (sprite->flags & (1 << 6))
-                        tilePixelRow = 7 - tilePixelRow;
-                    uint8_t tileData1 = vram[sprite->tileNum * 16 + tilePixelRow * 2 + 0];
-                    uint8_t tileData2 = vram[sprite->tileNum * 16 + tilePixelRow * 2 + 1];
-                    uint8_t pixel;
-                    const uint8_t *palette;
-                    
-                    if (sprite->flags & (1 << 4))
-                        palette = objPalette1;
-                    else
-                        palette = objPalette0;
-                    pix = linePtr + sprite->x - 8;
-                    if (sprite->flags & (1 << 5))
-                    {
-                        for (int i = 0; i < 8 && pix < linePtr + GB_DISPLAY_WIDTH; i++)
-                        {
-                            pixel = ((tileData1 >> i) & 1) | (((tileData2 >> i) & 1) << 1);
-                            if (pixel != 0)
-                                *pix = palette[pixel];
-                            pix++;                
-                        }
-                    }
-                    else
-                    {
-                        for (int i = 7; i >= 0 && pix < linePtr + GB_DISPLAY_WIDTH; i--)
-                        {
-                            pixel = ((tileData1 >> i) & 1) | (((tileData2 >> i) & 1) << 1);
-                            if (pixel != 0)
-                                *pix = palette[pixel];
-                            pix++;                
-                        }
-                    }
-                }
+                unsigned int map = (REG_LCDC & LCDC_BG_TILE_MAP) ? 1 : 0;
+                unsigned int y = (REG_LY + REG_SCY) % 256;
+                
+                fifo.tileNum = vram[0x1800 + map * 0x400 + (y / 8) * 32 + (REG_SCX / 8 + fifo.fetchX) % 32];
             }
+            break;
+          case 4:
+            fifo.tileLow = vram[fifo_tile_data_addr()];
+            break;
+          case 6:
+            fifo.tileHigh = vram[fifo_tile_data_addr() + 1];
+            break;
         }
     }
+    if (fifo.fetchStep == FIFO_FETCH_DOTS && fifo.bgCount == 0)
+    {
+        for (unsigned int x = 0; x < 8; x++)
+        {
+            unsigned int bit = 7 - x;
+            
+            fifo.bgColors[x] = ((fifo.tileLow >> bit) & 1) | (((fifo.tileHigh >> bit) & 1) << 1);
+        }
+        fifo.bgCount = 8;
+        fifo.fetchStep = 0;
+        fifo.fetchX++;
+    }
+}
+
+// Mixes the next sprite's row into the sprite pixels, under the pixels of
+// sprites fetched before it
+static void fifo_fetch_sprite(void)
+{
+    const struct FifoSprite *s = &fifo.sprites[fifo.nextSprite++];
+    const struct OamEntry *sprite = (const struct OamEntry *)oam + s->oamIndex;
+    unsigned int height = (REG_LCDC & (1 << 2)) ? 16 : 8;
+    unsigned int row = (REG_LY - (sprite->y - 16)) % height;
+    unsigned int tileNum = sprite->tileNum;
+    uint8_t tileLow, tileHigh;
+    
+    if (sprite->flags & OBJ_FLAG_YFLIP)
+        row = height - 1 - row;
+    if (height == 16)
+        tileNum = (row < 8) ? (tileNum & ~1) : (tileNum | 1);
+    tileLow = vram[tileNum * 16 + (row % 8) * 2];
+    tileHigh = vram[tileNum * 16 + (row % 8) * 2 + 1];
+    for (unsigned int col = s->firstCol; col < 8; col++)
+    {
+        unsigned int bit = (sprite->flags & OBJ_FLAG_XFLIP) ? col : 7 - col;
+        unsigned int color = ((tileLow >> bit) & 1) | (((tileHigh >> bit) & 1) << 1);
+        unsigned int slot = (fifo.objHead + col - s->firstCol) % 8;
+        
+        if (color != 0 && fifo.objColors[slot] == 0)
+        {
+            fifo.objColors[slot] = color;
+            fifo.objFlags[slot] = sprite->flags;
+        }
+    }
+}
+
+// Runs mode 3 for a dot. Returns true once the last pixel of the line is out.
+static bool fifo_dot(void)
+{
+    fifo.dots++;
+    if (fifo.stall != 0)
+    {
+        if (--fifo.stall == 0 && fifo.fetchingSprite)
+        {
+            fifo_fetch_sprite();
+            fifo.fetchingSprite = false;
+        }
+        return false;
+    }
+    
+    if (!fifo.inWindow && (REG_LCDC & (1 << 5)) && fifo.windowYReached
+     && (fifo.lcdX + 7 == REG_WX || (REG_WX < 7 && fifo.lcdX == 0)))
+    {
+        fifo.inWindow = true;
+        fifo.windowDrawn = true;
+        fifo.discard = (REG_WX < 7) ? 7 - REG_WX : 0;
+        fifo.bgCount = 0;
+        fifo.fetchStep = 0;
+        fifo.fetchX = 0;
+    }
+    
+    // A sprite waits for the fetcher to finish its tile and for there to be
+    // pixels to mix it with. The dot that happens on is its first.
+    while (fifo.nextSprite < fifo.spriteCount && fifo.sprites[fifo.nextSprite].startX == fifo.lcdX && fifo.discard == 0)
+    {
+        if (!(REG_LCDC & (1 << 1)))
+        {
+            fifo.nextSprite++;
+            continue;
+        }
+        if (fifo.fetchStep < FIFO_FETCH_DOTS || fifo.bgCount == 0)
+        {
+            fifo_fetch();
+            if (fifo.fetchStep < FIFO_FETCH_DOTS || fifo.bgCount == 0)
+                return false;
+        }
+        fifo.fetchingSprite = true;
+        fifo.stall = FIFO_SPRITE_DOTS - 1;
+        return false;
+    }
+    
+    if (fifo.bgCount != 0)
+    {
+        unsigned int color = fifo.bgColors[8 - fifo.bgCount--];
+        
+        if (fifo.discard != 0)
+            fifo.discard--;
+        else
+        {
+            unsigned int objColor = fifo.objColors[fifo.objHead];
+            unsigned int objFlags = fifo.objFlags[fifo.objHead];
+            unsigned int shade = 0;  // With LCDC bit 0 clear, the background and window are blank
+            
+            if (REG_LCDC & 1)
+                shade = (REG_BGP >> (color * 2)) & 3;
+            else
+                color = 0;
+            if (objColor != 0 && (color == 0 || !(objFlags & OBJ_FLAG_BEHIND_BG)))
+                shade = (((objFlags & OBJ_FLAG_PAL) ? REG_OBP1 : REG_OBP0) >> (objColor * 2)) & 3;
+            fifo.objColors[fifo.objHead] = 0;
+            fifo.objHead = (fifo.objHead + 1) % 8;
+            screenLine[fifo.lcdX++] = shade;
+            if (fifo.lcdX == GB_DISPLAY_WIDTH)
+                return true;
+        }
+    }
+    fifo_fetch();
+    return false;
 }
-*/
 
 static void gpu_state_oam_search(void)
 {
@@ -483,7 +1177,13 @@ static void gpu_state_oam_search(void)
         gpuClock -= 80;    
         REG_STAT &= ~3;
         REG_STAT |= 3;   
-        gpuFunc = gpu_state_data_transfer;
+        if (pixelFifo)
+        {
+            fifo_start_line();
+            gpuFunc = gpu_state_fifo_transfer;
+        }
+        else
+            gpuFunc = gpu_state_data_transfer;
     }
 }
 
@@ -492,26 +1192,51 @@ static void gpu_state_data_transfer(void)
     if (gpuClock >= 172)
     {
         gpuClock -= 172;
-        render_scanline(REG_LY);
+        memory_sync_dma();
+        if (frameBuffer != NULL)
+            draw_line(frameBuffer + REG_LY * frameBufferPitch, REG_LY);
         REG_STAT &= ~3;
+        hblankLength = 204;
         gpuFunc = gpu_state_hblank;
     }
 }
 
+static void gpu_state_fifo_transfer(void)
+{
+    while (gpuClock > 0)
+    {
+        gpuClock--;
+        if (fifo_dot())
+        {
+            if (frameBuffer != NULL)
+                frameChanges.rows[REG_LY] = write_screen_line(frameBuffer + REG_LY * frameBufferPitch, screenLine);
+            if (fifo.windowDrawn)
+                fifo.windowLine++;
+            REG_STAT &= ~3;
+            hblankLength = 456 - 80 - fifo.dots;
+            gpuFunc = gpu_state_hblank;
+            return;
+        }
+    }
+}
+
 static void gpu_state_hblank(void)
 {
-    if (gpuClock >= 204)
+    if (gpuClock >= hblankLength)
     {
-        gpuClock -= 204;
+        gpuClock -= hblankLength;
         
         REG_LY++;
         if (REG_LY == 144)
-        {            
+        {
+            if (renderMode == RENDER_MODE_DEFERRED)
+                draw_deferred_lines();            
             //if (interruptsEnabled && (ie & INTR_FLAG_VBLANK))
             {
                 // Trigger VBLANK interrupt
                 REG_IF |= INTR_FLAG_VBLANK;
             }
+            cheats_vblank();  // The GameShark hooks the vblank interrupt too
             REG_STAT &= ~3;
             REG_STAT |= 1;
             gpuFunc = gpu_state_vblank;
@@ -539,6 +1264,7 @@ static void gpu_state_vblank(void)
         REG_LY++;
         if (REG_LY == 154)
         {
+            wait_for_render_thread();
             REG_LY = 0;
             gpuFrameDone = true;
             return;
@@ -546,43 +1272,251 @@ static void gpu_state_vblank(void)
     }
 }
 
+// Called before val is written to a tile data byte (0x8000-0x97FF). Tile map
+// writes only come here when lines aren't drawn inline by the scanline
+// renderer, as they're otherwise mapped straight to VRAM.
 void gpu_handle_vram_write(uint16_t addr, uint8_t val)
 {
-    // Tile memory
-    if (addr >= 0x8000 && addr <= 0x97FF)
+    unsigned int offset = addr - 0x8000;
+    
+    gpu_sync();
+#ifdef GPU_RENDER_THREAD
+    if (renderMode == RENDER_MODE_THREAD)
     {
-        unsigned int tileNum = (addr - 0x8000) / 16;
-        uint8_t *vramData = vram + tileNum * 16;
+        if (frameBuffer == NULL)
+            renderCopiesStale = true;
+        if (!renderCopiesStale)
+            send_vram_write(offset, val);
+        return;
+    }
+#endif
+    if (renderMode == RENDER_MODE_DEFERRED && deferredLineCount != 0)
+        defer_write(offset, val);
+    if (offset < 0x1800)
+        invalidate_tile_row(offset);
+}
+
+// Called when OAM changed
+void gpu_invalidate_sprites(void)
+{
+    oamChanged = true;
+#ifdef GPU_RENDER_THREAD
+    if (renderMode == RENDER_MODE_THREAD)
+        return;  // The sprite lines are the render thread's
+#endif
+    spriteLinesHeight = 0;
+}
+
+// Called when a state is loaded, before VRAM is replaced with newVram. Run-ahead
+// loads a state every frame, usually with most of VRAM the same, so only the
+// tile rows that differ are invalidated and the rest of the caches are kept.
+void gpu_load_vram(const uint8_t *newVram)
+{
+#ifdef GPU_RENDER_THREAD
+    if (renderMode == RENDER_MODE_THREAD)
+    {
+        if (memcmp(vram, newVram, VRAM_SIZE) != 0)
+            renderCopiesStale = true;
+        return;
+    }
+#endif
+    for (unsigned int offset = 0; offset < 0x1800; offset += 2)
+    {
+        if (vram[offset] != newVram[offset] || vram[offset + 1] != newVram[offset + 1])
+            invalidate_tile_row(offset);
+    }
+}
+
+// Called when all of VRAM changed at once
+void gpu_invalidate_tiles(void)
+{
+#ifdef GPU_RENDER_THREAD
+    if (renderMode == RENDER_MODE_THREAD)
+    {
+        renderCopiesStale = true;
+        return;
+    }
+#endif
+    memset(dirtyTileRows, 0xFF, sizeof(dirtyTileRows));
+    for (unsigned int map = 0; map < 2; map++)
+    {
+        for (unsigned int addressing = 0; addressing < 2; addressing++)
+            memset(tileLayers[map][addressing].rowsValid, 0, sizeof(tileLayers[map][addressing].rowsValid));
+    }
+    memset(changedTileRows, 0, sizeof(changedTileRows));
+    tilesChanged = false;
+}
+
+// Sets the format frame buffers are in, and the RGB colors of the four shades
+// from white to black. The palette isn't used for PIXEL_FORMAT_INDEXED8.
+void gpu_set_screen_format(unsigned int format, const uint8_t palette[4][3])
+{
+    assert(format <= PIXEL_FORMAT_RGB24);
+    finish_lines();
+    screenFormat = format;
+    if (format == PIXEL_FORMAT_INDEXED8)
+        return;
+    for (unsigned int i = 0; i < 4; i++)
+    {
+        unsigned int r = palette[i][0];
+        unsigned int g = palette[i][1];
+        unsigned int b = palette[i][2];
         
-        for (unsigned int y = 0; y < 8; y++)
-        {
-            uint8_t tileData1 = *(vramData++);
-            uint8_t tileData2 = *(vramData++);
-            
-            for (unsigned int x = 0; x < 8; x++)
-            {
-                unsigned int bit = 7 - x;
-                uint8_t pixel = ((tileData1 >> bit) & 1) | (((tileData2 >> bit) & 1) << 1);
-                
-                screenTileData[tileNum][y][x] = pixel;
-            }
-        }
+        screenColors16[i] = ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+        screenColors32[i] = (r << 16) | (g << 8) | b;
+        memcpy(screenColors24[i], palette[i], 3);
     }
 }
 
-void gpu_set_screen_palette(unsigned int bytesPerPixel, const void *palette)
+size_t gpu_state_size(void)
 {
-    assert(bytesPerPixel == 1 || bytesPerPixel == 2 || bytesPerPixel == 3);
-    screenBytesPerPixel = bytesPerPixel;
-    screenPalette = palette;
+    return sizeof(gpuClock) + sizeof(gpuFrameDone) + sizeof(gpuFunc) + sizeof(hblankLength) + sizeof(fifo);
+}
+
+uint8_t *gpu_save_state(uint8_t *p)
+{
+    STATE_SAVE(p, gpuClock);
+    STATE_SAVE(p, gpuFrameDone);
+    STATE_SAVE(p, gpuFunc);
+    STATE_SAVE(p, hblankLength);
+    STATE_SAVE(p, fifo);
+    return p;
+}
+
+const uint8_t *gpu_load_state(const uint8_t *p)
+{
+    STATE_LOAD(p, gpuClock);
+    STATE_LOAD(p, gpuFrameDone);
+    STATE_LOAD(p, gpuFunc);
+    STATE_LOAD(p, hblankLength);
+    STATE_LOAD(p, fifo);
     
-    // TODO: convert buffers
+    // The decoded tiles, layers and sprite lines are only caches of VRAM and
+    // OAM, which memory_load_state() invalidated where they differ
+    return p;
+}
+
+// Chooses how lines are composited. Returns false if this CPU or build can't
+// use that one.
+bool gpu_set_compositor(unsigned int which)
+{
+    if (!compositor_supported(which))
+        return false;
+    finish_lines();
+    compositor = which;
+    map_palette = compositors[which].map_palette;
+    return true;
+}
+
+// Returns how many tile rows were decoded and layer rows drawn so far, to
+// show how well the caches work
+void gpu_get_cache_stats(unsigned long *tileRows, unsigned long *layerRows)
+{
+    *tileRows = tileRowsDecoded;
+    *layerRows = layerRowsDrawn;
 }
 
-void gpu_frame_init(void)
+// Returns the name of a compositor, or NULL if it can't be used
+const char *gpu_get_compositor_name(unsigned int which)
 {
+    return compositor_supported(which) ? compositors[which].name : NULL;
+}
+
+unsigned int gpu_get_compositor(void)
+{
+    return compositor;
+}
+
+// Renders every line into buffer from the current VRAM and registers, without
+// running the PPU. This is for measuring the cost of rendering on its own.
+void gpu_render_lines(uint8_t *buffer, size_t pitch)
+{
+    for (unsigned int scanline = 0; scanline < GB_DISPLAY_HEIGHT; scanline++)
+        draw_line(buffer + scanline * pitch, scanline);
+    finish_lines();
+}
+
+// Returns which rows of the last frame that was drawn changed. Rows that were
+// drawn the same as what was in the buffer before don't count.
+const struct FrameChanges *gpu_get_frame_changes(void)
+{
+    frameChanges.firstRow = 0;
+    frameChanges.endRow = GB_DISPLAY_HEIGHT;
+    while (frameChanges.firstRow < frameChanges.endRow && !frameChanges.rows[frameChanges.firstRow])
+        frameChanges.firstRow++;
+    while (frameChanges.endRow > frameChanges.firstRow && !frameChanges.rows[frameChanges.endRow - 1])
+        frameChanges.endRow--;
+    return &frameChanges;
+}
+
+// Chooses when and where lines are drawn: during mode 3 like the PPU, all at
+// once at vblank, or on a thread of their own. Frames come out the same in
+// every mode. Returns false if the mode isn't available in this build.
+bool gpu_set_render_mode(unsigned int mode)
+{
+#ifndef GPU_RENDER_THREAD
+    if (mode == RENDER_MODE_THREAD)
+        return false;
+#endif
+    if (mode > RENDER_MODE_THREAD)
+        return false;
+    if (mode == renderMode)
+        return true;
+    finish_lines();
+#ifdef GPU_RENDER_THREAD
+    if (renderMode == RENDER_MODE_THREAD)
+        stop_render_thread();
+    if (mode == RENDER_MODE_THREAD)
+        start_render_thread();
+#endif
+    renderMode = mode;
+    memory_trap_tile_map_writes(mode != RENDER_MODE_INLINE || pixelFifo);
+    return true;
+}
+
+// Chooses between the scanline renderer and the pixel FIFO. The pixel FIFO
+// changes how long modes 3 and 0 take as well as what is drawn, so frames
+// can come out differently.
+void gpu_set_pixel_fifo(bool on)
+{
+    if (on == pixelFifo)
+        return;
+    finish_lines();
+    pixelFifo = on;
+    memory_trap_tile_map_writes(renderMode != RENDER_MODE_INLINE || pixelFifo);
+}
+
+// Runs the pixel FIFO up to the current cycle, before something it reads is
+// written. Lines drawn by the scanline renderer have nothing to catch up on.
+void gpu_sync(void)
+{
+    if (!pixelFifo)
+        return;
+    if (gpuFunc == gpu_state_oam_search)
+        gpu_state_oam_search();
+    if (gpuFunc == gpu_state_fifo_transfer)
+        gpu_state_fifo_transfer();
+}
+
+// pitch is the distance in bytes from one line of buffer to the next. buffer
+// can be NULL to not draw the frame. The PPU still goes through every mode at
+// the same times; only making the pixels is skipped, and the tile and sprite
+// caches catch up with VRAM and OAM on the next frame that is drawn.
+void gpu_frame_init(uint8_t *buffer, size_t pitch)
+{
+    if (compositor == COMPOSITOR_COUNT)
+    {
+        // Use the widest one the CPU has
+        for (unsigned int which = COMPOSITOR_COUNT; which-- > 0; )
+        {
+            if (gpu_set_compositor(which))
+                break;
+        }
+        dbg_printf("gpu: using the %s compositor\n", compositors[compositor].name);
+    }
     gpuFrameDone = false;
-    frameBuffer = platform_get_framebuffer();
+    frameBuffer = buffer;
+    frameBufferPitch = pitch;
     REG_STAT &= ~3;
     REG_STAT |= 2;
     gpuFunc = gpu_state_oam_search;
@@ -1,12 +1,36 @@
 #ifndef GUARD_GPU_H
 #define GUARD_GPU_H
 
+enum
+{
+    COMPOSITOR_SCALAR,
+    COMPOSITOR_SSE2,
+    COMPOSITOR_SSSE3,
+    COMPOSITOR_AVX2,
+    COMPOSITOR_COUNT,
+};
+
 extern uint32_t gpuClock;
 extern bool gpuFrameDone;
 
 void gpu_handle_vram_write(uint16_t addr, uint8_t val);
-void gpu_set_screen_palette(unsigned int bytesPerPixel, const void *palette);
-void gpu_frame_init(void);
+void gpu_load_vram(const uint8_t *newVram);
+void gpu_invalidate_tiles(void);
+void gpu_invalidate_sprites(void);
+void gpu_set_screen_format(unsigned int format, const uint8_t palette[4][3]);
+bool gpu_set_compositor(unsigned int which);
+const char *gpu_get_compositor_name(unsigned int which);
+unsigned int gpu_get_compositor(void);
+void gpu_get_cache_stats(unsigned long *tileRows, unsigned long *layerRows);
+void gpu_render_lines(uint8_t *buffer, size_t pitch);
+const struct FrameChanges *gpu_get_frame_changes(void);
+bool gpu_set_render_mode(unsigned int mode);
+void gpu_set_pixel_fifo(bool on);
+void gpu_sync(void);
+void gpu_frame_init(uint8_t *buffer, size_t pitch);
 void gpu_step(void);
+size_t gpu_state_size(void);
+uint8_t *gpu_save_state(uint8_t *p);
+const uint8_t *gpu_load_state(const uint8_t *p);
 
 #endif  // GUARD_GPU_H
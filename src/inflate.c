@@ -0,0 +1,420 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "global.h"
+#include "inflate.h"
+
+enum
+{
+    STATE_BLOCK_HEADER,
+    STATE_STORED,
+    STATE_HUFFMAN,
+};
+
+#define MAX_CODE_BITS 15
+#define MAX_PADDING 8  // More than this means the input ended mid-stream
+
+static const uint16_t lengthBase[29] =
+{
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+};
+static const uint8_t lengthExtra[29] =
+{
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+};
+static const uint16_t distBase[30] =
+{
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577,
+};
+static const uint8_t distExtra[30] =
+{
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+};
+
+//------------------------------------------------------------------------------
+// Bit input
+//------------------------------------------------------------------------------
+
+static bool refill_input(struct Inflater *inf)
+{
+    size_t count = MIN(inf->inLeft, sizeof(inf->inBuffer));
+    
+    if (count != 0)
+        count = fread(inf->inBuffer, 1, count, inf->file);
+    inf->inLeft -= count;
+    inf->inPos = inf->inBuffer;
+    inf->inEnd = inf->inBuffer + count;
+    return count != 0;
+}
+
+// Makes at least n bits available. Past the end of the input, zeroes are fed
+// in so that a code near the end can be looked up with a full-width peek.
+// Whether any of them were actually consumed is checked at the end.
+static bool need_bits(struct Inflater *inf, unsigned int n)
+{
+    while (inf->bitCount < n)
+    {
+        uint8_t byte = 0;
+        
+        if (inf->inPos != inf->inEnd || refill_input(inf))
+            byte = *inf->inPos++;
+        else if (++inf->padding > MAX_PADDING)
+            return false;
+        inf->bitBuf |= (uint64_t)byte << inf->bitCount;
+        inf->bitCount += 8;
+    }
+    return true;
+}
+
+static void drop_bits(struct Inflater *inf, unsigned int n)
+{
+    inf->bitBuf >>= n;
+    inf->bitCount -= n;
+}
+
+static bool get_bits(struct Inflater *inf, unsigned int n, unsigned int *val)
+{
+    if (!need_bits(inf, n))
+        return false;
+    *val = inf->bitBuf & ((1u << n) - 1);
+    drop_bits(inf, n);
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// Huffman codes
+//------------------------------------------------------------------------------
+
+static bool build_table(struct HuffmanTable *h, const uint8_t *lengths, unsigned int n)
+{
+    uint16_t offsets[MAX_CODE_BITS + 1];
+    int left = 1;
+    unsigned int code = 0;
+    unsigned int index = 0;
+    
+    memset(h->count, 0, sizeof(h->count));
+    for (unsigned int i = 0; i < n; i++)
+        h->count[lengths[i]]++;
+    h->count[0] = 0;
+    for (unsigned int len = 1; len <= MAX_CODE_BITS; len++)
+    {
+        left = left * 2 - h->count[len];
+        if (left < 0)
+            return false;  // More codes than there is room for
+    }
+    offsets[1] = 0;
+    for (unsigned int len = 1; len < MAX_CODE_BITS; len++)
+        offsets[len + 1] = offsets[len] + h->count[len];
+    for (unsigned int i = 0; i < n; i++)
+    {
+        if (lengths[i] != 0)
+            h->symbol[offsets[lengths[i]]++] = i;
+    }
+    
+    // Codes are packed starting from their most significant bit, so the short
+    // ones are entered into the lookup table bit-reversed, once for every
+    // possible value of the bits that follow them.
+    memset(h->fast, 0, sizeof(h->fast));
+    for (unsigned int len = 1; len <= INFLATE_FAST_BITS; len++)
+    {
+        for (unsigned int i = 0; i < h->count[len]; i++)
+        {
+            unsigned int reversed = 0;
+            
+            for (unsigned int bit = 0; bit < len; bit++)
+                reversed |= ((code >> bit) & 1) << (len - 1 - bit);
+            for (unsigned int j = reversed; j < (1u << INFLATE_FAST_BITS); j += 1u << len)
+                h->fast[j] = (h->symbol[index] << 4) | len;
+            code++;
+            index++;
+        }
+        code <<= 1;
+    }
+    return true;
+}
+
+// Returns the next symbol, or -1 if there is no valid code
+static int decode_symbol(struct Inflater *inf, const struct HuffmanTable *h)
+{
+    unsigned int entry;
+    unsigned int code = 0;
+    unsigned int first = 0;
+    unsigned int index = 0;
+    
+    if (!need_bits(inf, MAX_CODE_BITS))
+        return -1;
+    entry = h->fast[inf->bitBuf & ((1 << INFLATE_FAST_BITS) - 1)];
+    if (entry != 0)
+    {
+        drop_bits(inf, entry & 0xF);
+        return entry >> 4;
+    }
+    
+    // Walk the canonical code one bit at a time
+    for (unsigned int len = 1; len <= MAX_CODE_BITS; len++)
+    {
+        code |= (inf->bitBuf >> (len - 1)) & 1;
+        if (code - first < h->count[len])
+        {
+            drop_bits(inf, len);
+            return h->symbol[index + code - first];
+        }
+        index += h->count[len];
+        first = (first + h->count[len]) << 1;
+        code <<= 1;
+    }
+    return -1;
+}
+
+static void read_fixed_tables(struct Inflater *inf)
+{
+    uint8_t lengths[288];
+    
+    memset(lengths, 8, 144);
+    memset(lengths + 144, 9, 112);
+    memset(lengths + 256, 7, 24);
+    memset(lengths + 280, 8, 8);
+    build_table(&inf->litLen, lengths, 288);
+    memset(lengths, 5, 30);
+    build_table(&inf->dist, lengths, 30);
+}
+
+static bool read_dynamic_tables(struct Inflater *inf)
+{
+    static const uint8_t order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+    uint8_t lengths[288 + 32];
+    unsigned int numLitLen, numDist, numCodeLen;
+    unsigned int i = 0;
+    
+    if (!get_bits(inf, 5, &numLitLen) || !get_bits(inf, 5, &numDist) || !get_bits(inf, 4, &numCodeLen))
+        return false;
+    numLitLen += 257;
+    numDist += 1;
+    numCodeLen += 4;
+    if (numLitLen > 286 || numDist > 30)
+        return false;
+    
+    // The code lengths are themselves Huffman coded
+    memset(lengths, 0, 19);
+    for (unsigned int j = 0; j < numCodeLen; j++)
+    {
+        unsigned int len;
+        
+        if (!get_bits(inf, 3, &len))
+            return false;
+        lengths[order[j]] = len;
+    }
+    if (!build_table(&inf->litLen, lengths, 19))
+        return false;
+    
+    while (i < numLitLen + numDist)
+    {
+        int sym = decode_symbol(inf, &inf->litLen);
+        unsigned int repeat;
+        uint8_t len = 0;
+        
+        if (sym < 0)
+            return false;
+        if (sym < 16)
+        {
+            lengths[i++] = sym;
+            continue;
+        }
+        if (sym == 16)
+        {
+            if (i == 0 || !get_bits(inf, 2, &repeat))
+                return false;
+            len = lengths[i - 1];
+            repeat += 3;
+        }
+        else if (sym == 17)
+        {
+            if (!get_bits(inf, 3, &repeat))
+                return false;
+            repeat += 3;
+        }
+        else
+        {
+            if (!get_bits(inf, 7, &repeat))
+                return false;
+            repeat += 11;
+        }
+        if (i + repeat > numLitLen + numDist)
+            return false;
+        memset(lengths + i, len, repeat);
+        i += repeat;
+    }
+    if (lengths[256] == 0)
+        return false;  // No end of block code
+    return build_table(&inf->litLen, lengths, numLitLen)
+        && build_table(&inf->dist, lengths + numLitLen, numDist);
+}
+
+//------------------------------------------------------------------------------
+// Blocks
+//------------------------------------------------------------------------------
+
+static int read_block_header(struct Inflater *inf)
+{
+    unsigned int type;
+    unsigned int len, nlen;
+    
+    if (inf->lastBlock)
+    {
+        // Anything but the padding of the last byte means the input was short
+        return (inf->padding * 8 <= inf->bitCount) ? INFLATE_DONE : INFLATE_ERROR;
+    }
+    if (!get_bits(inf, 1, &type))
+        return INFLATE_ERROR;
+    inf->lastBlock = type;
+    if (!get_bits(inf, 2, &type))
+        return INFLATE_ERROR;
+    switch (type)
+    {
+      case 0:
+        drop_bits(inf, inf->bitCount % 8);
+        if (!get_bits(inf, 16, &len) || !get_bits(inf, 16, &nlen) || len != (~nlen & 0xFFFF))
+            return INFLATE_ERROR;
+        inf->storedLeft = len;
+        inf->state = STATE_STORED;
+        return INFLATE_OK;
+      case 1:
+        read_fixed_tables(inf);
+        inf->state = STATE_HUFFMAN;
+        return INFLATE_OK;
+      case 2:
+        if (!read_dynamic_tables(inf))
+            return INFLATE_ERROR;
+        inf->state = STATE_HUFFMAN;
+        return INFLATE_OK;
+    }
+    return INFLATE_ERROR;
+}
+
+static int copy_stored(struct Inflater *inf, size_t outLimit)
+{
+    while (inf->storedLeft != 0 && inf->outPos < outLimit)
+    {
+        size_t count;
+        
+        if (inf->outPos == inf->outSize)
+            return INFLATE_ERROR;
+        
+        // Whole bytes still in the bit buffer come first
+        if (inf->bitCount != 0)
+        {
+            inf->out[inf->outPos++] = inf->bitBuf;
+            drop_bits(inf, 8);
+            inf->storedLeft--;
+            continue;
+        }
+        if (inf->inPos == inf->inEnd && !refill_input(inf))
+            return INFLATE_ERROR;
+        count = MIN(inf->storedLeft, (size_t)(inf->inEnd - inf->inPos));
+        count = MIN(count, outLimit - inf->outPos);
+        count = MIN(count, inf->outSize - inf->outPos);
+        memcpy(inf->out + inf->outPos, inf->inPos, count);
+        inf->inPos += count;
+        inf->outPos += count;
+        inf->storedLeft -= count;
+    }
+    if (inf->storedLeft == 0)
+        inf->state = STATE_BLOCK_HEADER;
+    return INFLATE_OK;
+}
+
+static int decode_huffman(struct Inflater *inf, size_t outLimit)
+{
+    while (inf->outPos < outLimit)
+    {
+        int sym = decode_symbol(inf, &inf->litLen);
+        unsigned int extra;
+        size_t length, distance;
+        
+        if (sym < 0)
+            return INFLATE_ERROR;
+        if (sym < 256)
+        {
+            if (inf->outPos == inf->outSize)
+                return INFLATE_ERROR;
+            inf->out[inf->outPos++] = sym;
+            continue;
+        }
+        if (sym == 256)
+        {
+            inf->state = STATE_BLOCK_HEADER;
+            return INFLATE_OK;
+        }
+        
+        sym -= 257;
+        if (sym >= 29 || !get_bits(inf, lengthExtra[sym], &extra))
+            return INFLATE_ERROR;
+        length = lengthBase[sym] + extra;
+        sym = decode_symbol(inf, &inf->dist);
+        if (sym < 0 || sym >= 30 || !get_bits(inf, distExtra[sym], &extra))
+            return INFLATE_ERROR;
+        distance = distBase[sym] + extra;
+        if (distance > inf->outPos || length > inf->outSize - inf->outPos)
+            return INFLATE_ERROR;
+        
+        // The source may overlap the destination, which repeats the pattern
+        for (size_t i = 0; i < length; i++)
+            inf->out[inf->outPos + i] = inf->out[inf->outPos - distance + i];
+        inf->outPos += length;
+    }
+    return INFLATE_OK;
+}
+
+//------------------------------------------------------------------------------
+// Public functions
+//------------------------------------------------------------------------------
+
+// Starts decompressing inSize bytes from the current position of file into a
+// buffer of outSize bytes
+void inflate_init(struct Inflater *inf, FILE *file, size_t inSize, uint8_t *out, size_t outSize)
+{
+    inf->file = file;
+    inf->inLeft = inSize;
+    inf->inPos = inf->inEnd = inf->inBuffer;
+    inf->padding = 0;
+    inf->bitBuf = 0;
+    inf->bitCount = 0;
+    inf->out = out;
+    inf->outPos = 0;
+    inf->outSize = outSize;
+    inf->state = STATE_BLOCK_HEADER;
+    inf->lastBlock = false;
+}
+
+// Decompresses until at least outLimit bytes of output exist or the stream
+// ends. A match can take the output up to 257 bytes past outLimit. Passing
+// SIZE_MAX decompresses the rest of the stream.
+int inflate_run(struct Inflater *inf, size_t outLimit)
+{
+    while (inf->outPos < outLimit)
+    {
+        int result;
+        
+        switch (inf->state)
+        {
+          case STATE_BLOCK_HEADER:
+            result = read_block_header(inf);
+            break;
+          case STATE_STORED:
+            result = copy_stored(inf, outLimit);
+            break;
+          default:
+            result = decode_huffman(inf, outLimit);
+            break;
+        }
+        if (result != INFLATE_OK)
+            return result;
+    }
+    return INFLATE_OK;
+}
@@ -0,0 +1,47 @@
+#ifndef GUARD_INFLATE_H
+#define GUARD_INFLATE_H
+
+// Codes up to this long are decoded with a single table lookup
+#define INFLATE_FAST_BITS 9
+
+struct HuffmanTable
+{
+    uint16_t fast[1 << INFLATE_FAST_BITS];  // symbol << 4 | length, or 0
+    uint16_t count[16];                     // Number of codes of each length
+    uint16_t symbol[288];                   // Symbols in canonical code order
+};
+
+enum
+{
+    INFLATE_OK,     // Produced the requested amount of output
+    INFLATE_DONE,   // Reached the end of the stream
+    INFLATE_ERROR,  // The stream is corrupt or doesn't fit in the output
+};
+
+// A DEFLATE (RFC 1951) decoder that reads compressed data from a file as it
+// goes and can stop and resume between any two symbols. It decompresses
+// straight into one output buffer, which also serves as its window.
+struct Inflater
+{
+    FILE *file;
+    size_t inLeft;  // Compressed bytes not read from the file yet
+    uint8_t inBuffer[4096];
+    const uint8_t *inPos;
+    const uint8_t *inEnd;
+    unsigned int padding;  // Zero bytes fed in past the end of the input
+    uint64_t bitBuf;
+    unsigned int bitCount;
+    uint8_t *out;
+    size_t outPos;
+    size_t outSize;
+    int state;
+    bool lastBlock;
+    size_t storedLeft;
+    struct HuffmanTable litLen;
+    struct HuffmanTable dist;
+};
+
+void inflate_init(struct Inflater *inf, FILE *file, size_t inSize, uint8_t *out, size_t outSize);
+int inflate_run(struct Inflater *inf, size_t outLimit);
+
+#endif  // GUARD_INFLATE_H
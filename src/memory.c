@@ -4,36 +4,169 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "global.h"
+#include "audio.h"
+#include "cheats.h"
 #include "gameboy.h"
 #include "gpu.h"
 #include "memory.h"
+#include "saveram.h"
 #include "platform/platform.h"
 
-uint8_t *gamePAK;
-uint8_t *rom0;
-uint8_t *rom1;
+const uint8_t *gamePAK;
+const uint8_t *rom0;
+const uint8_t *rom1;
 uint8_t vram[VRAM_SIZE];
-uint8_t eram[ERAM_SIZE];
 uint8_t iwram[IWRAM_SIZE];
 uint8_t io[IO_SIZE];
 uint8_t oam[OAM_SIZE];
 uint8_t hram[HRAM_SIZE];
 uint8_t ie;
 
-static FILE *saveFile;
-
 struct MBCDriver
 {
     uint8_t (*readByte)(uint16_t addr);
     void (*writeByte)(uint16_t addr, uint8_t val);
-    void (*loadSaveFile)(const char *filename);
-    void (*saveSaveFile)(const char *filename);
+    size_t stateSize;
+    uint8_t *(*saveState)(uint8_t *p);
+    const uint8_t *(*loadState)(const uint8_t *p);
+    void (*updateBanks)(void);  // Maps the current banks into the page tables
+    void (*endFrame)(void);     // Optional, called at the end of every frame
 };
 
 static struct MBCDriver mbcDriver;
 
+// Cartridge RAM, sized from the header. It is NULL on cartridges without RAM,
+// which leaves 0xA000-0xBFFF to the MBC's handlers.
+static uint8_t *cartRam;
+static size_t cartRamSize;             // A whole number of 8KByte banks
+static unsigned int cartRamBankCount;  // A power of two, or 0
+
+//------------------------------------------------------------------------------
+// Page Tables
+//------------------------------------------------------------------------------
+
+// The address space is split into 256 pages of 256 bytes. Pages backed by
+// plain memory have a host pointer in these tables, so most reads and writes
+// are a single lookup. Pages with a NULL entry go through the page's handler
+// instead.
+const uint8_t *memReadPages[256];
+uint8_t *memWritePages[256];
+static uint8_t (*readHandlers[256])(uint16_t addr);
+static void (*writeHandlers[256])(uint16_t addr, uint8_t val);
+
+// Pages with watched addresses send writes to watch_write(), which passes them
+// on to what the page would otherwise be mapped to, kept here
+static bool watchedPages[256];
+static uint8_t *watchedWritePages[256];
+static void (*watchedWriteHandlers[256])(uint16_t addr, uint8_t val);
+
+static bool tileMapWritesTrapped;  // Tile map writes go to vram_write()
+
+// Maps count pages starting at firstPage to readMem for reading and writeMem
+// for writing. Either can be NULL to send accesses to the handlers.
+static void map_pages(unsigned int firstPage, unsigned int count, const uint8_t *readMem, uint8_t *writeMem)
+{
+    for (unsigned int i = 0; i < count; i++)
+    {
+        uint8_t *writePage = (writeMem != NULL) ? writeMem + i * 0x100 : NULL;
+        
+        memReadPages[firstPage + i] = (readMem != NULL) ? readMem + i * 0x100 : NULL;
+        if (watchedPages[firstPage + i])
+            watchedWritePages[firstPage + i] = writePage;
+        else
+            memWritePages[firstPage + i] = writePage;
+    }
+}
+
+// Selects the ROM bank at 0x4000-0x7FFF. Bank numbers past the end of the
+// image wrap around like they do on a real cartridge, where the upper bank
+// lines are not connected. Banks of a ROM that is lazily extracted from an
+// archive are extracted the first time they are selected.
+static void set_rom1(unsigned int bank)
+{
+    bank &= gRomInfo.romBankCount - 1;
+    if (bank >= gRomInfo.romBanksLoaded)
+        gameboy_load_rom_banks(bank + 1);
+    rom1 = gamePAK + 0x4000 * bank;
+    map_pages(0x40, 0x40, rom1, NULL);
+    cheats_patch_rom_pages(bank, 0x40);
+}
+
+// Returns a cartridge RAM bank. Like ROM banks, bank numbers past the amount
+// of RAM on the cartridge wrap around.
+static uint8_t *cart_ram_bank(unsigned int bank)
+{
+    if (cartRam == NULL)
+        return NULL;
+    return cartRam + 0x2000 * (bank & (cartRamBankCount - 1));
+}
+
+//------------------------------------------------------------------------------
+// OAM DMA
+//------------------------------------------------------------------------------
+
+// Writing to the DMA register copies 0xA0 bytes from (val << 8) to OAM, one
+// byte per machine cycle, and the CPU can't access OAM until it's done. The
+// copy is done lazily: whenever OAM is about to be looked at, the bytes that
+// are due by then are copied in one go.
+#define DMA_LENGTH 0xA0
+#define DMA_CYCLES_PER_BYTE 4
+
+static bool dmaActive;
+static uint16_t dmaSource;
+static uint32_t dmaStartClock;
+static unsigned int dmaBytesDone;
+
+// Copies the source bytes up to end through the page tables, so MBC banking
+// and cartridge RAM apply the same way they do for the CPU
+static void dma_copy(unsigned int end)
+{
+    const uint8_t *src = memReadPages[dmaSource >> 8];
+    
+    if (src != NULL)
+        memcpy(oam + dmaBytesDone, src + dmaBytesDone, end - dmaBytesDone);
+    else
+    {
+        for (unsigned int i = dmaBytesDone; i < end; i++)
+            oam[i] = readHandlers[dmaSource >> 8](dmaSource + i);
+    }
+    dmaBytesDone = end;
+    gpu_invalidate_sprites();
+}
+
+// Brings a running DMA transfer up to cpuClock
+void memory_sync_dma(void)
+{
+    uint32_t elapsed;
+    
+    if (!dmaActive)
+        return;
+    elapsed = cpuClock - dmaStartClock;
+    if (dmaBytesDone < DMA_LENGTH)
+        dma_copy(MIN(elapsed / DMA_CYCLES_PER_BYTE, DMA_LENGTH));
+    if (elapsed >= DMA_LENGTH * DMA_CYCLES_PER_BYTE)
+        dmaActive = false;
+}
+
+static void dma_start(uint8_t val)
+{
+    memory_sync_dma();  // A running transfer stops where it is
+    if (val >= 0xE0)
+        val -= 0x20;  // Reads from 0xE000 and up hit WRAM through the echo
+    dmaSource = val << 8;
+    dmaStartClock = cpuClock;
+    dmaBytesDone = 0;
+    dmaActive = true;
+    
+    // Games normally wait for the transfer in a loop in HRAM, which can't see
+    // OAM or touch the source. Then the whole copy can be done right away.
+    if (regs.pc >= 0xFF80 && memReadPages[val] != NULL)
+        dma_copy(DMA_LENGTH);
+}
+
 //------------------------------------------------------------------------------
 // Null MBC Driver
 //------------------------------------------------------------------------------
@@ -52,24 +185,23 @@ static void mbc_null_write_byte(uint16_t addr, uint8_t val)
 {
     (void)val;
     
-    // Tetris hacks. I don't know why the game feels like poking this memory
     if (addr <= 0x7FFF)  // Silently ignore any writes to ROM
         return;
-    if (addr >= 0x9800 && addr <= 0x9FFF)
-        return;
-    if (addr >= 0xFEA0 && addr <= 0xFEFF)
-    {
-        //oam[addr - 0xFE00] = val;
-        return;
-    }
     
     platform_fatal_error("Wrote byte to invalid address 0x%04X, pc = 0x%04X", addr, regs.pc);
 }
 
+static void mbc_null_update_banks(void)
+{
+    set_rom1(1);
+}
+
 static void mbc_null_init(void)
 {
+    memset(&mbcDriver, 0, sizeof(mbcDriver));
     mbcDriver.readByte = mbc_null_read_byte;
     mbcDriver.writeByte = mbc_null_write_byte;
+    mbcDriver.updateBanks = mbc_null_update_banks;
 }
 
 //------------------------------------------------------------------------------
@@ -86,7 +218,6 @@ static uint8_t mbc1Reg1;
 static uint8_t mbc1Reg2;
 static uint8_t mbc1RomBankNum;
 static uint8_t mbc1RamBankNum;
-static uint8_t mbc1RamBanks[4][0x2000];
 
 static void mbc1_update_banks(void)
 {
@@ -98,7 +229,11 @@ static void mbc1_update_banks(void)
         mbc1RamBankNum = mbc1Reg2;
     }
     
-    rom1 = gamePAK + 0x4000 * mbc1RomBankNum;
+    set_rom1(mbc1RomBankNum);
+    if (mbc1RamEnabled)
+        map_pages(0xA0, 0x20, cart_ram_bank(mbc1RamBankNum), cart_ram_bank(mbc1RamBankNum));
+    else
+        map_pages(0xA0, 0x20, NULL, NULL);
 }
 
 // Write to 0x0000-0x1FFF
@@ -113,9 +248,12 @@ static void mbc1_reg0(uint8_t val)
     }
     else
     {
+        if (mbc1RamEnabled)
+            saveram_request_flush();
         mbc1RamEnabled = false;
         dbg_puts("mbc1: disabled RAM");
     }
+    mbc1_update_banks();
 }
 
 // Write to 0x2000-0x3FFF
@@ -160,8 +298,10 @@ static uint8_t mbc1_read_byte(uint16_t addr)
         return rom1[addr - 0x4000];
       case 0xA:
       case 0xB:
+        if (cartRam == NULL)
+            return 0xFF;  // No RAM on the cartridge
         if (mbc1RamEnabled)
-            return mbc1RamBanks[mbc1RamBankNum][addr - 0xA000];
+            return cart_ram_bank(mbc1RamBankNum)[addr - 0xA000];
         break;
     }
     platform_fatal_error("Read byte from invalid address 0x%04X", addr);
@@ -170,10 +310,6 @@ static uint8_t mbc1_read_byte(uint16_t addr)
 
 static void mbc1_write_byte(uint16_t addr, uint8_t val)
 {
-    // Super Mario Land hack
-    if (addr >= 0xFEA0 && addr <= 0xFEFF)
-        return;
-    
     switch (addr >> 12)
     {
       //0x0000-0x1FFF
@@ -198,51 +334,38 @@ static void mbc1_write_byte(uint16_t addr, uint8_t val)
         return;
       case 0xA:
       case 0xB:
-        if (mbc1RamEnabled)
+        if (mbc1RamEnabled && cartRam != NULL)
         {
-            mbc1RamBanks[mbc1RamBankNum][addr - 0xA000] = val;
-            break;
+            cart_ram_bank(mbc1RamBankNum)[addr - 0xA000] = val;
+            return;
         }
         
-        // Super Mario Land hack
+        // Writes to disabled RAM are ignored
         return;
-        
-        break;
     }
     platform_fatal_error("Wrote byte to invalid address 0x%04X, pc = 0x%04X", addr, regs.pc);
 }
 
-static void mbc1_load_save_file(const char *filename)
+static uint8_t *mbc1_save_state(uint8_t *p)
 {
-    size_t ramSize = gRomInfo.ramSizeKbyte * 1024;
-    
-    dbg_printf("mbc1: loading save file from '%s'\n", filename);
-    saveFile = fopen(filename, "rb");
-    if (saveFile == NULL)
-    {
-        // Try to create it
-        saveFile = fopen(filename, "wb");
-        if (saveFile == NULL)
-            platform_fatal_error("Failed to load save file '%s'", filename);
-        fclose(saveFile);
-        return;
-    }
-    assert(ramSize <= sizeof(mbc1RamBanks));
-    fread(mbc1RamBanks, 1, gRomInfo.ramSizeKbyte * 1024, saveFile);
-    fclose(saveFile);
+    STATE_SAVE(p, mbc1Mode);
+    STATE_SAVE(p, mbc1RamEnabled);
+    STATE_SAVE(p, mbc1Reg1);
+    STATE_SAVE(p, mbc1Reg2);
+    STATE_SAVE(p, mbc1RomBankNum);
+    STATE_SAVE(p, mbc1RamBankNum);
+    return p;
 }
 
-static void mbc1_save_save_file(const char *filename)
+static const uint8_t *mbc1_load_state(const uint8_t *p)
 {
-    size_t ramSize = gRomInfo.ramSizeKbyte * 1024;
-    
-    dbg_printf("mbc1: saving save file to '%s'\n", filename);
-    saveFile = fopen(filename, "wb");
-    if (saveFile == NULL)
-        platform_fatal_error("Failed to save file '%s'", filename);
-    assert(ramSize <= sizeof(mbc1RamBanks));
-    fwrite(mbc1RamBanks, 1, gRomInfo.ramSizeKbyte * 1024, saveFile);
-    fclose(saveFile);
+    STATE_LOAD(p, mbc1Mode);
+    STATE_LOAD(p, mbc1RamEnabled);
+    STATE_LOAD(p, mbc1Reg1);
+    STATE_LOAD(p, mbc1Reg2);
+    STATE_LOAD(p, mbc1RomBankNum);
+    STATE_LOAD(p, mbc1RamBankNum);
+    return p;
 }
 
 static void mbc1_init(void)
@@ -251,11 +374,16 @@ static void mbc1_init(void)
     
     mbcDriver.readByte = mbc1_read_byte;
     mbcDriver.writeByte = mbc1_write_byte;
-    mbcDriver.loadSaveFile = mbc1_load_save_file;
-    mbcDriver.saveSaveFile = mbc1_save_save_file;
+    mbcDriver.stateSize = sizeof(mbc1Mode) + sizeof(mbc1RamEnabled) + sizeof(mbc1Reg1)
+      + sizeof(mbc1Reg2) + sizeof(mbc1RomBankNum) + sizeof(mbc1RamBankNum);
+    mbcDriver.saveState = mbc1_save_state;
+    mbcDriver.loadState = mbc1_load_state;
+    mbcDriver.updateBanks = mbc1_update_banks;
     
     mbc1Mode = MBC1_MODE_ROM;
     mbc1RamEnabled = false;
+    mbc1Reg1 = 1;
+    mbc1Reg2 = 0;
     mbc1RomBankNum = 1; 
     mbc1RamBankNum = 0;  // I don't know what the default is.
 }
@@ -266,17 +394,197 @@ static void mbc1_init(void)
 
 static uint8_t mbc3RomBankNum;
 static uint8_t mbc3RamBankNum;
-uint8_t mbc3CartRamBanks[4][0x2000];
 static bool mbc3RamRTCWriteEnabled;
 static enum
 {
     MBC3_MODE_RAM,
     MBC3_MODE_RTC,
 } mbc3Mode;
+static uint8_t mbc3RtcSelect;  // RTC register mapped at 0xA000, 0x08-0x0C
+
+// The real-time clock does no work while the game runs. It remembers what the
+// counter was at some point in time, and only works out how far it has moved
+// since when the game latches it or writes to it. That point in time is a host
+// timestamp, or in deterministic mode an emulated cycle count.
+#define RTC_REG_S  0x08
+#define RTC_REG_M  0x09
+#define RTC_REG_H  0x0A
+#define RTC_REG_DL 0x0B
+#define RTC_REG_DH 0x0C
+#define RTC_DH_HALT  (1 << 6)
+#define RTC_DH_CARRY (1 << 7)
 
-static void mbc3_update_rom_bank(void)
+#define RTC_SECONDS_PER_DAY 86400
+#define RTC_MAX_DAYS 512  // The day counter has 9 bits
+
+#define RTC_TRAILER_SIZE 48
+
+static bool rtcDeterministic;
+static uint32_t rtcSeconds;     // Counter value at the base time, in seconds
+static bool rtcHalt;
+static bool rtcCarry;           // Day counter overflow
+static int64_t rtcBaseTime;     // Host time that rtcSeconds was last updated at
+static uint64_t rtcBaseCycles;  // The same, in cycles, in deterministic mode
+static uint64_t rtcCycles;      // Cycles emulated since the ROM was loaded
+static uint32_t rtcLastCpuClock;
+static uint8_t rtcLatchReg;     // Last value written to 0x6000-0x7FFF
+static uint8_t rtcLatched[5];   // S, M, H, DL and DH, as the game reads them
+
+// cpuClock wraps around every 17 minutes, so it is folded into a 64-bit count
+// at least once per frame.
+static void rtc_sync_clock(void)
+{
+    rtcCycles += (uint32_t)(cpuClock - rtcLastCpuClock);
+    rtcLastCpuClock = cpuClock;
+}
+
+static void rtc_set_base(void)
 {
-    rom1 = gamePAK + 0x4000 * mbc3RomBankNum;
+    rtc_sync_clock();
+    rtcBaseTime = time(NULL);
+    rtcBaseCycles = rtcCycles;
+}
+
+// Brings rtcSeconds up to date
+static void rtc_update(void)
+{
+    uint64_t elapsed;
+    
+    if (rtcDeterministic)
+    {
+        rtc_sync_clock();
+        elapsed = (rtcCycles - rtcBaseCycles) / CPU_CLOCK_RATE;
+        rtcBaseCycles += elapsed * CPU_CLOCK_RATE;  // Keep the partial second
+    }
+    else
+    {
+        int64_t now = time(NULL);
+        
+        elapsed = (now > rtcBaseTime) ? now - rtcBaseTime : 0;
+        rtcBaseTime = now;
+    }
+    if (rtcHalt)
+        return;
+    elapsed += rtcSeconds;
+    if (elapsed >= (uint64_t)RTC_MAX_DAYS * RTC_SECONDS_PER_DAY)
+    {
+        rtcCarry = true;
+        elapsed %= (uint64_t)RTC_MAX_DAYS * RTC_SECONDS_PER_DAY;
+    }
+    rtcSeconds = elapsed;
+}
+
+// Splits the counter into the S, M, H, DL and DH registers
+static void rtc_get_regs(uint8_t *regs)
+{
+    unsigned int days = rtcSeconds / RTC_SECONDS_PER_DAY;
+    
+    regs[0] = rtcSeconds % 60;
+    regs[1] = rtcSeconds / 60 % 60;
+    regs[2] = rtcSeconds / 3600 % 24;
+    regs[3] = days & 0xFF;
+    regs[4] = ((days >> 8) & 1) | (rtcHalt ? RTC_DH_HALT : 0) | (rtcCarry ? RTC_DH_CARRY : 0);
+}
+
+// Out of range values, which games can write, carry into the next register
+static void rtc_set_regs(const uint8_t *regs)
+{
+    unsigned int days = regs[3] | ((regs[4] & 1) << 8);
+    
+    rtcSeconds = (regs[0] & 0x3F) + (regs[1] & 0x3F) * 60 + (regs[2] & 0x1F) * 3600
+      + days * RTC_SECONDS_PER_DAY;
+    rtcHalt = (regs[4] & RTC_DH_HALT) != 0;
+    rtcCarry = (regs[4] & RTC_DH_CARRY) != 0;
+}
+
+static void rtc_write(uint8_t reg, uint8_t val)
+{
+    uint8_t regs[5];
+    
+    rtc_update();
+    rtc_get_regs(regs);
+    regs[reg - RTC_REG_S] = val;
+    rtc_set_regs(regs);
+    rtcLatched[reg - RTC_REG_S] = val;
+    if (reg == RTC_REG_S)
+        rtcBaseCycles = rtcCycles;  // Writing the seconds resets the divider
+}
+
+static void put_le32(uint8_t *p, uint32_t val)
+{
+    for (int i = 0; i < 4; i++)
+        p[i] = val >> (i * 8);
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// The clock is stored after the RAM in the save file, in the format used by
+// most emulators: the current and latched registers as 32-bit words, then the
+// host time they were saved at as a 64-bit word.
+static void rtc_fill_trailer(uint8_t *buffer)
+{
+    uint8_t regs[5];
+    uint64_t now = time(NULL);
+    
+    rtc_update();
+    rtc_get_regs(regs);
+    for (int i = 0; i < 5; i++)
+    {
+        put_le32(buffer + i * 4, regs[i]);
+        put_le32(buffer + 20 + i * 4, rtcLatched[i]);
+    }
+    put_le32(buffer + 40, now);
+    put_le32(buffer + 44, now >> 32);
+}
+
+// Restores the clock from the save file. Unless the clock is deterministic,
+// it also catches up with the time that passed while the game wasn't running.
+static void rtc_load_trailer(void)
+{
+    uint8_t buffer[RTC_TRAILER_SIZE];
+    size_t size = saveram_read_trailer(buffer, sizeof(buffer));
+    uint8_t regs[5];
+    int64_t savedTime;
+    
+    saveram_set_trailer(RTC_TRAILER_SIZE, rtc_fill_trailer);
+    if (size < 44)  // Some emulators only store a 32-bit timestamp
+        return;
+    for (int i = 0; i < 5; i++)
+    {
+        regs[i] = get_le32(buffer + i * 4);
+        rtcLatched[i] = get_le32(buffer + 20 + i * 4);
+    }
+    rtc_set_regs(regs);
+    savedTime = get_le32(buffer + 40);
+    if (size == RTC_TRAILER_SIZE)
+        savedTime |= (int64_t)get_le32(buffer + 44) << 32;
+    if (!rtcDeterministic)
+        rtcBaseTime = savedTime;
+    dbg_printf("mbc3: loaded RTC, %u seconds\n", rtcSeconds);
+}
+
+static void rtc_init(void)
+{
+    rtcSeconds = 0;
+    rtcHalt = false;
+    rtcCarry = false;
+    rtcCycles = 0;
+    rtcLastCpuClock = 0;  // cpuClock starts from 0 when a ROM is loaded
+    rtcLatchReg = 0xFF;
+    rtc_set_base();
+    rtc_get_regs(rtcLatched);
+}
+
+static void mbc3_update_banks(void)
+{
+    set_rom1(mbc3RomBankNum);
+    if (mbc3Mode == MBC3_MODE_RAM)
+        map_pages(0xA0, 0x20, cart_ram_bank(mbc3RamBankNum), cart_ram_bank(mbc3RamBankNum));
+    else
+        map_pages(0xA0, 0x20, NULL, NULL);
 }
 
 // Write to 0x0000-0x1FFF
@@ -291,6 +599,8 @@ static void mbc3_reg0(uint8_t val)
     }
     else
     {
+        if (mbc3RamRTCWriteEnabled)
+            saveram_request_flush();
         mbc3RamRTCWriteEnabled = false;
         dbg_puts("mbc3: disabled writing to RAM and RTC");
     }
@@ -304,7 +614,7 @@ static void mbc3_reg1(uint8_t val)
     if (mbc3RomBankNum == 0)
         mbc3RomBankNum = 1;
     //printf("mbc3: selected ROM bank 0x%02X\n", mbc3RomBankNum);
-    mbc3_update_rom_bank();
+    mbc3_update_banks();
 }
 
 // Write to 0x4000-0x5FFF
@@ -320,25 +630,29 @@ static void mbc3_reg2(uint8_t val)
         mbc3RamBankNum = val;
         dbg_printf("mbc3: selected RAM bank 0x%02X\n", mbc3RamBankNum);
     }
-    else if (val >= 0x08 && val <= 0x0C)
+    else if (val >= RTC_REG_S && val <= RTC_REG_DH)
     {
         mbc3Mode = MBC3_MODE_RTC;
-        dbg_puts("mbc3: RTC not implemented");
+        mbc3RtcSelect = val;
     }
+    mbc3_update_banks();
 }
 
 // Write to 0x6000-0x7FFF
 static void mbc3_reg3(uint8_t val)
 {
-    dbg_puts("mbc3: RTC not implemented");
+    // Writing 0x00 and then 0x01 copies the clock counters into the registers
+    // that the game reads.
+    if (rtcLatchReg == 0x00 && val == 0x01)
+    {
+        rtc_update();
+        rtc_get_regs(rtcLatched);
+    }
+    rtcLatchReg = val;
 }
 
 static uint8_t mbc3_read_byte(uint16_t addr)
 {
-    // Pokemon Gold/Silver hack
-    if (addr == 0xFEB6)
-        return 0;
-        
     switch (addr >> 12)
     {
       case 4:
@@ -349,12 +663,9 @@ static uint8_t mbc3_read_byte(uint16_t addr)
       case 0xA:
       case 0xB:
         if (mbc3Mode == MBC3_MODE_RAM)
-            return mbc3CartRamBanks[mbc3RamBankNum][addr - 0xA000];
+            return (cartRam != NULL) ? cart_ram_bank(mbc3RamBankNum)[addr - 0xA000] : 0xFF;
         else
-        {
-            dbg_puts("RTC not implemented");
-            return 0;
-        }
+            return rtcLatched[mbc3RtcSelect - RTC_REG_S];
         break;
     }
     platform_fatal_error("Read byte from invalid address 0x%04X, pc = 0x%X:0x%04X", addr, mbc3RamBankNum, regs.pc);
@@ -363,10 +674,6 @@ static uint8_t mbc3_read_byte(uint16_t addr)
 
 static void mbc3_write_byte(uint16_t addr, uint8_t val)
 {
-    // Pokemon Gold/Silver hack
-    if (addr == 0xFEB6)
-        return;
-    
     switch (addr >> 12)
     {
       case 0:
@@ -388,9 +695,12 @@ static void mbc3_write_byte(uint16_t addr, uint8_t val)
       case 0xA:
       case 0xB:
         if (mbc3Mode == MBC3_MODE_RAM)
-            mbc3CartRamBanks[mbc3RamBankNum][addr - 0xA000] = val;
-        else
-            dbg_puts("RTC not implemented");
+        {
+            if (cartRam != NULL)
+                cart_ram_bank(mbc3RamBankNum)[addr - 0xA000] = val;
+        }
+        else if (mbc3RamRTCWriteEnabled)
+            rtc_write(mbc3RtcSelect, val);
         break;
       default:
         platform_fatal_error("Wrote byte 0x%02X to invalid address 0x%04X, pc = 0x%X:0x%04X", val, addr, mbc3RamBankNum, regs.pc);
@@ -398,50 +708,69 @@ static void mbc3_write_byte(uint16_t addr, uint8_t val)
     }
 }
 
-static void mbc3_load_save_file(const char *filename)
+static void mbc3_end_frame(void)
 {
-    size_t ramSize = gRomInfo.ramSizeKbyte * 1024;
-    
-    dbg_printf("mbc3: loading save file from '%s'\n", filename);
-    saveFile = fopen(filename, "rb");
-    if (saveFile == NULL)
-    {
-        // Try to create it
-        saveFile = fopen(filename, "wb");
-        if (saveFile == NULL)
-            platform_fatal_error("Failed to load save file '%s'", filename);
-        fclose(saveFile);
-        return;
-    }
-    assert(ramSize <= sizeof(mbc3CartRamBanks));
-    fread(mbc3CartRamBanks, 1, gRomInfo.ramSizeKbyte * 1024, saveFile);
-    fclose(saveFile);
+    rtc_sync_clock();
 }
 
-static void mbc3_save_save_file(const char *filename)
+static uint8_t *mbc3_save_state(uint8_t *p)
 {
-    size_t ramSize = gRomInfo.ramSizeKbyte * 1024;
-    
-    dbg_printf("mbc3: saving save file to '%s'\n", filename);
-    saveFile = fopen(filename, "wb");
-    if (saveFile == NULL)
-        platform_fatal_error("Failed to save file '%s'", filename);
-    assert(ramSize <= sizeof(mbc3CartRamBanks));
-    fwrite(mbc3CartRamBanks, 1, gRomInfo.ramSizeKbyte * 1024, saveFile);
-    fclose(saveFile);
+    STATE_SAVE(p, mbc3RomBankNum);
+    STATE_SAVE(p, mbc3RamBankNum);
+    STATE_SAVE(p, mbc3RamRTCWriteEnabled);
+    STATE_SAVE(p, mbc3Mode);
+    STATE_SAVE(p, mbc3RtcSelect);
+    STATE_SAVE(p, rtcSeconds);
+    STATE_SAVE(p, rtcHalt);
+    STATE_SAVE(p, rtcCarry);
+    STATE_SAVE(p, rtcBaseTime);
+    STATE_SAVE(p, rtcBaseCycles);
+    STATE_SAVE(p, rtcCycles);
+    STATE_SAVE(p, rtcLastCpuClock);
+    STATE_SAVE(p, rtcLatchReg);
+    STATE_SAVE(p, rtcLatched);
+    return p;
+}
+
+static const uint8_t *mbc3_load_state(const uint8_t *p)
+{
+    STATE_LOAD(p, mbc3RomBankNum);
+    STATE_LOAD(p, mbc3RamBankNum);
+    STATE_LOAD(p, mbc3RamRTCWriteEnabled);
+    STATE_LOAD(p, mbc3Mode);
+    STATE_LOAD(p, mbc3RtcSelect);
+    STATE_LOAD(p, rtcSeconds);
+    STATE_LOAD(p, rtcHalt);
+    STATE_LOAD(p, rtcCarry);
+    STATE_LOAD(p, rtcBaseTime);
+    STATE_LOAD(p, rtcBaseCycles);
+    STATE_LOAD(p, rtcCycles);
+    STATE_LOAD(p, rtcLastCpuClock);
+    STATE_LOAD(p, rtcLatchReg);
+    STATE_LOAD(p, rtcLatched);
+    return p;
 }
 
 static void mbc3_init(void)
 {
     mbcDriver.readByte = mbc3_read_byte;
     mbcDriver.writeByte = mbc3_write_byte;
-    mbcDriver.loadSaveFile = mbc3_load_save_file;
-    mbcDriver.saveSaveFile = mbc3_save_save_file;
+    mbcDriver.stateSize = sizeof(mbc3RomBankNum) + sizeof(mbc3RamBankNum)
+      + sizeof(mbc3RamRTCWriteEnabled) + sizeof(mbc3Mode) + sizeof(mbc3RtcSelect)
+      + sizeof(rtcSeconds) + sizeof(rtcHalt) + sizeof(rtcCarry) + sizeof(rtcBaseTime)
+      + sizeof(rtcBaseCycles) + sizeof(rtcCycles) + sizeof(rtcLastCpuClock)
+      + sizeof(rtcLatchReg) + sizeof(rtcLatched);
+    mbcDriver.saveState = mbc3_save_state;
+    mbcDriver.loadState = mbc3_load_state;
+    mbcDriver.updateBanks = mbc3_update_banks;
+    mbcDriver.endFrame = mbc3_end_frame;
     
     mbc3Mode = MBC3_MODE_RAM;
     mbc3RamRTCWriteEnabled = false;
     mbc3RomBankNum = 1;
     mbc3RamBankNum = 0;
+    mbc3RtcSelect = RTC_REG_S;
+    rtc_init();
 }
 
 //------------------------------------------------------------------------------
@@ -451,11 +780,13 @@ static void mbc3_init(void)
 static bool mbc5RamEnabled;
 static uint16_t mbc5RomBankNum;
 static uint8_t mbc5RamBankNum;
-static uint8_t mbc5RamBanks[16][0x2000];
 
-static void mbc5_update_bank(void)
+static void mbc5_update_banks(void)
 {
-    rom1 = gamePAK + 0x4000 * mbc5RomBankNum;
+    uint8_t *ram = cart_ram_bank(mbc5RamBankNum);
+    
+    set_rom1(mbc5RomBankNum);
+    map_pages(0xA0, 0x20, ram, mbc5RamEnabled ? ram : NULL);
 }
 
 // Write to 0x0000-0x1FFF
@@ -470,9 +801,12 @@ static void mbc5_ramg(uint8_t val)
     }
     else
     {
+        if (mbc5RamEnabled)
+            saveram_request_flush();
         mbc5RamEnabled = false;
         //puts("mbc5: disabled RAM");
     }
+    mbc5_update_banks();
 }
 
 // Write to 0x2000-0x2FFF
@@ -481,7 +815,7 @@ static void mbc5_romb0(uint8_t val)
     // Specifies the lower-order 8 bits of a 9-bit ROM bank
     mbc5RomBankNum &= 0xFF00;
     mbc5RomBankNum |= val;
-    mbc5_update_bank();
+    mbc5_update_banks();
 }
 
 // Write to 0x3000-0x3FFF
@@ -490,6 +824,7 @@ static void mbc5_romb1(uint8_t val)
     // Specifies the higher-order 1 bit of a 9-bit ROM bank
     mbc5RomBankNum &= 0x00FF;
     mbc5RomBankNum |= (val & 1) << 8;
+    mbc5_update_banks();
 }
 
 // Write to 0x4000-0x5FFF
@@ -497,6 +832,7 @@ static void mbc5_ramb(uint8_t val)
 {
     // Specifies the RAM bank
     mbc5RamBankNum = val & 0xF;
+    mbc5_update_banks();
 }
 
 static uint8_t mbc5_read_byte(uint16_t addr)
@@ -510,8 +846,9 @@ static uint8_t mbc5_read_byte(uint16_t addr)
         return rom1[addr - 0x4000];
       case 0xA:
       case 0xB:
-        return mbc5RamBanks[mbc5RamBankNum][addr - 0xA000];
-        break;
+        if (cartRam == NULL)
+            return 0xFF;  // No RAM on the cartridge
+        return cart_ram_bank(mbc5RamBankNum)[addr - 0xA000];
     }
     platform_fatal_error("Read byte from invalid address 0x%04X", addr);
     return 0;
@@ -546,9 +883,11 @@ static void mbc5_write_byte(uint16_t addr, uint8_t val)
         return;
       case 0xA:
       case 0xB:
+        if (cartRam == NULL)
+            return;  // No RAM on the cartridge
         if (mbc5RamEnabled)
         {
-            mbc5RamBanks[mbc5RamBankNum][addr - 0xA000] = val;
+            cart_ram_bank(mbc5RamBankNum)[addr - 0xA000] = val;
             return;
         }
         break;
@@ -557,37 +896,20 @@ static void mbc5_write_byte(uint16_t addr, uint8_t val)
     platform_fatal_error("Read byte from invalid address 0x%04X", addr);
 }
 
-static void mbc5_load_save_file(const char *filename)
+static uint8_t *mbc5_save_state(uint8_t *p)
 {
-    size_t ramSize = gRomInfo.ramSizeKbyte * 1024;
-    
-    dbg_printf("mbc5: loading save file from '%s'\n", filename);
-    saveFile = fopen(filename, "rb");
-    if (saveFile == NULL)
-    {
-        // Try to create it
-        saveFile = fopen(filename, "wb");
-        if (saveFile == NULL)
-            platform_fatal_error("Failed to load save file '%s'", filename);
-        fclose(saveFile);
-        return;
-    }
-    assert(ramSize <= sizeof(mbc5RamBanks));
-    fread(mbc5RamBanks, 1, gRomInfo.ramSizeKbyte * 1024, saveFile);
-    fclose(saveFile);
+    STATE_SAVE(p, mbc5RamEnabled);
+    STATE_SAVE(p, mbc5RomBankNum);
+    STATE_SAVE(p, mbc5RamBankNum);
+    return p;
 }
 
-static void mbc5_save_save_file(const char *filename)
+static const uint8_t *mbc5_load_state(const uint8_t *p)
 {
-    size_t ramSize = gRomInfo.ramSizeKbyte * 1024;
-    
-    dbg_printf("mbc5: saving save file to '%s'\n", filename);
-    saveFile = fopen(filename, "wb");
-    if (saveFile == NULL)
-        platform_fatal_error("Failed to save file '%s'", filename);
-    assert(ramSize <= sizeof(mbc5RamBanks));
-    fwrite(mbc5RamBanks, 1, gRomInfo.ramSizeKbyte * 1024, saveFile);
-    fclose(saveFile);
+    STATE_LOAD(p, mbc5RamEnabled);
+    STATE_LOAD(p, mbc5RomBankNum);
+    STATE_LOAD(p, mbc5RamBankNum);
+    return p;
 }
 
 static void mbc5_init(void)
@@ -596,8 +918,11 @@ static void mbc5_init(void)
     
     mbcDriver.readByte = mbc5_read_byte;
     mbcDriver.writeByte = mbc5_write_byte;
-    mbcDriver.loadSaveFile = mbc5_load_save_file;
-    mbcDriver.saveSaveFile = mbc5_save_save_file;
+    mbcDriver.stateSize = sizeof(mbc5RamEnabled) + sizeof(mbc5RomBankNum)
+      + sizeof(mbc5RamBankNum);
+    mbcDriver.saveState = mbc5_save_state;
+    mbcDriver.loadState = mbc5_load_state;
+    mbcDriver.updateBanks = mbc5_update_banks;
     
     mbc5RamEnabled = false;
     mbc5RomBankNum = 1;
@@ -608,8 +933,13 @@ static void mbc5_init(void)
 // General Read/Write functions
 //------------------------------------------------------------------------------
 
+// Sets up the MBC driver and cartridge RAM. On battery-backed cartridges the
+// RAM is kept in sync with gRomInfo.saveFileName while the game runs.
 void memory_initialize_mapper(void)
 {
+    size_t saveSize = gRomInfo.ramSizeKbyte * 1024;
+    
+    mbcDriver.endFrame = NULL;
     switch (gRomInfo.mapper)
     {
       case MAPPER_NONE:
@@ -627,62 +957,117 @@ void memory_initialize_mapper(void)
       default:
         assert(0);  // Should never happen
     }
+    
+    // 2KByte of RAM still gets a whole bank, so that the pages can be mapped
+    cartRamBankCount = (saveSize + 0x1FFF) / 0x2000;
+    cartRamSize = cartRamBankCount * 0x2000;
+    cartRam = NULL;
+    if (gRomInfo.cartridgeFlags & CART_FLAG_BATTERY)
+    {
+        // The clock is kept in the save file too, even without any RAM
+        if (cartRamSize != 0 || (gRomInfo.cartridgeFlags & CART_FLAG_TIMER))
+            cartRam = saveram_open(gRomInfo.saveFileName, saveSize, cartRamSize);
+    }
+    else if (cartRamSize != 0)
+        cartRam = calloc(cartRamSize, 1);
+    if (cartRam == NULL && cartRamSize != 0)
+        platform_fatal_error("Failed to allocate memory for cartridge RAM");
+    if ((gRomInfo.cartridgeFlags & (CART_FLAG_TIMER | CART_FLAG_BATTERY)) == (CART_FLAG_TIMER | CART_FLAG_BATTERY))
+        rtc_load_trailer();
 }
 
-void memory_load_save_file(const char *filename)
+void memory_close_mapper(void)
 {
-    if (mbcDriver.loadSaveFile == NULL)
-        platform_fatal_error("Save files not implemented.");
-    mbcDriver.loadSaveFile(filename);
+    if (gRomInfo.cartridgeFlags & CART_FLAG_BATTERY)
+        saveram_close();
+    else
+        free(cartRam);
+    cartRam = NULL;
 }
 
-void memory_save_save_file(const char *filename)
+void memory_end_frame(void)
 {
-    if (mbcDriver.saveSaveFile == NULL)
-        platform_fatal_error("Save files not implemented.");
-    mbcDriver.saveSaveFile(filename);
+    if (mbcDriver.endFrame != NULL)
+        mbcDriver.endFrame();
 }
 
-// TODO: get rid of this function
-void *memory_virt_to_phys(uint16_t addr)
+void memory_set_deterministic_rtc(bool deterministic)
 {
-    // ROM0
-    if (addr < ROM0_BASE + ROM0_SIZE)
-        return rom0 + addr - ROM0_BASE;
-    
-    // ROM1
-    else if (addr >= ROM1_BASE && addr < ROM1_BASE + ROM1_SIZE)
-        return rom1 + addr - ROM1_BASE;
-    
-    // VRAM
-    else if (addr >= VRAM_BASE && addr < VRAM_BASE + VRAM_SIZE)
-        return vram + addr - VRAM_BASE;
-    
-    // IWRAM
-    else if (addr >= IWRAM_BASE && addr < IWRAM_BASE + IWRAM_SIZE)
-        return iwram + addr - IWRAM_BASE;
-    
-    // IO
-    else if (addr >= IO_BASE && addr < IO_BASE + IO_SIZE)
-        return io + addr - IO_BASE;
-    
-    // OAM
-    else if (addr >= OAM_BASE && addr < OAM_BASE + OAM_SIZE)
-        return oam + addr - OAM_BASE;
-    
-    // HRAM
-    else if (addr >= HRAM_BASE && addr < HRAM_BASE + HRAM_SIZE)
-        return hram + addr - HRAM_BASE;
-    
-    // Echo RAM
-    else if (addr >= ECHO_BASE && addr < ECHO_BASE + ECHO_SIZE)
-        return iwram + addr - ECHO_BASE;
-    
-    // IE
-    else if (addr == IE_ADDR)
-        return &ie;
-    
-    return NULL;
+    if (gRomInfo.mapper == MAPPER_MBC3)
+        rtc_update();  // Count the time up to now the old way
+    rtcDeterministic = deterministic;
+    rtc_set_base();
+}
+
+// Sends tile map writes to gpu_handle_vram_write() like tile data writes, for
+// the render modes and renderers that have to see every change to VRAM
+void memory_trap_tile_map_writes(bool trap)
+{
+    tileMapWritesTrapped = trap;
+    if (gamePAK != NULL)
+        map_pages(0x98, 0x08, vram + 0x1800, trap ? NULL : vram + 0x1800);
+}
+
+size_t memory_state_size(void)
+{
+    return sizeof(vram) + sizeof(iwram)
+      + sizeof(io) + sizeof(oam) + sizeof(hram) + sizeof(ie) + sizeof(dmaActive) + sizeof(dmaSource)
+      + sizeof(dmaStartClock) + sizeof(dmaBytesDone) + cartRamSize + mbcDriver.stateSize;
+}
+
+uint8_t *memory_save_state(uint8_t *p)
+{
+    STATE_SAVE(p, vram);
+    STATE_SAVE(p, iwram);
+    STATE_SAVE(p, io);
+    STATE_SAVE(p, oam);
+    STATE_SAVE(p, hram);
+    STATE_SAVE(p, ie);
+    STATE_SAVE(p, dmaActive);
+    STATE_SAVE(p, dmaSource);
+    STATE_SAVE(p, dmaStartClock);
+    STATE_SAVE(p, dmaBytesDone);
+    if (cartRam != NULL)
+        memcpy(p, cartRam, cartRamSize);
+    p += cartRamSize;
+    if (mbcDriver.saveState != NULL)
+        p = mbcDriver.saveState(p);
+    return p;
+}
+
+const uint8_t *memory_load_state(const uint8_t *p)
+{
+    gpu_load_vram(p);
+    STATE_LOAD(p, vram);
+    STATE_LOAD(p, iwram);
+    STATE_LOAD(p, io);
+    if (memcmp(oam, p, sizeof(oam)) != 0)
+        gpu_invalidate_sprites();
+    STATE_LOAD(p, oam);
+    STATE_LOAD(p, hram);
+    STATE_LOAD(p, ie);
+    STATE_LOAD(p, dmaActive);
+    STATE_LOAD(p, dmaSource);
+    STATE_LOAD(p, dmaStartClock);
+    STATE_LOAD(p, dmaBytesDone);
+    if (cartRam != NULL)
+    {
+        // Cartridge RAM may be a shared mapping of the save file, and run-ahead
+        // loads states every frame. Only touch the bytes that differ, so that
+        // pages the game didn't write don't get dirtied in the page cache.
+        for (size_t offset = 0; offset < cartRamSize; offset += 0x100)
+        {
+            size_t size = MIN(0x100, cartRamSize - offset);
+            
+            if (memcmp(cartRam + offset, p + offset, size) != 0)
+                memcpy(cartRam + offset, p + offset, size);
+        }
+    }
+    p += cartRamSize;
+    if (mbcDriver.loadState != NULL)
+        p = mbcDriver.loadState(p);
+    mbcDriver.updateBanks();
+    return p;
 }
 
 static uint8_t io_read(uint16_t addr)
@@ -690,6 +1075,7 @@ static uint8_t io_read(uint16_t addr)
     switch (addr)
     {
       case REG_ADDR_JOYP:
+        gameboy_joypad_latch();
         if (!(REG_JOYP & 0x20))
             return (REG_JOYP | 0xCF) & ~joypadState;
         else if (!(REG_JOYP & 0x10))
@@ -699,6 +1085,9 @@ static uint8_t io_read(uint16_t addr)
       case 0xFF4D:
         return 0xFF;
       default:
+        // 0xFF10-0xFF3F: Sound registers and wave RAM
+        if (addr >= REG_ADDR_NR10 && addr <= 0xFF3F)
+            return audio_read_reg(addr);
         return io[addr - 0xFF00];
     }
 }
@@ -713,109 +1102,347 @@ static void io_write(uint16_t addr, uint8_t val)
       case REG_ADDR_TAC:
         REG_TAC = 0xF8 | val;
         break;
-      case 0xFF46:  // OAM DMA
-        {
-            // TODO: check this address
-            const void *src = memory_virt_to_phys(val << 8);
-            
-            memcpy(oam, src, 0xA0);
-        }
+      case REG_ADDR_DMA:  // OAM DMA
+        REG_DMA = val;
+        dma_start(val);
         break;
-      default:
+      case REG_ADDR_LCDC:
+      case REG_ADDR_SCY:
+      case REG_ADDR_SCX:
+      case REG_ADDR_BGP:
+      case REG_ADDR_OBP0:
+      case REG_ADDR_OBP1:
+      case REG_ADDR_WY:
+      case REG_ADDR_WX:
+        gpu_sync();  // The pixel FIFO draws what came before with the old value
         io[addr - 0xFF00] = val;
+        break;
+      default:
+        // 0xFF10-0xFF3F: Sound registers and wave RAM
+        if (addr >= REG_ADDR_NR10 && addr <= 0xFF3F)
+            audio_write_reg(addr, val);
+        else
+            io[addr - 0xFF00] = val;
     }
 }
 
-uint8_t memory_read_byte(uint16_t addr)
+// 0x8000-0x97FF: Video RAM tile data. The tile maps after it are plain memory,
+// unless memory_trap_tile_map_writes() sent them here too.
+static void vram_write(uint16_t addr, uint8_t val)
 {
-    switch (addr >> 12)
+    gpu_handle_vram_write(addr, val);  // Before, so it can see the old value
+    vram[addr - 0x8000] = val;
+}
+
+static uint8_t oam_read(uint16_t addr)
+{
+    memory_sync_dma();
+    // 0xFE00-0xFE9F: OAM, which reads as 0xFF during DMA
+    if (addr <= 0xFE9F)
+        return dmaActive ? 0xFF : oam[addr - 0xFE00];
+    // 0xFEA0-0xFEFF: unusable, reads as 0 like it does on a DMG
+    return 0;
+}
+
+static void oam_write(uint16_t addr, uint8_t val)
+{
+    memory_sync_dma();
+    // 0xFE00-0xFE9F: OAM, which ignores writes during DMA. 0xFEA0-0xFEFF is
+    // unusable and ignores them too.
+    if (addr <= 0xFE9F && !dmaActive)
     {
-      // 0x0000-0x3FFF: Cartridge ROM Bank 0
-      case 0x0:
-      case 0x1:
-      case 0x2:
-      case 0x3:
-        return rom0[addr];
-      
-      // 0x8000-9FFF: Video RAM
-      case 0x8:
-      case 0x9:
-        return vram[addr - 0x8000];
-      
-      // 0xC000-0xDFFF: Internal RAM
-      case 0xC:
-      case 0xD:
-        return iwram[addr - 0xC000];
-      
-      case 0xE:
-      case 0xF:
-        // 0xE000-0xFDFF: Echo RAM
-        if (addr <= 0xFDFF)
-            return iwram[addr - 0xE000];
-        // 0xFE00-0xFE9F: OAM
-        if (addr <= 0xFE9F)
-            return oam[addr - 0xFE00];
-        if (addr <= 0xFEFF)  // 0xFEA0-0xFEFF: unusable
-            break;
-        // 0xFF00-0xFF7F: IO Registers
-        if (addr <= 0xFF7F)
-            return io_read(addr);
-        // 0xFF80-0xFFFD: High RAM
-        if (addr <= 0xFFFE)
-            return hram[addr - 0xFF80];
-        // 0xFFFF: Interrupt Enable Flag
-        assert(addr == 0xFFFF);
+        oam[addr - 0xFE00] = val;
+        gpu_invalidate_sprites();
+    }
+}
+
+static uint8_t high_read(uint16_t addr)
+{
+    // 0xFF00-0xFF7F: IO Registers
+    if (addr <= 0xFF7F)
+        return io_read(addr);
+    // 0xFF80-0xFFFE: High RAM
+    if (addr <= 0xFFFE)
+        return hram[addr - 0xFF80];
+    // 0xFFFF: Interrupt Enable Flag
+    return ie;
+}
+
+static void high_write(uint16_t addr, uint8_t val)
+{
+    // 0xFF00-0xFF7F: IO Registers
+    if (addr <= 0xFF7F)
+        io_write(addr, val);
+    // 0xFF80-0xFFFE: High RAM
+    else if (addr <= 0xFFFE)
+        hram[addr - 0xFF80] = val;
+    // 0xFFFF: Interrupt Enable Flag
+    else
+        ie = val;
+}
+
+//------------------------------------------------------------------------------
+// Memory Watches
+//------------------------------------------------------------------------------
+
+// Writes to watched addresses are recorded along with the cycle they happened
+// at, and each watch's records are handed to its callback in one batch at the
+// end of the frame. Only pages that contain watched addresses lose their
+// direct mapping, so writes everywhere else cost the same as without watches.
+
+#define MAX_WATCHES 16
+
+struct Watch
+{
+    bool active;
+    uint16_t start;
+    uint16_t end;  // Inclusive
+    void (*callback)(const struct MemoryWatchEvent *events, unsigned int count, void *userData);
+    void *userData;
+    struct MemoryWatchEvent *events;
+    unsigned int eventCount;
+    unsigned int eventCapacity;
+};
+
+static struct Watch watches[MAX_WATCHES];
+static bool watchesMuted;
+
+static void record_watch_event(struct Watch *w, uint16_t addr, uint8_t oldVal, uint8_t newVal)
+{
+    if (w->eventCount == w->eventCapacity)
+    {
+        w->eventCapacity = MAX(w->eventCapacity * 2, 64);
+        w->events = realloc(w->events, w->eventCapacity * sizeof(*w->events));
+        if (w->events == NULL)
+            platform_fatal_error("Failed to allocate memory for watch events");
+    }
+    w->events[w->eventCount++] = (struct MemoryWatchEvent){addr, oldVal, newVal, cpuClock};
+}
+
+// Returns the byte that a write to addr replaces. Reading through a handler
+// could latch the joypad, catch up the APU or be fatal in a mapper, so pages
+// without memory mapped are read from their backing store instead.
+static uint8_t watch_old_value(uint16_t addr)
+{
+    unsigned int page = addr >> 8;
+    
+    if (watchedWritePages[page] != NULL)
+        return watchedWritePages[page][addr & 0xFF];
+    if (memReadPages[page] != NULL)
+        return memReadPages[page][addr & 0xFF];
+    if (addr >= VRAM_BASE && addr < VRAM_BASE + VRAM_SIZE)
+        return vram[addr - VRAM_BASE];
+    if (addr >= OAM_BASE && addr < OAM_BASE + OAM_SIZE)
+        return oam[addr - OAM_BASE];
+    if (addr >= IO_BASE && addr < IO_BASE + IO_SIZE)
+        return io[addr - IO_BASE];
+    if (addr >= HRAM_BASE && addr < HRAM_BASE + HRAM_SIZE)
+        return hram[addr - HRAM_BASE];
+    if (addr == IE_ADDR)
         return ie;
+    return 0;  // Mapper registers, and cartridge RAM while it's disabled
+}
+
+static void watch_write(uint16_t addr, uint8_t val)
+{
+    unsigned int page = addr >> 8;
+    uint16_t watchAddr = addr;
+    unsigned int matches = 0;
+    uint8_t oldVal = 0;
+    
+    // Echo RAM writes are reported at the address they end up at
+    if (addr >= ECHO_BASE && addr < ECHO_BASE + ECHO_SIZE)
+        watchAddr -= ECHO_BASE - IWRAM_BASE;
+    if (!watchesMuted)
+    {
+        for (unsigned int i = 0; i < MAX_WATCHES; i++)
+        {
+            if (watches[i].active && watchAddr >= watches[i].start && watchAddr <= watches[i].end)
+                matches |= 1 << i;
+        }
+        if (matches != 0)
+            oldVal = watch_old_value(addr);
     }
     
-    // Anything not in standard memory is handled by the MBC driver
-    return mbcDriver.readByte(addr);
+    if (watchedWritePages[page] != NULL)
+        watchedWritePages[page][addr & 0xFF] = val;
+    else
+        watchedWriteHandlers[page](addr, val);
+    
+    for (unsigned int i = 0; matches != 0; i++, matches >>= 1)
+    {
+        if (matches & 1)
+            record_watch_event(&watches[i], watchAddr, oldVal, val);
+    }
 }
 
-void memory_write_byte(uint16_t addr, uint8_t val)
+static void watch_page(unsigned int page)
 {
-    switch (addr >> 12)
+    watchedPages[page] = true;
+    watchedWritePages[page] = memWritePages[page];
+    watchedWriteHandlers[page] = writeHandlers[page];
+    memWritePages[page] = NULL;
+    writeHandlers[page] = watch_write;
+}
+
+static void unwatch_page(unsigned int page)
+{
+    watchedPages[page] = false;
+    memWritePages[page] = watchedWritePages[page];
+    writeHandlers[page] = watchedWriteHandlers[page];
+}
+
+// Routes exactly the pages that have watched addresses, and the echo RAM pages
+// that mirror them, through watch_write()
+static void update_watched_pages(void)
+{
+    bool needed[256] = {false};
+    
+    for (unsigned int i = 0; i < MAX_WATCHES; i++)
     {
-      // 0x8000-9FFF: Video RAM
-      case 0x8:
-      case 0x9:
-        vram[addr - 0x8000] = val;
-        gpu_handle_vram_write(addr, val);
-        return;
-      
-      // 0xC000-0xDFFF: Internal RAM
-      case 0xC:
-      case 0xD:
-        iwram[addr - 0xC000] = val;
-        return;
-      
-      case 0xE:
-      case 0xF:
-        // 0xE000-0xFDFF: Echo RAM
-        if (addr <= 0xFDFF)  // 0xE000-0xFDFF: Echo RAM - unusable
-            iwram[addr - 0xE000] = val;
-        // 0xFE00-0xFE9F: OAM
-        else if (addr <= 0xFE9F)
-            oam[addr - 0xFE00] = val;
-        else if (addr <= 0xFEFF)  // 0xFEA0-0xFEFF: unusable
-            break;
-        // 0xFF00-0xFF7F: IO Registers
-        else if (addr <= 0xFF7F)
-            io_write(addr, val);
-        // 0xFF80-0xFFFD: High RAM
-        else if (addr <= 0xFFFE)
-            hram[addr - 0xFF80] = val;
-        // 0xFFFF: Interrupt Enable Flag
-        else
-            ie = val;
+        if (!watches[i].active)
+            continue;
+        for (unsigned int page = watches[i].start >> 8; page <= (unsigned int)(watches[i].end >> 8); page++)
+        {
+            needed[page] = true;
+            if (page >= (IWRAM_BASE >> 8) && page < ((IWRAM_BASE + ECHO_SIZE) >> 8))
+                needed[page + ((ECHO_BASE - IWRAM_BASE) >> 8)] = true;
+        }
+    }
+    for (unsigned int page = 0; page < 256; page++)
+    {
+        if (needed[page] && !watchedPages[page])
+            watch_page(page);
+        else if (!needed[page] && watchedPages[page])
+            unwatch_page(page);
+    }
+}
+
+// Calls callback with the writes to start-end (inclusive) made during each
+// frame. Writes to ROM are MBC register writes, so only 0x8000-0xFFFF can be
+// watched. Echo RAM writes are reported at the IWRAM address they end up at,
+// so a range in echo RAM watches the IWRAM it mirrors, and a range that only
+// covers part of echo RAM must cover all of the IWRAM it mirrors. Returns an
+// id for memory_remove_watch(), or -1 on failure.
+int memory_add_watch(uint16_t start, uint16_t end,
+  void (*callback)(const struct MemoryWatchEvent *events, unsigned int count, void *userData), void *userData)
+{
+    if (start < VRAM_BASE || end < start || callback == NULL)
+        return -1;
+    if (start >= ECHO_BASE && end < ECHO_BASE + ECHO_SIZE)
+    {
+        start -= ECHO_BASE - IWRAM_BASE;
+        end -= ECHO_BASE - IWRAM_BASE;
+    }
+    else if (start > IWRAM_BASE && start < ECHO_BASE + ECHO_SIZE && end >= ECHO_BASE)
+        return -1;
+    for (unsigned int i = 0; i < MAX_WATCHES; i++)
+    {
+        if (!watches[i].active)
+        {
+            watches[i] = (struct Watch){true, start, end, callback, userData, watches[i].events, 0, watches[i].eventCapacity};
+            update_watched_pages();
+            return i;
+        }
+    }
+    return -1;
+}
+
+void memory_remove_watch(int id)
+{
+    if (id < 0 || id >= MAX_WATCHES || !watches[id].active)
         return;
+    watches[id].active = false;
+    watches[id].eventCount = 0;
+    update_watched_pages();
+}
+
+void memory_clear_watches(void)
+{
+    for (unsigned int i = 0; i < MAX_WATCHES; i++)
+    {
+        watches[i].active = false;
+        free(watches[i].events);
+        watches[i].events = NULL;
+        watches[i].eventCount = 0;
+        watches[i].eventCapacity = 0;
     }
+    update_watched_pages();
+}
+
+// While muted, like during run-ahead frames that are thrown away, writes to
+// watched addresses aren't recorded
+void memory_set_watches_muted(bool muted)
+{
+    watchesMuted = muted;
+}
+
+void memory_deliver_watch_events(void)
+{
+    for (unsigned int i = 0; i < MAX_WATCHES; i++)
+    {
+        struct Watch *w = &watches[i];
+        unsigned int count = w->eventCount;
+        
+        if (!w->active || count == 0)
+            continue;
+        w->eventCount = 0;
+        w->callback(w->events, count, w->userData);
+    }
+}
+
+// Sets up the page tables for a newly loaded ROM. The MBC driver must have
+// been initialized first.
+void memory_init_page_tables(void)
+{
+    memset(watchedPages, 0, sizeof(watchedPages));
+    for (unsigned int page = 0; page < 256; page++)
+    {
+        // Anything not in standard memory is handled by the MBC driver
+        readHandlers[page] = mbcDriver.readByte;
+        writeHandlers[page] = mbcDriver.writeByte;
+    }
+    for (unsigned int page = 0x80; page < 0xA0; page++)
+        writeHandlers[page] = vram_write;
+    readHandlers[0xFE] = oam_read;
+    writeHandlers[0xFE] = oam_write;
+    readHandlers[0xFF] = high_read;
+    writeHandlers[0xFF] = high_write;
+    dmaActive = false;
     
-    // Anything not in standard memory is handled by the MBC driver
-    mbcDriver.writeByte(addr, val);
+    map_pages(0x00, 0x40, rom0, NULL);
+    cheats_patch_rom_pages(0, 0x00);
+    map_pages(0x80, 0x18, vram, NULL);
+    map_pages(0x98, 0x08, vram + 0x1800, tileMapWritesTrapped ? NULL : vram + 0x1800);  // Tile maps
+    map_pages(0xA0, 0x20, NULL, NULL);
+    map_pages(0xC0, 0x20, iwram, iwram);
+    map_pages(0xE0, 0x1E, iwram, iwram);  // Echo RAM
+    map_pages(0xFE, 0x02, NULL, NULL);
+    mbcDriver.updateBanks();  // ROM bank 1 and cartridge RAM
+    update_watched_pages();
+}
+
+// Maps the ROM banks again, after the cheats that patch them changed
+void memory_update_rom_pages(void)
+{
+    map_pages(0x00, 0x40, rom0, NULL);
+    cheats_patch_rom_pages(0, 0x00);
+    mbcDriver.updateBanks();
+}
+
+uint8_t memory_read_byte_slow(uint16_t addr)
+{
+    return readHandlers[addr >> 8](addr);
+}
+
+void memory_write_byte_slow(uint16_t addr, uint8_t val)
+{
+    writeHandlers[addr >> 8](addr, val);
 }
 
-uint16_t memory_read_word(uint16_t addr)
+// Reads a word one byte at a time, for words that cross a page boundary or
+// touch a page with handlers
+uint16_t memory_read_word_slow(uint16_t addr)
 {
     uint16_t val;
     
@@ -824,7 +1451,7 @@ uint16_t memory_read_word(uint16_t addr)
     return val;
 }
 
-void memory_write_word(uint16_t addr, uint16_t val)
+void memory_write_word_slow(uint16_t addr, uint16_t val)
 {
     memory_write_byte(addr, val);   // Write low byte
     memory_write_byte(addr + 1, val >> 8);  // Write high byte
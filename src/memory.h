@@ -13,8 +13,8 @@
 #define ERAM_SIZE 0x2000
 #define IWRAM_BASE 0xC000
 #define IWRAM_SIZE 0x2000
-#define OAM_BASE 0xFE00  // This is really supposed to be from 0xFE00-0xFE9F, but
-#define OAM_SIZE 0x0100  // some games (Tetris) write to the invalid memory above it
+#define OAM_BASE 0xFE00
+#define OAM_SIZE 0x00A0  // 0xFEA0-0xFEFF is unusable
 #define HRAM_BASE 0xFF80
 #define HRAM_SIZE 0x007F
 #define IO_BASE 0xFF00
@@ -34,6 +34,23 @@
 #define REG_OFFSET_NR12 0x12
 #define REG_OFFSET_NR13 0x13
 #define REG_OFFSET_NR14 0x14
+#define REG_OFFSET_NR21 0x16
+#define REG_OFFSET_NR22 0x17
+#define REG_OFFSET_NR23 0x18
+#define REG_OFFSET_NR24 0x19
+#define REG_OFFSET_NR30 0x1A
+#define REG_OFFSET_NR31 0x1B
+#define REG_OFFSET_NR32 0x1C
+#define REG_OFFSET_NR33 0x1D
+#define REG_OFFSET_NR34 0x1E
+#define REG_OFFSET_NR41 0x20
+#define REG_OFFSET_NR42 0x21
+#define REG_OFFSET_NR43 0x22
+#define REG_OFFSET_NR44 0x23
+#define REG_OFFSET_NR50 0x24
+#define REG_OFFSET_NR51 0x25
+#define REG_OFFSET_NR52 0x26
+#define REG_OFFSET_WAVE 0x30
 
 #define REG_OFFSET_LCDC 0x40
 #define REG_OFFSET_STAT 0x41
@@ -59,14 +76,34 @@
 #define REG_ADDR_NR12 (IO_BASE + REG_OFFSET_NR12)
 #define REG_ADDR_NR13 (IO_BASE + REG_OFFSET_NR13)
 #define REG_ADDR_NR14 (IO_BASE + REG_OFFSET_NR14)
+#define REG_ADDR_NR21 (IO_BASE + REG_OFFSET_NR21)
+#define REG_ADDR_NR22 (IO_BASE + REG_OFFSET_NR22)
+#define REG_ADDR_NR23 (IO_BASE + REG_OFFSET_NR23)
+#define REG_ADDR_NR24 (IO_BASE + REG_OFFSET_NR24)
+#define REG_ADDR_NR30 (IO_BASE + REG_OFFSET_NR30)
+#define REG_ADDR_NR31 (IO_BASE + REG_OFFSET_NR31)
+#define REG_ADDR_NR32 (IO_BASE + REG_OFFSET_NR32)
+#define REG_ADDR_NR33 (IO_BASE + REG_OFFSET_NR33)
+#define REG_ADDR_NR34 (IO_BASE + REG_OFFSET_NR34)
+#define REG_ADDR_NR41 (IO_BASE + REG_OFFSET_NR41)
+#define REG_ADDR_NR42 (IO_BASE + REG_OFFSET_NR42)
+#define REG_ADDR_NR43 (IO_BASE + REG_OFFSET_NR43)
+#define REG_ADDR_NR44 (IO_BASE + REG_OFFSET_NR44)
+#define REG_ADDR_NR50 (IO_BASE + REG_OFFSET_NR50)
+#define REG_ADDR_NR51 (IO_BASE + REG_OFFSET_NR51)
+#define REG_ADDR_NR52 (IO_BASE + REG_OFFSET_NR52)
+#define REG_ADDR_WAVE (IO_BASE + REG_OFFSET_WAVE)
 
 #define REG_ADDR_LCDC (IO_BASE + REG_OFFSET_LCDC)
 #define REG_ADDR_STAT (IO_BASE + REG_OFFSET_STAT)
 #define REG_ADDR_SCY  (IO_BASE + REG_OFFSET_SCY)
 #define REG_ADDR_SCX  (IO_BASE + REG_OFFSET_SCX)
+#define REG_ADDR_DMA  (IO_BASE + REG_OFFSET_DMA)
 #define REG_ADDR_BGP  (IO_BASE + REG_OFFSET_BGP)
 #define REG_ADDR_OBP0 (IO_BASE + REG_OFFSET_OBP0)
 #define REG_ADDR_OBP1 (IO_BASE + REG_OFFSET_OBP1)
+#define REG_ADDR_WY   (IO_BASE + REG_OFFSET_WY)
+#define REG_ADDR_WX   (IO_BASE + REG_OFFSET_WX)
 
 #define REG_JOYP          io[REG_OFFSET_JOYP]
 #define REG_DIV           io[REG_OFFSET_DIV]
@@ -79,6 +116,22 @@
 #define REG_NR12          io[REG_OFFSET_NR12]
 #define REG_NR13          io[REG_OFFSET_NR13]
 #define REG_NR14          io[REG_OFFSET_NR14]
+#define REG_NR21          io[REG_OFFSET_NR21]
+#define REG_NR22          io[REG_OFFSET_NR22]
+#define REG_NR23          io[REG_OFFSET_NR23]
+#define REG_NR24          io[REG_OFFSET_NR24]
+#define REG_NR30          io[REG_OFFSET_NR30]
+#define REG_NR31          io[REG_OFFSET_NR31]
+#define REG_NR32          io[REG_OFFSET_NR32]
+#define REG_NR33          io[REG_OFFSET_NR33]
+#define REG_NR34          io[REG_OFFSET_NR34]
+#define REG_NR41          io[REG_OFFSET_NR41]
+#define REG_NR42          io[REG_OFFSET_NR42]
+#define REG_NR43          io[REG_OFFSET_NR43]
+#define REG_NR44          io[REG_OFFSET_NR44]
+#define REG_NR50          io[REG_OFFSET_NR50]
+#define REG_NR51          io[REG_OFFSET_NR51]
+#define REG_NR52          io[REG_OFFSET_NR52]
 
 #define REG_LCDC          io[REG_OFFSET_LCDC]
 #define REG_STAT          io[REG_OFFSET_STAT]
@@ -109,9 +162,10 @@ struct OamEntry
     uint8_t flags;
 } ATTRIBUTE_PACKED;
 
-#define OBJ_FLAG_PAL   (1 << 4)
-#define OBJ_FLAG_XFLIP (1 << 5)
-#define OBJ_FLAG_YFLIP (1 << 6)
+#define OBJ_FLAG_PAL       (1 << 4)
+#define OBJ_FLAG_XFLIP     (1 << 5)
+#define OBJ_FLAG_YFLIP     (1 << 6)
+#define OBJ_FLAG_BEHIND_BG (1 << 7)  // Only shows over background color 0
 
 enum
 {
@@ -124,23 +178,85 @@ enum
     MAPPER_MMM01,
 };
 
-extern uint8_t *gamePAK;
-extern uint8_t *rom0;
-extern uint8_t *rom1;
+extern const uint8_t *gamePAK;
+extern const uint8_t *rom0;
+extern const uint8_t *rom1;
 extern uint8_t vram[VRAM_SIZE];
-extern uint8_t eram[ERAM_SIZE];
 extern uint8_t iwram[IWRAM_SIZE];
 extern uint8_t io[IO_SIZE];
 extern uint8_t oam[OAM_SIZE];
 extern uint8_t hram[HRAM_SIZE];
 extern uint8_t ie;
+extern const uint8_t *memReadPages[256];
+extern uint8_t *memWritePages[256];
 
 void memory_initialize_mapper(void);
-uint8_t memory_read_byte(uint16_t addr);
-void memory_write_byte(uint16_t addr, uint8_t val);
-uint16_t memory_read_word(uint16_t addr);
-void memory_write_word(uint16_t addr, uint16_t val);
-void memory_load_save_file(const char *filename);
-void memory_save_save_file(const char *filename);
+void memory_close_mapper(void);
+void memory_init_page_tables(void);
+void memory_update_rom_pages(void);
+void memory_sync_dma(void);
+void memory_end_frame(void);
+void memory_set_deterministic_rtc(bool deterministic);
+void memory_trap_tile_map_writes(bool trap);
+int memory_add_watch(uint16_t start, uint16_t end,
+  void (*callback)(const struct MemoryWatchEvent *events, unsigned int count, void *userData), void *userData);
+void memory_remove_watch(int id);
+void memory_clear_watches(void);
+void memory_set_watches_muted(bool muted);
+void memory_deliver_watch_events(void);
+uint8_t memory_read_byte_slow(uint16_t addr);
+void memory_write_byte_slow(uint16_t addr, uint8_t val);
+uint16_t memory_read_word_slow(uint16_t addr);
+void memory_write_word_slow(uint16_t addr, uint16_t val);
+size_t memory_state_size(void);
+uint8_t *memory_save_state(uint8_t *p);
+const uint8_t *memory_load_state(const uint8_t *p);
+
+static inline uint8_t memory_read_byte(uint16_t addr)
+{
+    const uint8_t *page = memReadPages[addr >> 8];
+    
+    if (page != NULL)
+        return page[addr & 0xFF];
+    return memory_read_byte_slow(addr);
+}
+
+static inline void memory_write_byte(uint16_t addr, uint8_t val)
+{
+    uint8_t *page = memWritePages[addr >> 8];
+    
+    if (page != NULL)
+        page[addr & 0xFF] = val;
+    else
+        memory_write_byte_slow(addr, val);
+}
+
+// Words are little-endian. When both bytes are in the same plain-memory page,
+// which is nearly always the case for the stack and for instruction operands,
+// they are accessed with a single 16-bit load or store. Like struct Registers,
+// this assumes a little-endian host.
+static inline uint16_t memory_read_word(uint16_t addr)
+{
+    const uint8_t *page = memReadPages[addr >> 8];
+    
+    if (page != NULL && (addr & 0xFF) != 0xFF)
+    {
+        uint16_t val;
+        
+        memcpy(&val, page + (addr & 0xFF), sizeof(val));
+        return val;
+    }
+    return memory_read_word_slow(addr);
+}
+
+static inline void memory_write_word(uint16_t addr, uint16_t val)
+{
+    uint8_t *page = memWritePages[addr >> 8];
+    
+    if (page != NULL && (addr & 0xFF) != 0xFF)
+        memcpy(page + (addr & 0xFF), &val, sizeof(val));
+    else
+        memory_write_word_slow(addr, val);
+}
 
 #endif  // GUARD_MEMORY_H
@@ -41,8 +41,7 @@ static char currentRomName[256];
 static bool exitApp = false;
 static bool isRomLoaded = false;
 static bool isRunning = false;
-static uint8_t frameBufferPixels[GB_DISPLAY_WIDTH * GB_DISPLAY_HEIGHT];
-static uint8_t palette[][3] =
+static const uint8_t palette[4][3] =
 {
     {255, 255, 255},
     {160, 160, 160},
@@ -84,28 +83,23 @@ void platform_error(char *fmt, ...)
     va_end(args);
 }
 
-uint8_t *platform_get_framebuffer(void)
+// The emulator draws RGB straight into the pixbuf
+uint8_t *platform_get_framebuffer(size_t *pitch)
 {
-    return frameBufferPixels;
+    *pitch = gdk_pixbuf_get_rowstride(pixbuf);
+    return gdk_pixbuf_get_pixels(pixbuf);
 }
 
-static void render_framebuffer(void)
+void platform_draw_done(const struct FrameChanges *changes)
 {
-    uint8_t *rgb = gdk_pixbuf_get_pixels(pixbuf);
-    
-    // Convert from color indexed to RGB
-    for (int i = 0; i < GB_DISPLAY_WIDTH * GB_DISPLAY_HEIGHT; i++)
-    {
-        *(rgb++) = palette[frameBufferPixels[i]][0];
-        *(rgb++) = palette[frameBufferPixels[i]][1];
-        *(rgb++) = palette[frameBufferPixels[i]][2];
-    }
-    gtk_widget_queue_draw(screenImage);
+    if (changes->firstRow != changes->endRow)
+        gtk_widget_queue_draw(screenImage);
 }
 
-void platform_draw_done(void)
+static void clear_screen(void)
 {
-    render_framebuffer();
+    gdk_pixbuf_fill(pixbuf, ((guint32)palette[0][0] << 24) | (palette[0][1] << 16) | (palette[0][2] << 8) | 0xFF);
+    gtk_widget_queue_draw(screenImage);
 }
 
 //------------------------------------------------------------------------------
@@ -132,8 +126,7 @@ static void try_load_rom(const char *filename)
 static void close_game(void)
 {
     gameboy_close_rom();
-    memset(frameBufferPixels, 0, sizeof(frameBufferPixels));
-    render_framebuffer();
+    clear_screen();
     isRomLoaded = false;
     isRunning = false;
     gtk_widget_set_sensitive(fileCloseItem, FALSE);
@@ -442,6 +435,13 @@ int main(int argc, char **argv)
     
     gtk_init(&argc, &argv);
     config_load("gbemu_cfg.txt");
+    gameboy_set_run_ahead(gConfig.runAheadFrames);
+    gameboy_set_save_flush_interval(gConfig.saveFlushInterval);
+    gameboy_set_deterministic_rtc(gConfig.rtcDeterministic);
+    gameboy_set_lazy_rom_loading(gConfig.lazyRomLoading);
+    gameboy_set_render_mode(gConfig.renderMode);
+    gameboy_set_renderer(gConfig.renderer);
+    gameboy_set_screen_format(PIXEL_FORMAT_RGB24, palette);
     create_menu_bar();
     window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
     if (window == NULL)
@@ -456,6 +456,7 @@ int main(int argc, char **argv)
     pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8,
       GB_DISPLAY_WIDTH, GB_DISPLAY_HEIGHT);
     screenImage = gtk_image_new_from_pixbuf(pixbuf);
+    clear_screen();
     gtk_box_pack_start(GTK_BOX(vbox), screenImage, TRUE, TRUE, 0);
     gtk_container_add(GTK_CONTAINER(window), vbox);
     if (argc >= 2)
@@ -0,0 +1,420 @@
+#define _POSIX_C_SOURCE 199309L
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../global.h"
+#include "../audio.h"
+#include "../gameboy.h"
+#include "../gpu.h"
+#include "platform.h"
+
+// A frontend without any video, audio or input. It runs a ROM as fast as
+// possible, which makes it useful for benchmarking the emulator core.
+
+static uint8_t frameBufferPixels[GB_DISPLAY_WIDTH * GB_DISPLAY_HEIGHT];
+static uint32_t *frameHashes;
+static unsigned int frameNum;
+static FILE *wavFile;
+static uint32_t wavSamples;
+static const char *cheatCodes[64];
+static unsigned int cheatCount;
+static unsigned int drawInterval = 1;  // Draw one frame in this many
+static unsigned int renderer = RENDERER_SCANLINE;
+
+void platform_fatal_error(char *fmt, ...)
+{
+    va_list args;
+    
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    fputc('\n', stderr);
+    va_end(args);
+    exit(1);
+}
+
+uint8_t *platform_get_framebuffer(size_t *pitch)
+{
+    *pitch = GB_DISPLAY_WIDTH;
+    return frameBufferPixels;
+}
+
+void platform_draw_done(const struct FrameChanges *changes)
+{
+    if (frameHashes != NULL)
+    {
+        uint32_t hash = 2166136261u;  // FNV-1a
+        
+        // A frame that didn't change is the same as the one before
+        if (frameNum > 0 && changes->firstRow == changes->endRow)
+            hash = frameHashes[frameNum - 1];
+        else
+        {
+            for (unsigned int i = 0; i < sizeof(frameBufferPixels); i++)
+                hash = (hash ^ frameBufferPixels[i]) * 16777619u;
+        }
+        frameHashes[frameNum] = hash;
+    }
+    frameNum++;
+}
+
+static void write_le(FILE *file, uint32_t val, unsigned int size)
+{
+    for (unsigned int i = 0; i < size; i++)
+        fputc((val >> (i * 8)) & 0xFF, file);
+}
+
+static void write_wav_header(unsigned int sampleRate)
+{
+    fseek(wavFile, 0, SEEK_SET);
+    fputs("RIFF", wavFile);
+    write_le(wavFile, 36 + wavSamples * 4, 4);
+    fputs("WAVEfmt ", wavFile);
+    write_le(wavFile, 16, 4);
+    write_le(wavFile, 1, 2);  // PCM
+    write_le(wavFile, 2, 2);  // Stereo
+    write_le(wavFile, sampleRate, 4);
+    write_le(wavFile, sampleRate * 4, 4);
+    write_le(wavFile, 4, 2);
+    write_le(wavFile, 16, 2);
+    fputs("data", wavFile);
+    write_le(wavFile, wavSamples * 4, 4);
+}
+
+static void write_wav_samples(void)
+{
+    unsigned int count;
+    const int16_t *samples = audio_get_samples(&count);
+    
+    for (unsigned int i = 0; i < count * 2; i++)
+        write_le(wavFile, (uint16_t)samples[i], 2);
+    wavSamples += count;
+}
+
+static double get_time_ms(void)
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+// Runs the ROM from power-on for numFrames frames, pressing keys from frame
+// pressFrame onwards. Returns the average time per frame in milliseconds.
+static double run_rom(const char *romFile, unsigned int runAhead, unsigned int numFrames,
+  unsigned int pressFrame, unsigned int keys, uint32_t *hashes)
+{
+    double startTime;
+    double time;
+    
+    if (!gameboy_load_rom(romFile))
+        platform_fatal_error("Failed to load ROM '%s'", romFile);
+    for (unsigned int i = 0; i < cheatCount; i++)
+    {
+        if (!gameboy_add_cheat(cheatCodes[i]))
+            platform_fatal_error("Invalid cheat code '%s'", cheatCodes[i]);
+    }
+    gameboy_set_run_ahead(runAhead);
+    frameHashes = hashes;
+    frameNum = 0;
+    startTime = get_time_ms();
+    for (unsigned int i = 0; i < numFrames; i++)
+    {
+        if (i == pressFrame)
+            gameboy_joypad_press(keys);
+        // Frame hashes need every frame drawn
+        if (hashes == NULL && (i + 1) % drawInterval != 0)
+            gameboy_skip_frame();
+        else
+            gameboy_run_frame();
+        if (wavFile != NULL)
+            write_wav_samples();
+    }
+    time = get_time_ms() - startTime;
+    gameboy_close_rom();
+    frameHashes = NULL;
+    return time / numFrames;
+}
+
+// Runs the ROM once with every run-ahead setting up to maxRunAhead, reporting
+// the CPU cost per frame and the input latency. Latency is measured as the
+// number of frames between pressing a button and the first presented frame
+// that differs from a run where the button was never pressed.
+static void benchmark(const char *romFile, unsigned int maxRunAhead, unsigned int numFrames,
+  unsigned int pressFrame, unsigned int keys)
+{
+    uint32_t *refHashes = malloc(numFrames * sizeof(*refHashes));
+    uint32_t *hashes = malloc(numFrames * sizeof(*hashes));
+    
+    if (refHashes == NULL || hashes == NULL)
+        platform_fatal_error("Out of memory");
+    puts("run-ahead  ms/frame  speed     latency");
+    for (unsigned int runAhead = 0; runAhead <= maxRunAhead; runAhead++)
+    {
+        double msPerFrame = run_rom(romFile, runAhead, numFrames, numFrames, 0, refHashes);
+        unsigned int i;
+        
+        run_rom(romFile, runAhead, numFrames, pressFrame, keys, hashes);
+        for (i = pressFrame; i < numFrames; i++)
+        {
+            if (hashes[i] != refHashes[i])
+                break;
+        }
+        printf("%-9u  %-8.3f  %-8.1fx", runAhead, msPerFrame, (1000.0 / 59.7275) / msPerFrame);
+        if (i < numFrames)
+            printf(" %u frames\n", i - pressFrame);
+        else
+            puts(" no change");
+    }
+    free(refHashes);
+    free(hashes);
+}
+
+// Compares running the ROM with and without generating sound. The APU itself
+// is emulated either way, so this only measures the cost of synthesis.
+static void benchmark_audio(const char *romFile, unsigned int numFrames, unsigned int sampleRate)
+{
+    double silentTime;
+    double soundTime;
+    
+    audio_set_sample_rate(0);
+    silentTime = run_rom(romFile, 0, numFrames, numFrames, 0, NULL);
+    audio_set_sample_rate(sampleRate);
+    soundTime = run_rom(romFile, 0, numFrames, numFrames, 0, NULL);
+    printf("sound at %u Hz: %.3f ms/frame, without: %.3f ms/frame (%.2f%% of the frame budget)\n",
+      sampleRate, soundTime, silentTime, (soundTime - silentTime) * 59.7275 / 10);
+}
+
+// Times rendering the screen as the ROM left it after numFrames frames with
+// each line compositor this CPU supports, checking that they all agree
+static void benchmark_render(const char *romFile, unsigned int numFrames)
+{
+    static uint8_t refPixels[GB_DISPLAY_WIDTH * GB_DISPLAY_HEIGHT];
+    static uint8_t pixels[GB_DISPLAY_WIDTH * GB_DISPLAY_HEIGHT];
+    const unsigned int repeats = 2000;
+    unsigned int defaultCompositor;
+    
+    if (!gameboy_load_rom(romFile))
+        platform_fatal_error("Failed to load ROM '%s'", romFile);
+    for (unsigned int i = 0; i < numFrames; i++)
+        gameboy_run_frame();
+    defaultCompositor = gpu_get_compositor();
+    gpu_set_compositor(COMPOSITOR_SCALAR);
+    gpu_render_lines(refPixels, GB_DISPLAY_WIDTH);
+    for (unsigned int which = 0; which < COMPOSITOR_COUNT; which++)
+    {
+        double startTime;
+        double time;
+        
+        if (!gpu_set_compositor(which))
+            continue;
+        startTime = get_time_ms();
+        for (unsigned int i = 0; i < repeats; i++)
+            gpu_render_lines(pixels, GB_DISPLAY_WIDTH);
+        time = get_time_ms() - startTime;
+        printf("%s compositor: %.1f ns/scanline%s%s\n", gpu_get_compositor_name(which),
+          time * 1000000.0 / (repeats * GB_DISPLAY_HEIGHT), (which == defaultCompositor) ? " (default)" : "",
+          memcmp(pixels, refPixels, sizeof(pixels)) != 0 ? " MISMATCH" : "");
+    }
+    gpu_set_compositor(defaultCompositor);
+    gameboy_close_rom();
+}
+
+// Counts how many tile rows are decoded and layer rows drawn per frame with
+// and without run-ahead. Run-ahead loads a state every frame, and that should
+// leave the caches of what didn't change in place.
+static void benchmark_tile_cache(const char *romFile, unsigned int numFrames)
+{
+    for (unsigned int runAhead = 0; runAhead <= 2; runAhead += 2)
+    {
+        unsigned long tileRowsBefore, layerRowsBefore;
+        unsigned long tileRows, layerRows;
+        
+        gpu_get_cache_stats(&tileRowsBefore, &layerRowsBefore);
+        run_rom(romFile, runAhead, numFrames, numFrames, 0, NULL);
+        gpu_get_cache_stats(&tileRows, &layerRows);
+        printf("run-ahead %u: %.1f tile rows decoded, %.1f layer rows drawn per frame\n", runAhead,
+          (double)(tileRows - tileRowsBefore) / numFrames, (double)(layerRows - layerRowsBefore) / numFrames);
+    }
+}
+
+// Compares the cost of running the ROM with each renderer. The pixel FIFO
+// times mode 3 differently, so frames aren't expected to match exactly; how
+// many differ gives an idea of how much the game depends on it.
+static void benchmark_renderers(const char *romFile, unsigned int numFrames)
+{
+    uint32_t *refHashes = malloc(numFrames * sizeof(*refHashes));
+    uint32_t *hashes = malloc(numFrames * sizeof(*hashes));
+    double scanlineTime;
+    double fifoTime;
+    unsigned int diffCount = 0;
+    
+    if (refHashes == NULL || hashes == NULL)
+        platform_fatal_error("Out of memory");
+    gameboy_set_renderer(RENDERER_SCANLINE);
+    scanlineTime = run_rom(romFile, 0, numFrames, numFrames, 0, refHashes);
+    gameboy_set_renderer(RENDERER_PIXEL_FIFO);
+    fifoTime = run_rom(romFile, 0, numFrames, numFrames, 0, hashes);
+    gameboy_set_renderer(renderer);
+    for (unsigned int i = 0; i < numFrames; i++)
+    {
+        if (hashes[i] != refHashes[i])
+            diffCount++;
+    }
+    printf("scanline renderer: %.3f ms/frame, pixel FIFO: %.3f ms/frame (%.1fx), %u of %u frames differ%s\n",
+      scanlineTime, fifoTime, fifoTime / scanlineTime, diffCount, numFrames,
+      (gRomInfo.quirks & QUIRK_PIXEL_FIFO) ? " (the ROM always uses the pixel FIFO)" : "");
+    free(refHashes);
+    free(hashes);
+}
+
+static unsigned int parse_key(const char *name)
+{
+    static const struct {const char *name; unsigned int key;} keyNames[] =
+    {
+        {"a",      KEY_A_BUTTON},
+        {"b",      KEY_B_BUTTON},
+        {"select", KEY_SELECT_BUTTON},
+        {"start",  KEY_START_BUTTON},
+        {"right",  KEY_DPAD_RIGHT},
+        {"left",   KEY_DPAD_LEFT},
+        {"up",     KEY_DPAD_UP},
+        {"down",   KEY_DPAD_DOWN},
+    };
+    
+    for (unsigned int i = 0; i < ARRAY_COUNT(keyNames); i++)
+    {
+        if (strcmp(name, keyNames[i].name) == 0)
+            return keyNames[i].key;
+    }
+    platform_fatal_error("Unknown key '%s'", name);
+    return 0;
+}
+
+static unsigned int parse_render_mode(const char *name)
+{
+    static const char *const modeNames[] =
+    {
+        [RENDER_MODE_INLINE]   = "inline",
+        [RENDER_MODE_DEFERRED] = "deferred",
+        [RENDER_MODE_THREAD]   = "thread",
+    };
+    
+    for (unsigned int i = 0; i < ARRAY_COUNT(modeNames); i++)
+    {
+        if (strcmp(name, modeNames[i]) == 0)
+            return i;
+    }
+    platform_fatal_error("Unknown render mode '%s'", name);
+    return 0;
+}
+
+static unsigned int parse_renderer(const char *name)
+{
+    static const char *const rendererNames[] =
+    {
+        [RENDERER_SCANLINE]   = "scanline",
+        [RENDERER_PIXEL_FIFO] = "fifo",
+    };
+    
+    for (unsigned int i = 0; i < ARRAY_COUNT(rendererNames); i++)
+    {
+        if (strcmp(name, rendererNames[i]) == 0)
+            return i;
+    }
+    platform_fatal_error("Unknown renderer '%s'", name);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *romFile = NULL;
+    unsigned int numFrames = 3600;
+    unsigned int runAhead = 0;
+    unsigned int pressFrame = 600;
+    unsigned int keys = KEY_START_BUTTON;
+    unsigned int sampleRate = 44100;
+    const char *wavFileName = NULL;
+    bool bench = false;
+    double msPerFrame;
+    
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-frames") == 0 && i + 1 < argc)
+            numFrames = strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-runahead") == 0 && i + 1 < argc)
+            runAhead = strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-press") == 0 && i + 1 < argc)
+            pressFrame = strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-key") == 0 && i + 1 < argc)
+            keys = parse_key(argv[++i]);
+        else if (strcmp(argv[i], "-rate") == 0 && i + 1 < argc)
+            sampleRate = strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-wav") == 0 && i + 1 < argc)
+            wavFileName = argv[++i];
+        else if (strcmp(argv[i], "-bench") == 0)
+            bench = true;
+        else if (strcmp(argv[i], "-drawevery") == 0 && i + 1 < argc)
+            drawInterval = MAX(strtoul(argv[++i], NULL, 0), 1);
+        else if (strcmp(argv[i], "-lazyrom") == 0)
+            gameboy_set_lazy_rom_loading(true);
+        else if (strcmp(argv[i], "-render") == 0 && i + 1 < argc)
+        {
+            if (!gameboy_set_render_mode(parse_render_mode(argv[++i])))
+                platform_fatal_error("Render mode '%s' isn't available", argv[i]);
+        }
+        else if (strcmp(argv[i], "-renderer") == 0 && i + 1 < argc)
+        {
+            renderer = parse_renderer(argv[++i]);
+            gameboy_set_renderer(renderer);
+        }
+        else if (strcmp(argv[i], "-cheat") == 0 && i + 1 < argc && cheatCount < ARRAY_COUNT(cheatCodes))
+            cheatCodes[cheatCount++] = argv[++i];
+        else
+            romFile = argv[i];
+    }
+    if (romFile == NULL)
+    {
+        printf("usage: %s [-frames n] [-runahead n] [-rate hz] [-wav file] [-bench] [-drawevery n] [-lazyrom] [-render inline|deferred|thread] [-renderer scanline|fifo] [-cheat code] [-press frame] [-key name] rom\n", argv[0]);
+        return 1;
+    }
+    if (numFrames == 0)
+        platform_fatal_error("Number of frames must be non-zero");
+    
+    audio_set_sample_rate(sampleRate);
+    gameboy_set_deterministic_rtc(true);  // Keep runs reproducible
+    if (bench)
+    {
+        if (pressFrame >= numFrames)
+            platform_fatal_error("Press frame must be less than the number of frames");
+        benchmark(romFile, MAX(runAhead, 2), numFrames, pressFrame, keys);
+        benchmark_render(romFile, numFrames);
+        benchmark_tile_cache(romFile, numFrames);
+        benchmark_renderers(romFile, numFrames);
+        if (sampleRate != 0)
+            benchmark_audio(romFile, numFrames, sampleRate);
+    }
+    else
+    {
+        if (wavFileName != NULL)
+        {
+            wavFile = fopen(wavFileName, "wb");
+            if (wavFile == NULL)
+                platform_fatal_error("Failed to open '%s' for writing", wavFileName);
+            write_wav_header(sampleRate);
+        }
+        msPerFrame = run_rom(romFile, runAhead, numFrames, numFrames, 0, NULL);
+        printf("%u frames, %.3f ms/frame (%.1fx speed)\n",
+          numFrames, msPerFrame, (1000.0 / 59.7275) / msPerFrame);
+        if (wavFile != NULL)
+        {
+            write_wav_header(sampleRate);
+            fclose(wavFile);
+        }
+    }
+    return 0;
+}
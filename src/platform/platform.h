@@ -1,8 +1,10 @@
 #ifndef GUARD_PLATFORM_H
 #define GUARD_PLATFORM_H
 
+struct FrameChanges;
+
 void platform_fatal_error(char *fmt, ...);
-uint8_t *platform_get_framebuffer(void);
-void platform_draw_done(void);
+uint8_t *platform_get_framebuffer(size_t *pitch);
+void platform_draw_done(const struct FrameChanges *changes);
 
 #endif  // GUARD_PLATFORM_H
@@ -32,19 +32,26 @@ void platform_fatal_error(char *fmt, ...)
 
 static SDL_Surface *frameBufferSurface;
 
-uint8_t *platform_get_framebuffer(void)
+uint8_t *platform_get_framebuffer(size_t *pitch)
 {
     if (SDL_MUSTLOCK(frameBufferSurface))
         SDL_LockSurface(frameBufferSurface);
+    *pitch = frameBufferSurface->pitch;
     return frameBufferSurface->pixels;
 }
 
-void platform_draw_done(void)
+// Only copies the rows that changed to the window
+void platform_draw_done(const struct FrameChanges *changes)
 {
+    SDL_Rect srcRect = {0, changes->firstRow, GB_DISPLAY_WIDTH, changes->endRow - changes->firstRow};
+    SDL_Rect dstRect = srcRect;
+    
     if (SDL_MUSTLOCK(frameBufferSurface))
         SDL_UnlockSurface(frameBufferSurface);
-    SDL_BlitSurface(frameBufferSurface, NULL, winSurface, NULL);
-    SDL_UpdateRect(winSurface, 0, 0, 0, 0);
+    if (srcRect.h == 0)
+        return;
+    SDL_BlitSurface(frameBufferSurface, &srcRect, winSurface, &dstRect);
+    SDL_UpdateRect(winSurface, srcRect.x, srcRect.y, srcRect.w, srcRect.h);
 }
 
 int main(int argc, char **argv)
@@ -137,6 +144,9 @@ int main(int argc, char **argv)
                 break;
             }
             break;
+          case SDL_VIDEOEXPOSE:
+            SDL_UpdateRect(winSurface, 0, 0, 0, 0);
+            break;
           case SDL_QUIT:
             goto done;
         }
@@ -1,22 +1,38 @@
 #include <assert.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <SDL2/SDL.h>
 
 #include "../global.h"
+#include "../audio.h"
+#include "../config.h"
 #include "../gameboy.h"
+#include "../memory.h"
+#include "../ringbuf.h"
 #include "platform.h"
 
 #define max(a, b) ((a) > (b) ? (a) : (b))
 
 static SDL_Window *window = NULL;
 static SDL_Palette *palette;
+static const uint8_t screenColors[4][3] =
+{
+    {255, 255, 255},
+    {160, 160, 160},
+    {80,  80,  80},
+    {0,   0,   0},
+};
 static SDL_Surface *winSurface;
 static SDL_Surface *frameBufferSurface;
-static unsigned long int ticks = 0;
+static Uint64 inputLatchTime = 0;
+static Uint64 totalInputLatency = 0;
+static unsigned long int inputLatencySamples = 0;
+static SDL_AudioDeviceID audioDevice = 0;
 
 void platform_fatal_error(char *fmt, ...)
 {
@@ -45,19 +61,38 @@ static SDL_Surface *bgTilePatternSurface = NULL;
 static int bgTilePattern;
 static int bgTileMap;
 
-uint8_t *platform_get_framebuffer(void)
+uint8_t *platform_get_framebuffer(size_t *pitch)
 {
     SDL_LockSurface(frameBufferSurface);
+    *pitch = frameBufferSurface->pitch;
     return frameBufferSurface->pixels;
 }
 
-void platform_draw_done(void)
+// Copies rows first to end - 1 of the frame to the window
+static void present_rows(unsigned int first, unsigned int end)
 {
-    SDL_Rect dstRect = {0, 0, GB_DISPLAY_WIDTH, GB_DISPLAY_HEIGHT};
+    SDL_Rect srcRect = {0, first, GB_DISPLAY_WIDTH, end - first};
+    SDL_Rect dstRect = srcRect;
     
+    if (first == end)
+        return;
+    SDL_BlitSurface(frameBufferSurface, &srcRect, winSurface, &dstRect);
+    SDL_UpdateWindowSurfaceRects(window, &srcRect, 1);
+}
+
+void platform_draw_done(const struct FrameChanges *changes)
+{
     SDL_UnlockSurface(frameBufferSurface);
-    SDL_BlitSurface(frameBufferSurface, NULL, winSurface, &dstRect);
-    SDL_UpdateWindowSurface(window);
+    present_rows(changes->firstRow, changes->endRow);
+    
+    // Measure how old the input the game saw this frame is by the time it
+    // gets to the screen
+    if (inputLatchTime != 0)
+    {
+        totalInputLatency += SDL_GetPerformanceCounter() - inputLatchTime;
+        inputLatencySamples++;
+        inputLatchTime = 0;
+    }
 }
 
 static void render(void)
@@ -220,126 +255,268 @@ static void render_debug2(void)
     SDL_UpdateWindowSurface(window);
 }
 
+//------------------------------------------------------------------------------
+// Input
+//------------------------------------------------------------------------------
+
+// Called by the emulator when the game reads the joypad register, so that the
+// game sees the freshest possible button state rather than what the keyboard
+// looked like before the frame started.
+static unsigned int read_joypad(void)
+{
+    const Uint8 *keys;
+    unsigned int state = 0;
+    
+    SDL_PumpEvents();
+    keys = SDL_GetKeyboardState(NULL);
+    if (keys[SDL_SCANCODE_UP])
+        state |= KEY_DPAD_UP;
+    if (keys[SDL_SCANCODE_DOWN])
+        state |= KEY_DPAD_DOWN;
+    if (keys[SDL_SCANCODE_LEFT])
+        state |= KEY_DPAD_LEFT;
+    if (keys[SDL_SCANCODE_RIGHT])
+        state |= KEY_DPAD_RIGHT;
+    if (keys[SDL_SCANCODE_C])
+        state |= KEY_A_BUTTON;
+    if (keys[SDL_SCANCODE_X])
+        state |= KEY_B_BUTTON;
+    if (keys[SDL_SCANCODE_RETURN])
+        state |= KEY_START_BUTTON;
+    if (keys[SDL_SCANCODE_BACKSPACE])
+        state |= KEY_SELECT_BUTTON;
+    inputLatchTime = SDL_GetPerformanceCounter();
+    return state;
+}
+
+//------------------------------------------------------------------------------
+// Audio
+//------------------------------------------------------------------------------
+
+#define AUDIO_SAMPLE_RATE 44100
+#define AUDIO_RING_FRAMES 4096      // About 93 ms. We try to keep it half full.
+#define AUDIO_MAX_RATE_DELTA 0.005  // Largest pitch change for each correction term
+#define AUDIO_RATE_TRIM_GAIN 0.00005
+
+// The emulation thread writes each frame's samples into the ring buffer, and
+// SDL's audio thread drains it from the callback.
+static struct RingBuffer audioRing;
+static bool audioStarted = false;
+static atomic_ulong audioUnderruns;
+static unsigned long int audioOverruns = 0;
+static double audioRateTrim = 0.0;
+
+static void audio_callback(void *userdata, Uint8 *stream, int len)
+{
+    size_t got = ringbuf_read(&audioRing, stream, len);
+    
+    UNUSED(userdata);
+    if (got < (size_t)len)
+    {
+        memset(stream + got, 0, len - got);
+        atomic_fetch_add(&audioUnderruns, 1);
+    }
+}
+
+static void init_audio(void)
+{
+    SDL_AudioSpec want = {0};
+    SDL_AudioSpec have;
+    
+    want.freq = AUDIO_SAMPLE_RATE;
+    want.format = AUDIO_S16SYS;
+    want.channels = 2;
+    want.samples = 512;
+    want.callback = audio_callback;
+    audioDevice = SDL_OpenAudioDevice(NULL, 0, &want, &have, 0);
+    if (audioDevice == 0)
+    {
+        fprintf(stderr, "Failed to open audio device: %s\n", SDL_GetError());
+        return;
+    }
+    if (!ringbuf_init(&audioRing, AUDIO_RING_FRAMES * 2 * sizeof(int16_t)))
+        platform_fatal_error("Failed to allocate audio buffer");
+    atomic_init(&audioUnderruns, 0);
+    audio_set_sample_rate(have.freq);
+}
+
+static void queue_audio(void)
+{
+    const int16_t *samples;
+    unsigned int count;
+    size_t bytes;
+    double error;
+    
+    if (audioDevice == 0)
+        return;
+    samples = audio_get_samples(&count);
+    bytes = count * 2 * sizeof(*samples);
+    if (ringbuf_write(&audioRing, samples, bytes) < bytes)
+        audioOverruns++;
+    
+    error = 0.5 - (double)ringbuf_used(&audioRing) / audioRing.size;
+    
+    // Don't start playing until the buffer is half full
+    if (!audioStarted)
+    {
+        if (error <= 0.0)
+        {
+            SDL_PauseAudioDevice(audioDevice, 0);
+            audioStarted = true;
+        }
+        return;
+    }
+    
+    // Dynamic rate control: nudge the sample rate up when the buffer is less
+    // than half full and down when it's more. That alone would settle off
+    // center if the sound card's clock is far from ours, so a slowly
+    // accumulating trim takes over the steady part of the correction.
+    audioRateTrim += error * AUDIO_RATE_TRIM_GAIN;
+    audioRateTrim = MAX(audioRateTrim, -AUDIO_MAX_RATE_DELTA);
+    audioRateTrim = MIN(audioRateTrim, AUDIO_MAX_RATE_DELTA);
+    audio_adjust_sample_rate(1.0 + AUDIO_MAX_RATE_DELTA * 2.0 * error + audioRateTrim);
+}
+
+//------------------------------------------------------------------------------
+// Timing
+//------------------------------------------------------------------------------
+
+static void wait_until(Uint64 time)
+{
+    Uint64 freq = SDL_GetPerformanceFrequency();
+    Uint64 now = SDL_GetPerformanceCounter();
+    
+    // Sleep for most of the time, then spin for the last millisecond since
+    // SDL_Delay isn't precise enough.
+    if (now + freq / 500 < time)
+        SDL_Delay((time - now) * 1000 / freq - 1);
+    while (SDL_GetPerformanceCounter() < time)
+        ;
+}
+
 //------------------------------------------------------------------------------
 // Main
 //------------------------------------------------------------------------------
 
 int main(int argc, char **argv)
 {
+    Uint64 freq;
+    Uint64 frameTicks;
+    Uint64 emuTicks;
+    Uint64 deadline;
+    
     if (argc < 2)
         platform_fatal_error("No ROM file specified.");
-    if (SDL_Init(SDL_INIT_VIDEO) != 0)
+    config_load(CONFIG_FILE_NAME);
+    if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO) != 0)
         platform_fatal_error("Failed to initialize SDL: %s", SDL_GetError());
     window = SDL_CreateWindow(APPNAME,
       SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, GB_DISPLAY_WIDTH, GB_DISPLAY_HEIGHT, SDL_WINDOW_RESIZABLE);
     if (window == NULL)
         platform_fatal_error("Failed to create window: %s", SDL_GetError());
     winSurface = SDL_GetWindowSurface(window);
-    palette = SDL_AllocPalette(256);
-    if (palette == NULL)
-        platform_fatal_error("Failed to create palette: %s", SDL_GetError());
-    palette->colors[0] = (SDL_Color){255, 255, 255, 255};
-    palette->colors[1] = (SDL_Color){160, 160, 160, 255};
-    palette->colors[2] = (SDL_Color){80,  80,  80,  255};
-    palette->colors[3] = (SDL_Color){0,   0,   0,   255};
-    frameBufferSurface = SDL_CreateRGBSurface(0, GB_DISPLAY_WIDTH, GB_DISPLAY_HEIGHT,
-      8, 0, 0, 0, 0);
+    
+    // The emulator draws in the window's format if it can, which makes
+    // blitting the frame a plain copy. Otherwise it draws shades, and SDL
+    // converts them.
+    if (winSurface->format->format == SDL_PIXELFORMAT_RGB888)
+    {
+        frameBufferSurface = SDL_CreateRGBSurfaceWithFormat(0, GB_DISPLAY_WIDTH, GB_DISPLAY_HEIGHT,
+          32, SDL_PIXELFORMAT_RGB888);
+        gameboy_set_screen_format(PIXEL_FORMAT_XRGB8888, screenColors);
+    }
+    else if (winSurface->format->format == SDL_PIXELFORMAT_RGB565)
+    {
+        frameBufferSurface = SDL_CreateRGBSurfaceWithFormat(0, GB_DISPLAY_WIDTH, GB_DISPLAY_HEIGHT,
+          16, SDL_PIXELFORMAT_RGB565);
+        gameboy_set_screen_format(PIXEL_FORMAT_RGB565, screenColors);
+    }
+    else
+    {
+        palette = SDL_AllocPalette(256);
+        if (palette == NULL)
+            platform_fatal_error("Failed to create palette: %s", SDL_GetError());
+        for (unsigned int i = 0; i < 4; i++)
+            palette->colors[i] = (SDL_Color){screenColors[i][0], screenColors[i][1], screenColors[i][2], 255};
+        frameBufferSurface = SDL_CreateRGBSurface(0, GB_DISPLAY_WIDTH, GB_DISPLAY_HEIGHT,
+          8, 0, 0, 0, 0);
+        if (frameBufferSurface != NULL && SDL_SetSurfacePalette(frameBufferSurface, palette) != 0)
+            platform_fatal_error("Failed to set palette: %s", SDL_GetError());
+    }
     if (frameBufferSurface == NULL)
         platform_fatal_error("Failed to create surface: %s", SDL_GetError());
-    if (SDL_SetSurfacePalette(frameBufferSurface, palette) != 0)
-        platform_fatal_error("Failed to set palette: %s", SDL_GetError());
+    gameboy_set_deterministic_rtc(gConfig.rtcDeterministic);
+    gameboy_set_lazy_rom_loading(gConfig.lazyRomLoading);
+    gameboy_set_render_mode(gConfig.renderMode);
+    gameboy_set_renderer(gConfig.renderer);
     if (!gameboy_load_rom(argv[1]))
         platform_fatal_error("Failed to load ROM '%s'", argv[1]);
+    gameboy_set_joypad_callback(read_joypad);
+    gameboy_set_run_ahead(gConfig.runAheadFrames);
+    gameboy_set_save_flush_interval(gConfig.saveFlushInterval);
+    init_audio();
     
+    freq = SDL_GetPerformanceFrequency();
+    frameTicks = freq * 70224 / 4194304;  // One Game Boy frame (about 59.7 Hz)
+    emuTicks = freq / 1000;
+    deadline = SDL_GetPerformanceCounter() + frameTicks;
     while (1)
     {
         SDL_Event event;
+        Uint64 start;
+        Uint64 now;
         
-        SDL_PollEvent(&event);
-        switch (event.type)
+        while (SDL_PollEvent(&event))
         {
-            case SDL_KEYDOWN:
-                switch (event.key.keysym.sym)
-                {
-                    case SDLK_UP:
-                        gameboy_joypad_press(KEY_DPAD_UP);
-                        break;
-                    case SDLK_DOWN:
-                        gameboy_joypad_press(KEY_DPAD_DOWN);
-                        break;
-                    case SDLK_LEFT:
-                        gameboy_joypad_press(KEY_DPAD_LEFT);
-                        break;
-                    case SDLK_RIGHT:
-                        gameboy_joypad_press(KEY_DPAD_RIGHT);
-                        break;
-                    case SDLK_c:
-                        gameboy_joypad_press(KEY_A_BUTTON);
-                        break;
-                    case SDLK_x:
-                        gameboy_joypad_press(KEY_B_BUTTON);
-                        break;
-                    case SDLK_RETURN:
-                        gameboy_joypad_press(KEY_START_BUTTON);
-                        break;
-                    case SDLK_BACKSPACE:
-                        gameboy_joypad_press(KEY_SELECT_BUTTON);
-                        break;
-                }
-                break;
-            case SDL_KEYUP:
-                switch (event.key.keysym.sym)
-                {
-                    case SDLK_UP:
-                        gameboy_joypad_release(KEY_DPAD_UP);
-                        break;
-                    case SDLK_DOWN:
-                        gameboy_joypad_release(KEY_DPAD_DOWN);
-                        break;
-                    case SDLK_LEFT:
-                        gameboy_joypad_release(KEY_DPAD_LEFT);
-                        break;
-                    case SDLK_RIGHT:
-                        gameboy_joypad_release(KEY_DPAD_RIGHT);
-                        break;
-                    case SDLK_c:
-                        gameboy_joypad_release(KEY_A_BUTTON);
-                        break;
-                    case SDLK_x:
-                        gameboy_joypad_release(KEY_B_BUTTON);
-                        break;
-                    case SDLK_RETURN:
-                        gameboy_joypad_release(KEY_START_BUTTON);
-                        break;
-                    case SDLK_BACKSPACE:
-                        gameboy_joypad_release(KEY_SELECT_BUTTON);
-                        break;
-                }
-                break;
-            case SDL_WINDOWEVENT:
-                switch (event.window.event)
-                {
-                    case SDL_WINDOWEVENT_RESIZED:
-                        winSurface = SDL_GetWindowSurface(window);
-                        break;
-                    case SDL_WINDOWEVENT_CLOSE:
-                        goto done;
-                }
-                break;
+            switch (event.type)
+            {
+                case SDL_WINDOWEVENT:
+                    switch (event.window.event)
+                    {
+                        case SDL_WINDOWEVENT_RESIZED:
+                            winSurface = SDL_GetWindowSurface(window);
+                            present_rows(0, GB_DISPLAY_HEIGHT);
+                            break;
+                        case SDL_WINDOWEVENT_EXPOSED:
+                            SDL_UpdateWindowSurface(window);
+                            break;
+                        case SDL_WINDOWEVENT_CLOSE:
+                            goto done;
+                    }
+                    break;
+                case SDL_QUIT:
+                    goto done;
+            }
         }
+        
+        // Start emulating the frame as late as possible, so that the input the
+        // game latches is sampled just before the frame gets presented.
+        wait_until(deadline - emuTicks);
+        start = SDL_GetPerformanceCounter();
         gameboy_run_frame();
-        unsigned long int newTicks = SDL_GetTicks();
-        if (newTicks < ticks + 1000 / 60)
-        {
-            printf("sleeping for %u\n", ticks + 1000 / 60 - newTicks);
-            SDL_Delay(ticks + 1000 / 60 - newTicks);
-        }
-        ticks = SDL_GetTicks();
-        //SDL_Delay(10);
-        //render();
+        queue_audio();
+        now = SDL_GetPerformanceCounter();
+        
+        // Keep a conservative estimate of how long a frame takes to emulate. It
+        // grows immediately after a slow frame and only shrinks gradually.
+        emuTicks -= emuTicks / 16;
+        emuTicks = max(emuTicks, now - start + freq / 1000);
+        
+        deadline += frameTicks;
+        if (deadline < now)  // We fell behind. Don't try to catch up.
+            deadline = now + frameTicks;
     }
   done:
+    if (audioDevice != 0)
+    {
+        SDL_CloseAudioDevice(audioDevice);
+        ringbuf_destroy(&audioRing);
+        printf("audio underruns: %lu, overruns: %lu\n", atomic_load(&audioUnderruns), audioOverruns);
+    }
     printf("PC = 0x%04X\n", regs.pc);
+    if (inputLatencySamples != 0)
+        printf("average input latency: %.2f ms\n",
+          (double)totalInputLatency * 1000 / freq / inputLatencySamples);
     
     return 0;
 }
@@ -3,6 +3,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #define _WIN32_WINNT 0x0400
 #include <windows.h>
 #include <commctrl.h>
@@ -18,6 +19,7 @@
 #include "winrsrc.h"
 
 #define SAMPLE_RATE 8000
+#define FAST_FORWARD_DRAW_INTERVAL 4  // Draw one frame in this many while fast-forwarding
 
 enum
 {
@@ -140,23 +142,24 @@ static struct BITMAPINFO4COLOR bmpInfo =
         .biWidth = GB_DISPLAY_WIDTH,
         .biHeight = -GB_DISPLAY_HEIGHT,
         .biPlanes = 1,
-        .biBitCount = 8,
+        .biBitCount = 32,
         .biCompression = BI_RGB,
-        .biSizeImage = GB_DISPLAY_WIDTH * GB_DISPLAY_HEIGHT,
+        .biSizeImage = GB_DISPLAY_WIDTH * GB_DISPLAY_HEIGHT * 4,
         .biXPelsPerMeter = 0,
         .biYPelsPerMeter = 0,
-        .biClrUsed = 4,
-        .biClrImportant = 4,
+        .biClrUsed = 0,
+        .biClrImportant = 0,
     },
     .bmiColors = {{0}},
 };
-static uint8_t frameBufferPixels[GB_DISPLAY_WIDTH * GB_DISPLAY_HEIGHT];
+static uint32_t frameBufferPixels[GB_DISPLAY_WIDTH * GB_DISPLAY_HEIGHT];  // Drawn in by the emulator as XRGB
 //static HWAVEOUT hAudioDevice;
 static char currentDirectory[MAX_PATH];
 static char currentRomName[MAX_PATH];
 static bool isRomLoaded = false;
 static bool isRunning = false;
 static bool fastForward = false;
+static unsigned int fastForwardFrames;
 
 // Dialogs
 static HWND hKeyConfigDialog = NULL;
@@ -197,9 +200,10 @@ static char *get_error_text(DWORD errCode)
 }
 */
 
-uint8_t *platform_get_framebuffer(void)
+uint8_t *platform_get_framebuffer(size_t *pitch)
 {
-    return frameBufferPixels;
+    *pitch = GB_DISPLAY_WIDTH * sizeof(*frameBufferPixels);
+    return (uint8_t *)frameBufferPixels;
 }
 
 #define TEST_BUFFER_WIDTH (16 * 8)
@@ -232,25 +236,15 @@ void StretchDIBits_(HDC hdc, int XDest, int YDest, int nDestWidth, int nDestHeig
     StretchDIBits(hdc, XDest, YDest, nDestWidth, nDestHeight, XSrc, YSrc, nSrcWidth, nSrcHeight, lpBits, lpBitsInfo, iUsage, dwRop);
 }
 
-void platform_draw_done(void)
+void platform_draw_done(const struct FrameChanges *changes)
 {
     HDC hDC;
-    static uint32_t frameBuffer[GB_DISPLAY_WIDTH * GB_DISPLAY_HEIGHT];
-    const struct RGBColor *colors = palettes[gConfig.colorPalette].colors;
     
-    for (unsigned int i = 0; i < GB_DISPLAY_WIDTH * GB_DISPLAY_HEIGHT; i++)
-    {
-        uint8_t pixel = frameBufferPixels[i];
-        
-        frameBuffer[i] = colors[pixel].blue | (colors[pixel].green << 8) | (colors[pixel].red << 16);
-    }
+    if (changes->firstRow == changes->endRow)
+        return;  // WM_PAINT redraws it when needed
     hDC = GetDC(hWnd);
-    bmpInfo.bmiHeader.biBitCount = 32;
-    bmpInfo.bmiHeader.biCompression = BI_RGB;
-    bmpInfo.bmiHeader.biSizeImage = sizeof(frameBuffer);
-    bmpInfo.bmiHeader.biClrUsed = 0;
     StretchDIBits(hDC, 0, 0, gConfig.windowWidth, gConfig.windowHeight, 0, 0, GB_DISPLAY_WIDTH, GB_DISPLAY_HEIGHT,
-      frameBuffer, (BITMAPINFO *)&bmpInfo, DIB_RGB_COLORS, SRCCOPY);
+      frameBufferPixels, (BITMAPINFO *)&bmpInfo, DIB_RGB_COLORS, SRCCOPY);
     ReleaseDC(hWnd, hDC);
 }
 
@@ -304,6 +298,7 @@ static void set_palette(unsigned int newPaletteNum)
     if (newPaletteNum < ARRAY_COUNT(palettes))
     {
         const struct Palette *palette = &palettes[newPaletteNum];
+        uint8_t colors[4][3];
         
         CheckMenuItem(hMenuBar, CMD_VIEW_COLORS + gConfig.colorPalette, MF_UNCHECKED);
         CheckMenuItem(hMenuBar, CMD_VIEW_COLORS + newPaletteNum, MF_CHECKED);
@@ -311,13 +306,22 @@ static void set_palette(unsigned int newPaletteNum)
         config_save(CONFIG_FILE_NAME);
         for (unsigned int i = 0; i < 4; i++)
         {
-            bmpInfo.bmiColors[i].rgbRed = palette->colors[i].red;
-            bmpInfo.bmiColors[i].rgbGreen = palette->colors[i].green;
-            bmpInfo.bmiColors[i].rgbBlue = palette->colors[i].blue;
+            colors[i][0] = palette->colors[i].red;
+            colors[i][1] = palette->colors[i].green;
+            colors[i][2] = palette->colors[i].blue;
         }
+        gameboy_set_screen_format(PIXEL_FORMAT_XRGB8888, (const uint8_t (*)[3])colors);
     }
 }
 
+static void clear_screen(void)
+{
+    const struct RGBColor *color = &palettes[gConfig.colorPalette].colors[0];
+    
+    for (unsigned int i = 0; i < ARRAY_COUNT(frameBufferPixels); i++)
+        frameBufferPixels[i] = (color->red << 16) | (color->green << 8) | color->blue;
+}
+
 //------------------------------------------------------------------------------
 // ROM handling functions
 //------------------------------------------------------------------------------
@@ -342,7 +346,7 @@ static void try_load_rom(const char *filename)
 static void close_game(void)
 {
     gameboy_close_rom();
-    memset(frameBufferPixels, 0, sizeof(frameBufferPixels));
+    clear_screen();
     RedrawWindow(hWnd, NULL, NULL, RDW_ERASE | RDW_INVALIDATE);
     isRomLoaded = false;
     isRunning = false;
@@ -620,11 +624,8 @@ LRESULT CALLBACK wnd_proc(HWND hWnd, UINT msg, WPARAM wParam, LPARAM lParam)
             HDC hDC;
             
             hDC = BeginPaint(hWnd, &ps);
-            if (!isRunning)
-            {
-                StretchDIBits(hDC, 0, 0, gConfig.windowWidth, gConfig.windowHeight, 0, 0, GB_DISPLAY_WIDTH, GB_DISPLAY_HEIGHT,
-                  frameBufferPixels, (BITMAPINFO *)&bmpInfo, DIB_RGB_COLORS, SRCCOPY);
-            }
+            StretchDIBits(hDC, 0, 0, gConfig.windowWidth, gConfig.windowHeight, 0, 0, GB_DISPLAY_WIDTH, GB_DISPLAY_HEIGHT,
+              frameBufferPixels, (BITMAPINFO *)&bmpInfo, DIB_RGB_COLORS, SRCCOPY);
             EndPaint(hWnd, &ps);
         }
         break;
@@ -810,6 +811,12 @@ int main(int argc, char **argv)
     unsigned long newTicks;
     
     config_load("gbemu_cfg.txt");
+    gameboy_set_run_ahead(gConfig.runAheadFrames);
+    gameboy_set_save_flush_interval(gConfig.saveFlushInterval);
+    gameboy_set_deterministic_rtc(gConfig.rtcDeterministic);
+    gameboy_set_lazy_rom_loading(gConfig.lazyRomLoading);
+    gameboy_set_render_mode(gConfig.renderMode);
+    gameboy_set_renderer(gConfig.renderer);
     InitCommonControls();
     hInstance = GetModuleHandle(NULL);
     GetModuleFileName(hInstance, currentDirectory, sizeof(currentDirectory));
@@ -842,6 +849,7 @@ int main(int argc, char **argv)
     calc_client_diff();
     update_window_size();
     set_palette(gConfig.colorPalette);
+    clear_screen();
     
     /*
     wfex.wFormatTag = WAVE_FORMAT_PCM;
@@ -904,7 +912,11 @@ int main(int argc, char **argv)
                 if (!isRunning)
                     goto skip_frame;  // Hack: We don't want to run another frame after closing the ROM.
             }
-            gameboy_run_frame();
+            // Only some of the frames are drawn while fast-forwarding
+            if (fastForward && ++fastForwardFrames % FAST_FORWARD_DRAW_INTERVAL != 0)
+                gameboy_skip_frame();
+            else
+                gameboy_run_frame();
             if (!fastForward)
             {
                 newTicks = timeGetTime();
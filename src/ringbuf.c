@@ -0,0 +1,70 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "global.h"
+#include "ringbuf.h"
+
+bool ringbuf_init(struct RingBuffer *rb, size_t size)
+{
+    assert(size != 0 && (size & (size - 1)) == 0);
+    rb->data = malloc(size);
+    rb->size = size;
+    atomic_init(&rb->readPos, 0);
+    atomic_init(&rb->writePos, 0);
+    return rb->data != NULL;
+}
+
+void ringbuf_destroy(struct RingBuffer *rb)
+{
+    free(rb->data);
+    rb->data = NULL;
+}
+
+// Returns the number of bytes waiting to be read. This is exact when called
+// from either thread, but may be stale by the time it's used on the other.
+size_t ringbuf_used(struct RingBuffer *rb)
+{
+    return atomic_load_explicit(&rb->writePos, memory_order_acquire)
+      - atomic_load_explicit(&rb->readPos, memory_order_acquire);
+}
+
+// Copies as much of src as fits and returns the number of bytes written. Only
+// the producer thread may call this.
+size_t ringbuf_write(struct RingBuffer *rb, const void *src, size_t len)
+{
+    size_t writePos = atomic_load_explicit(&rb->writePos, memory_order_relaxed);
+    size_t readPos = atomic_load_explicit(&rb->readPos, memory_order_acquire);
+    size_t offset = writePos & (rb->size - 1);
+    size_t firstPart;
+    
+    len = MIN(len, rb->size - (writePos - readPos));
+    firstPart = MIN(len, rb->size - offset);
+    memcpy(rb->data + offset, src, firstPart);
+    memcpy(rb->data, (const uint8_t *)src + firstPart, len - firstPart);
+    
+    // Publish the data only after it has been copied in
+    atomic_store_explicit(&rb->writePos, writePos + len, memory_order_release);
+    return len;
+}
+
+// Copies up to len bytes into dst and returns the number of bytes read. Only
+// the consumer thread may call this.
+size_t ringbuf_read(struct RingBuffer *rb, void *dst, size_t len)
+{
+    size_t readPos = atomic_load_explicit(&rb->readPos, memory_order_relaxed);
+    size_t writePos = atomic_load_explicit(&rb->writePos, memory_order_acquire);
+    size_t offset = readPos & (rb->size - 1);
+    size_t firstPart;
+    
+    len = MIN(len, writePos - readPos);
+    firstPart = MIN(len, rb->size - offset);
+    memcpy(dst, rb->data + offset, firstPart);
+    memcpy((uint8_t *)dst + firstPart, rb->data, len - firstPart);
+    
+    // Let the producer reuse the space only after the data has been copied out
+    atomic_store_explicit(&rb->readPos, readPos + len, memory_order_release);
+    return len;
+}
@@ -0,0 +1,23 @@
+#ifndef GUARD_RINGBUF_H
+#define GUARD_RINGBUF_H
+
+#include <stdatomic.h>
+
+// A lock-free ring buffer for passing data from one producer thread to one
+// consumer thread. The read and write positions count up forever and are
+// masked when indexing, so the size must be a power of two.
+struct RingBuffer
+{
+    uint8_t *data;
+    size_t size;
+    atomic_size_t readPos;   // Only written by the consumer
+    atomic_size_t writePos;  // Only written by the producer
+};
+
+bool ringbuf_init(struct RingBuffer *rb, size_t size);
+void ringbuf_destroy(struct RingBuffer *rb);
+size_t ringbuf_used(struct RingBuffer *rb);
+size_t ringbuf_write(struct RingBuffer *rb, const void *src, size_t len);
+size_t ringbuf_read(struct RingBuffer *rb, void *dst, size_t len);
+
+#endif  // GUARD_RINGBUF_H
@@ -0,0 +1,470 @@
+#ifndef _WIN32
+#define _DEFAULT_SOURCE  // For mmap() and MAP_ANONYMOUS under -std=c11
+#define USE_MMAP
+#endif
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef USE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#if !defined(__STDC_NO_THREADS__) && defined(__has_include)
+#if __has_include(<threads.h>)
+#define SAVERAM_WRITER_THREAD
+#include <threads.h>
+#endif
+#endif
+
+#include "global.h"
+#include "ringbuf.h"
+#include "saveram.h"
+#include "platform/platform.h"
+
+// Granularity of dirty tracking when the save file isn't mapped
+#define DIRTY_PAGE_SIZE 0x100
+
+#define MAX_TRAILER_SIZE 64
+
+static bool isOpen;
+static uint8_t *ram;          // NULL if the cartridge has no RAM
+static size_t ramSize;        // Number of bytes stored in the save file
+static size_t ramAllocSize;   // Number of bytes allocated, at least ramSize
+static bool ramMapped;        // ram is a shared mapping of the save file
+#ifdef USE_MMAP
+static int saveFd = -1;       // Only used when the save file is mapped
+#endif
+static FILE *saveFile;        // Only used when the save file isn't mapped
+static uint8_t *savedRam;     // What the save file contains, when not mapped
+
+// Extra data stored after the RAM in the save file, like the MBC3 clock
+static size_t trailerSize;
+static void (*trailerCallback)(uint8_t *buffer);
+
+static unsigned int flushInterval = 300;
+static unsigned int framesSinceFlush;
+static bool flushRequested;
+
+#ifdef USE_MMAP
+// Maps the save file into memory. Writes to cartridge RAM then land directly
+// in the page cache, so they survive the emulator crashing or being killed,
+// and the kernel writes them back to disk on its own schedule. The file is
+// mapped over an anonymous mapping of allocSize bytes, which covers banks
+// that the header says the cartridge doesn't have.
+static bool map_save_file(const char *filename)
+{
+    int fd = open(filename, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    uint8_t *base;
+    
+    if (fd < 0)
+        return false;
+    if (fstat(fd, &st) != 0 || (st.st_size < (off_t)ramSize && ftruncate(fd, ramSize) != 0))
+    {
+        close(fd);
+        return false;
+    }
+    if (ramAllocSize == 0)
+        base = NULL;
+    else
+    {
+        base = mmap(NULL, ramAllocSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED)
+        {
+            close(fd);
+            return false;
+        }
+        if (ramSize != 0
+         && mmap(base, ramSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+        {
+            munmap(base, ramAllocSize);
+            close(fd);
+            return false;
+        }
+    }
+    saveFd = fd;  // Kept open for the trailer
+    ram = base;
+    ramMapped = true;
+    return true;
+}
+#endif
+
+// Reads the save file into an allocated buffer and keeps a copy of what was
+// read, so that a flush can find the pages that changed since without having
+// to trap every write to cartridge RAM.
+static bool read_save_file(const char *filename)
+{
+    saveFile = fopen(filename, "r+b");
+    if (saveFile == NULL)
+        saveFile = fopen(filename, "w+b");  // Try to create it
+    if (saveFile == NULL)
+        return false;
+    ram = (ramAllocSize != 0) ? calloc(ramAllocSize, 1) : NULL;
+    savedRam = calloc(ramSize + 1, 1);
+    if ((ram == NULL && ramAllocSize != 0) || savedRam == NULL)
+        platform_fatal_error("Failed to allocate memory for cartridge RAM");
+    if (ramSize != 0)
+    {
+        fread(ram, 1, ramSize, saveFile);
+        memcpy(savedRam, ram, ramSize);
+    }
+    ramMapped = false;
+    return true;
+}
+
+static bool page_is_dirty(size_t offset)
+{
+    return memcmp(ram + offset, savedRam + offset, MIN(DIRTY_PAGE_SIZE, ramSize - offset)) != 0;
+}
+
+static void write_save_data(size_t offset, const uint8_t *data, size_t size)
+{
+#ifdef USE_MMAP
+    if (ramMapped)
+    {
+        if (pwrite(saveFd, data, size, offset) != (ssize_t)size)
+            dbg_puts("saveram: failed to write save file");
+        return;
+    }
+#endif
+    if (fseek(saveFile, offset, SEEK_SET) != 0 || fwrite(data, 1, size, saveFile) != size)
+        dbg_puts("saveram: failed to write save file");
+}
+
+// Has the OS start writing what it was given to the disk, without waiting
+static void sync_save_file(void)
+{
+#ifdef USE_MMAP
+    if (ramMapped)
+    {
+        if (ramSize != 0)
+            msync(ram, ramSize, MS_ASYNC);
+        return;
+    }
+#endif
+    fflush(saveFile);
+}
+
+//------------------------------------------------------------------------------
+// Writer thread
+//------------------------------------------------------------------------------
+
+// Flushes don't make file system calls themselves. They queue what is to be
+// written on a ring buffer, and a thread of its own writes it out, so the
+// emulation thread never waits on the file. Dirty pages that don't fit in the
+// queue are left for the next flush: they're found by comparing with
+// savedRam, which is only updated for what was queued. Closing the save file
+// waits for the queue to empty. Builds without C11 threads write in place.
+
+#define SAVE_QUEUE_SIZE 0x40000  // Room for all of the largest cartridge RAM
+
+enum
+{
+    SAVE_CMD_WRITE,  // Followed by size bytes to write at offset
+    SAVE_CMD_SYNC,
+};
+
+struct SaveCommand
+{
+    uint32_t type;
+    uint32_t offset;
+    uint32_t size;
+};
+
+static uint8_t *saveCommandBuffer;  // Only used by the emulation thread
+
+#ifdef SAVERAM_WRITER_THREAD
+
+static thrd_t writerThread;
+static mtx_t writerMutex;
+static cnd_t writerWorkCond;   // Signaled when there are commands
+static cnd_t writerIdleCond;   // Signaled when the writer thread runs out of them
+static bool writerThreadIdle;  // Guarded by writerMutex
+static bool writerThreadQuit;  // Guarded by writerMutex
+static struct RingBuffer writerQueue;
+static uint8_t *writerDataBuffer;  // Only used by the writer thread
+
+static void run_save_commands(void)
+{
+    struct SaveCommand cmd;
+    
+    // Commands are sent in one write each, so the data after one is all there
+    while (ringbuf_read(&writerQueue, &cmd, sizeof(cmd)) == sizeof(cmd))
+    {
+        switch (cmd.type)
+        {
+          case SAVE_CMD_WRITE:
+            ringbuf_read(&writerQueue, writerDataBuffer, cmd.size);
+            write_save_data(cmd.offset, writerDataBuffer, cmd.size);
+            break;
+          case SAVE_CMD_SYNC:
+            sync_save_file();
+            break;
+        }
+    }
+}
+
+static int writer_thread_main(void *arg)
+{
+    (void)arg;
+    mtx_lock(&writerMutex);
+    while (!writerThreadQuit)
+    {
+        if (ringbuf_used(&writerQueue) == 0)
+        {
+            writerThreadIdle = true;
+            cnd_broadcast(&writerIdleCond);
+            cnd_wait(&writerWorkCond, &writerMutex);
+            writerThreadIdle = false;
+            continue;
+        }
+        mtx_unlock(&writerMutex);
+        run_save_commands();
+        mtx_lock(&writerMutex);
+    }
+    mtx_unlock(&writerMutex);
+    return 0;
+}
+
+static void wake_save_writer(void)
+{
+    mtx_lock(&writerMutex);
+    cnd_signal(&writerWorkCond);
+    mtx_unlock(&writerMutex);
+}
+
+// Waits until the writer thread has carried out every command sent to it
+static void wait_for_save_writer(void)
+{
+    mtx_lock(&writerMutex);
+    cnd_signal(&writerWorkCond);
+    while (!writerThreadIdle || ringbuf_used(&writerQueue) != 0)
+        cnd_wait(&writerIdleCond, &writerMutex);
+    mtx_unlock(&writerMutex);
+}
+
+// Queues a command along with size bytes of data. Returns false, without
+// queueing anything, if there isn't room for it.
+static bool send_save_command(unsigned int type, size_t offset, const uint8_t *data, size_t size)
+{
+    struct SaveCommand cmd = {type, offset, size};
+    
+    if (SAVE_QUEUE_SIZE - ringbuf_used(&writerQueue) < sizeof(cmd) + size)
+        return false;
+    memcpy(saveCommandBuffer, &cmd, sizeof(cmd));
+    if (size != 0)
+        memcpy(saveCommandBuffer + sizeof(cmd), data, size);
+    ringbuf_write(&writerQueue, saveCommandBuffer, sizeof(cmd) + size);
+    return true;
+}
+
+static void start_save_writer(size_t maxDataSize)
+{
+    writerDataBuffer = malloc(maxDataSize);
+    if (writerDataBuffer == NULL
+     || !ringbuf_init(&writerQueue, SAVE_QUEUE_SIZE)
+     || mtx_init(&writerMutex, mtx_plain) != thrd_success
+     || cnd_init(&writerWorkCond) != thrd_success
+     || cnd_init(&writerIdleCond) != thrd_success)
+        platform_fatal_error("Failed to start the save file writer");
+    writerThreadIdle = false;
+    writerThreadQuit = false;
+    if (thrd_create(&writerThread, writer_thread_main, NULL) != thrd_success)
+        platform_fatal_error("Failed to start the save file writer");
+}
+
+static void stop_save_writer(void)
+{
+    wait_for_save_writer();
+    mtx_lock(&writerMutex);
+    writerThreadQuit = true;
+    cnd_signal(&writerWorkCond);
+    mtx_unlock(&writerMutex);
+    thrd_join(writerThread, NULL);
+    cnd_destroy(&writerIdleCond);
+    cnd_destroy(&writerWorkCond);
+    mtx_destroy(&writerMutex);
+    ringbuf_destroy(&writerQueue);
+    free(writerDataBuffer);
+    writerDataBuffer = NULL;
+}
+
+#else
+
+static void wake_save_writer(void)
+{
+}
+
+static void wait_for_save_writer(void)
+{
+}
+
+static bool send_save_command(unsigned int type, size_t offset, const uint8_t *data, size_t size)
+{
+    if (type == SAVE_CMD_SYNC)
+        sync_save_file();
+    else
+        write_save_data(offset, data, size);
+    return true;
+}
+
+static void start_save_writer(size_t maxDataSize)
+{
+    (void)maxDataSize;
+}
+
+static void stop_save_writer(void)
+{
+}
+
+#endif  // SAVERAM_WRITER_THREAD
+
+// Queues the changes made since the last flush to be written to the save
+// file. A mapped file only needs the trailer written and its write-back
+// started; otherwise the dirty pages are written too.
+static void flush_save_file(void)
+{
+    size_t offset = 0;
+    
+    framesSinceFlush = 0;
+    flushRequested = false;
+    if (trailerCallback != NULL)
+    {
+        uint8_t buffer[MAX_TRAILER_SIZE];
+        
+        trailerCallback(buffer);
+        send_save_command(SAVE_CMD_WRITE, ramSize, buffer, trailerSize);
+    }
+    while (!ramMapped && offset < ramSize)
+    {
+        size_t start;
+        
+        // Write out each run of consecutive dirty pages with a single call
+        while (offset < ramSize && !page_is_dirty(offset))
+            offset += DIRTY_PAGE_SIZE;
+        start = offset;
+        while (offset < ramSize && page_is_dirty(offset))
+            offset += DIRTY_PAGE_SIZE;
+        offset = MIN(offset, ramSize);
+        if (start == offset)
+            break;
+        if (!send_save_command(SAVE_CMD_WRITE, start, ram + start, offset - start))
+            break;  // The rest stays dirty until the next flush
+        memcpy(savedRam + start, ram + start, offset - start);
+    }
+    send_save_command(SAVE_CMD_SYNC, 0, NULL, 0);
+    wake_save_writer();
+}
+
+// Opens the save file and returns a buffer of allocSize bytes for the
+// cartridge RAM, of which the first size bytes are backed by the file.
+uint8_t *saveram_open(const char *filename, size_t size, size_t allocSize)
+{
+    saveram_close();
+    ramSize = size;
+    ramAllocSize = allocSize;
+    framesSinceFlush = 0;
+    flushRequested = false;
+    dbg_printf("saveram: loading save file from '%s'\n", filename);
+    assert(size + MAX_TRAILER_SIZE <= SAVE_QUEUE_SIZE / 2);
+    saveCommandBuffer = malloc(sizeof(struct SaveCommand) + MAX(size, MAX_TRAILER_SIZE));
+    if (saveCommandBuffer == NULL)
+        platform_fatal_error("Failed to allocate memory for cartridge RAM");
+    isOpen = true;
+#ifdef USE_MMAP
+    if (!map_save_file(filename))
+#endif
+    {
+        if (!read_save_file(filename))
+            platform_fatal_error("Failed to load save file '%s'", filename);
+    }
+    start_save_writer(MAX(size, MAX_TRAILER_SIZE));
+    return ram;
+}
+
+void saveram_close(void)
+{
+    if (!isOpen)
+        return;
+    // With the queue empty, everything that is left fits in it
+    wait_for_save_writer();
+    flush_save_file();
+    stop_save_writer();
+    free(saveCommandBuffer);
+    saveCommandBuffer = NULL;
+#ifdef USE_MMAP
+    if (ramMapped)
+    {
+        if (ram != NULL)
+            munmap(ram, ramAllocSize);
+        close(saveFd);
+        saveFd = -1;
+    }
+    else
+#endif
+    {
+        fclose(saveFile);
+        free(ram);
+        free(savedRam);
+        saveFile = NULL;
+        savedRam = NULL;
+    }
+    ram = NULL;
+    trailerCallback = NULL;
+    isOpen = false;
+}
+
+// Reads up to size bytes stored after the RAM, and returns how many there were
+size_t saveram_read_trailer(uint8_t *buffer, size_t size)
+{
+    wait_for_save_writer();  // The file is the writer thread's while it runs
+#ifdef USE_MMAP
+    if (ramMapped)
+    {
+        ssize_t count = pread(saveFd, buffer, size, ramSize);
+        
+        return (count > 0) ? count : 0;
+    }
+#endif
+    if (fseek(saveFile, ramSize, SEEK_SET) != 0)
+        return 0;
+    return fread(buffer, 1, size, saveFile);
+}
+
+// Has size bytes from callback stored after the RAM whenever the save file is
+// flushed
+void saveram_set_trailer(size_t size, void (*callback)(uint8_t *buffer))
+{
+    assert(size <= MAX_TRAILER_SIZE);
+    trailerSize = size;
+    trailerCallback = callback;
+}
+
+// Sets how many frames may pass between flushes. 0 only flushes on request
+// and when the save file is closed.
+void saveram_set_flush_interval(unsigned int frames)
+{
+    flushInterval = frames;
+}
+
+// Flushes at the end of the current frame. Games disable cartridge RAM once
+// they are done saving, which makes that the best time to do it.
+void saveram_request_flush(void)
+{
+    flushRequested = true;
+}
+
+void saveram_end_frame(void)
+{
+    if (!isOpen)
+        return;
+    framesSinceFlush++;
+    if (flushRequested || (flushInterval != 0 && framesSinceFlush >= flushInterval))
+        flush_save_file();
+}
@@ -0,0 +1,14 @@
+#ifndef GUARD_SAVERAM_H
+#define GUARD_SAVERAM_H
+
+// Battery-backed cartridge RAM, kept in sync with a .sav file while the game
+// runs instead of only being written out when the ROM is closed.
+uint8_t *saveram_open(const char *filename, size_t size, size_t allocSize);
+void saveram_close(void);
+size_t saveram_read_trailer(uint8_t *buffer, size_t size);
+void saveram_set_trailer(size_t size, void (*callback)(uint8_t *buffer));
+void saveram_set_flush_interval(unsigned int frames);
+void saveram_request_flush(void);
+void saveram_end_frame(void);
+
+#endif  // GUARD_SAVERAM_H